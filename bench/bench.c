@@ -0,0 +1,545 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "corpus.h"
+#include "../src/png/png.h"
+#include "../src/png/png_map.h"
+#include "../src/png/png_filter.h"
+#include "../src/png/png_write.h"
+#include "../src/png/inflate.h"
+#include "../src/png/deflate.h"
+#include "../src/png/adler32.h"
+#include "../src/crc/crc.h"
+#include "../src/log.h"
+
+int g_log_level = LOG_ERROR;
+
+#define BENCH_MAX_SIZES 16
+
+struct bench_options {
+    uint32_t sizes[BENCH_MAX_SIZES];
+    int nsizes;
+    int kinds[CORPUS_KINDS];  // 1 = benchmark this kind
+    int warmup;
+    int reps;
+    int level;                // deflate / write compression level
+    int json;
+    int generate_only;
+    const char *dir;          // corpus directory
+};
+
+/*
+ * One corpus image and everything its stages work on. Setup runs the
+ * pipeline once, so each stage can be timed alone on real input: inflate
+ * on the file's own zlib stream, unfilter on its own filtered rows, and
+ * the encoder stages on the decoded pixels.
+ */
+struct bench_case {
+    const char *kind;
+    char path[4096];
+    char write_path[4096];
+    uint32_t width, height;
+
+    uint8_t *file;            // whole file in memory
+    size_t file_size;
+    struct png_map map;
+    struct png_arena arena;   // chunk views for the parse stage
+
+    uint8_t *zlib;            // IDAT payloads joined
+    size_t zlib_size;
+    struct inflateState inflate;
+
+    uint8_t *filtered;        // inflated scanlines with filter bytes
+    size_t filtered_size;
+    int filtered_bpp;
+    size_t row_bytes;         // unfiltered bytes per row
+    uint8_t *unfiltered;
+
+    struct png_decoder decoder;
+    struct png_image image;   // header and expanded palette for convert
+    enum png_format format;
+    int bpp;
+    uint8_t *pixels;          // decoded output, input of the encoder stages
+
+    struct png_image encode;  // the pixels as png_filterImage sees them
+    struct png_writeOptions write_options;
+    uint8_t *refiltered;
+    size_t refiltered_size;
+    uint8_t *compressed;
+    size_t compressed_cap;
+};
+
+// Results go through here so no stage can be optimised away
+static volatile uint32_t bench_sink;
+
+static double bench_nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_parse(struct bench_case *c) {
+    struct png_chunkView *views;
+    png_arenaReset(&c->arena);
+    int count = png_mapChunks(&c->map, &c->arena, &views);
+    bench_sink += count;
+    return count > 0 ? 0 : -1;
+}
+
+static int bench_crc(struct bench_case *c) {
+    bench_sink += update_crc(0xffffffffL, c->file, c->file_size);
+    return 0;
+}
+
+static int bench_inflate(struct bench_case *c) {
+    size_t pos = 0;
+    inflate_init(&c->inflate, c->zlib + 2, c->zlib_size - 2, 1);
+    int res = inflate_run(&c->inflate, c->filtered, &pos, c->filtered_size);
+    return res == INFLATE_STREAM_END && pos == c->filtered_size ? 0 : -1;
+}
+
+static int bench_adler32(struct bench_case *c) {
+    bench_sink += adler32_update(1, c->filtered, c->filtered_size);
+    return 0;
+}
+
+static int bench_unfilter(struct bench_case *c) {
+    uint8_t *prev = c->unfiltered + c->row_bytes * c->height; // zero row past the image
+    for (uint32_t y = 0; y < c->height; y++) {
+        const uint8_t *raw = c->filtered + y * (c->row_bytes + 1);
+        uint8_t *dst = c->unfiltered + y * c->row_bytes;
+        if (png_unfilterRow(raw[0], dst, prev, raw + 1, c->row_bytes, c->filtered_bpp) != 0) {
+            return -1;
+        }
+        prev = dst;
+    }
+    return 0;
+}
+
+static int bench_convert(struct bench_case *c) {
+    size_t stride = (size_t)c->width * c->bpp;
+    for (uint32_t y = 0; y < c->height; y++) {
+        png_convertRow(&c->image, c->unfiltered + y * c->row_bytes, c->pixels + y * stride,
+                       c->width, c->format);
+    }
+    return 0;
+}
+
+static int bench_decode(struct bench_case *c) {
+    struct png_info info;
+    if (png_readHeader(&c->decoder, c->path, &info) != 1) {
+        return -1;
+    }
+    return png_decodeInto(&c->decoder, c->pixels, (size_t)c->width * c->bpp, c->format) == 1
+               ? 0 : -1;
+}
+
+static int bench_filter(struct bench_case *c) {
+    return png_filterImage(&c->encode, c->refiltered, &c->write_options);
+}
+
+static int bench_deflate(struct bench_case *c) {
+    struct bitStream bs;
+    bitstream_init(&bs, c->compressed, c->compressed_cap);
+    if (deflate_compress(c->refiltered, c->refiltered_size, c->write_options.level, &bs) != 0) {
+        return -1;
+    }
+    bitstream_flush(&bs);
+    bench_sink += bitstream_get_size(&bs);
+    return 0;
+}
+
+static int bench_write(struct bench_case *c) {
+    return png_save(c->write_path, c->pixels, c->width, c->height, c->bpp,
+                    &c->write_options) == 1 ? 0 : -1;
+}
+
+struct bench_stage {
+    const char *name;
+    int (*run)(struct bench_case *c);
+    const char *bytes;  // which size the MB/s figure is relative to
+};
+
+static const struct bench_stage bench_stages[] = {
+    {"parse", bench_parse, "file"},
+    {"crc", bench_crc, "file"},
+    {"inflate", bench_inflate, "filtered"},
+    {"adler32", bench_adler32, "filtered"},
+    {"unfilter", bench_unfilter, "filtered"},
+    {"convert", bench_convert, "pixels"},
+    {"decode", bench_decode, "pixels"},
+    {"filter", bench_filter, "pixels"},
+    {"deflate", bench_deflate, "filtered"},
+    {"write", bench_write, "pixels"},
+};
+
+static size_t bench_stageBytes(const struct bench_case *c, const char *bytes) {
+    if (strcmp(bytes, "file") == 0) {
+        return c->file_size;
+    }
+    if (strcmp(bytes, "filtered") == 0) {
+        return c->filtered_size;
+    }
+    return (size_t)c->width * c->height * c->bpp;
+}
+
+static int bench_loadFile(struct bench_case *c) {
+    FILE *fptr = fopen(c->path, "rb");
+    if (fptr == NULL) {
+        LOGE("Failed to open file %s\n", c->path);
+        return -1;
+    }
+    fseek(fptr, 0, SEEK_END);
+    long size = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+    c->file = size > 0 ? malloc(size) : NULL;
+    if (c->file == NULL || fread(c->file, 1, size, fptr) != (size_t)size) {
+        LOGE("Failed to read file %s\n", c->path);
+        fclose(fptr);
+        return -1;
+    }
+    fclose(fptr);
+    c->file_size = size;
+    c->map.data = c->file;
+    c->map.size = c->file_size;
+    c->map.mapped = 0;
+    return 1;
+}
+
+// Join the IDAT payloads, the stream the inflate stage decodes
+static int bench_joinIDAT(struct bench_case *c) {
+    struct png_chunkView *views;
+    int count = png_mapChunks(&c->map, &c->arena, &views);
+    if (count <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (memcmp(views[i].chunkType, "IDAT", 4) == 0) {
+            c->zlib_size += views[i].length;
+        }
+    }
+    if (c->zlib_size < 2 || (c->zlib = malloc(c->zlib_size)) == NULL) {
+        return -1;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        if (memcmp(views[i].chunkType, "IDAT", 4) == 0) {
+            memcpy(c->zlib + pos, c->file + views[i].offset, views[i].length);
+            pos += views[i].length;
+        }
+    }
+    return 1;
+}
+
+static int bench_setup(struct bench_case *c, const struct bench_options *options) {
+    png_arenaInit(&c->arena, NULL);
+    png_decoderInit(&c->decoder, NULL);
+    if (bench_loadFile(c) != 1 || bench_joinIDAT(c) != 1) {
+        return -1;
+    }
+
+    struct png_info info;
+    if (png_readHeader(&c->decoder, c->path, &info) != 1) {
+        return -1;
+    }
+    c->width = info.width;
+    c->height = info.height;
+    c->format = info.format;
+    c->bpp = png_formatBpp(info.format);
+    c->image = c->decoder.image;
+    if (c->image.ihdr.colorType == 3) {
+        png_expandPalette(&c->image, c->format);
+    }
+    c->filtered_bpp = png_filteredBpp(&c->image.ihdr);
+    c->row_bytes = png_rowBytes(&c->image.ihdr);
+    size_t pixel_size, unfiltered_size;
+    if (png_mulSize(c->row_bytes + 1, c->height, &c->filtered_size) != 0 ||
+        png_mulSize(c->row_bytes, (size_t)c->height + 1, &unfiltered_size) != 0 ||
+        png_mulSize((size_t)c->width * c->bpp, c->height, &pixel_size) != 0) {
+        LOGE("%s is too big\n", c->path);
+        return -1;
+    }
+    c->filtered = malloc(c->filtered_size);
+    c->unfiltered = calloc(unfiltered_size, 1);
+    c->pixels = malloc(pixel_size);
+    if (c->filtered == NULL || c->unfiltered == NULL || c->pixels == NULL) {
+        LOGE("Failed to allocate buffers for %s\n", c->path);
+        return -1;
+    }
+    if (png_decodeInto(&c->decoder, c->pixels, (size_t)c->width * c->bpp, c->format) != 1 ||
+        bench_inflate(c) != 0) {
+        LOGE("Failed to decode %s\n", c->path);
+        return -1;
+    }
+
+    // png_save picks the colour type from bpp the same way
+    static const uint8_t color_types[5] = {0, 0, 4, 2, 6};
+    c->encode.ihdr.width = c->width;
+    c->encode.ihdr.height = c->height;
+    c->encode.ihdr.bitDepth = 8;
+    c->encode.ihdr.colorType = color_types[c->bpp];
+    c->encode.pixels = c->pixels;
+    c->encode.pixel_size = pixel_size;
+    c->write_options.level = options->level;
+    c->write_options.threads = 1;
+    c->write_options.filter = PNG_FILTER_ADAPTIVE;
+
+    // No overflow, it is pixel_size plus one byte per row
+    c->refiltered_size = ((size_t)c->width * c->bpp + 1) * c->height;
+    c->compressed_cap = deflate_bound(c->refiltered_size);
+    c->refiltered = malloc(c->refiltered_size);
+    c->compressed = malloc(c->compressed_cap);
+    if (c->refiltered == NULL || c->compressed == NULL || bench_filter(c) != 0) {
+        LOGE("Failed to set up the encoder stages for %s\n", c->path);
+        return -1;
+    }
+    snprintf(c->write_path, sizeof(c->write_path), "%s/write.png", options->dir);
+    return 1;
+}
+
+static void bench_release(struct bench_case *c) {
+    png_decoderRelease(&c->decoder);
+    png_arenaRelease(&c->arena);
+    free(c->file);
+    free(c->zlib);
+    free(c->filtered);
+    free(c->unfiltered);
+    free(c->pixels);
+    free(c->refiltered);
+    free(c->compressed);
+}
+
+static int bench_compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double bench_percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+static void bench_printResult(const struct bench_case *c, const struct bench_stage *stage,
+                              size_t bytes, int reps, double median, double p99,
+                              const struct bench_options *options, int *first) {
+    double pixels = (double)c->width * c->height;
+    double mbs = median > 0 ? bytes / (median / 1e9) / 1e6 : 0;
+    double ns_px = median / pixels;
+    const char *name = strrchr(c->path, '/');
+    name = name ? name + 1 : c->path;
+
+    if (options->json) {
+        printf("%s\n  {\"image\": \"%s\", \"kind\": \"%s\", \"width\": %u, \"height\": %u, "
+               "\"stage\": \"%s\", \"bytes\": %zu, \"reps\": %d, \"median_ms\": %.6f, "
+               "\"p99_ms\": %.6f, \"mb_s\": %.3f, \"ns_px\": %.4f}",
+               *first ? "" : ",", name, c->kind, c->width, c->height, stage->name, bytes,
+               reps, median / 1e6, p99 / 1e6, mbs, ns_px);
+    } else {
+        printf("%s,%s,%u,%u,%s,%zu,%d,%.6f,%.6f,%.3f,%.4f\n", name, c->kind, c->width,
+               c->height, stage->name, bytes, reps, median / 1e6, p99 / 1e6, mbs, ns_px);
+    }
+    *first = 0;
+    fflush(stdout);
+}
+
+static int bench_runCase(struct bench_case *c, const struct bench_options *options, int *first) {
+    double samples[options->reps];
+    int failed = 0;
+
+    for (size_t s = 0; s < sizeof(bench_stages) / sizeof(bench_stages[0]); s++) {
+        const struct bench_stage *stage = &bench_stages[s];
+        int ok = 1;
+        for (int i = 0; i < options->warmup && ok; i++) {
+            ok = stage->run(c) == 0;
+        }
+        for (int i = 0; i < options->reps && ok; i++) {
+            double start = bench_nowNs();
+            ok = stage->run(c) == 0;
+            samples[i] = bench_nowNs() - start;
+        }
+        if (!ok) {
+            LOGE("%s: stage %s failed\n", c->path, stage->name);
+            failed = 1;
+            continue;
+        }
+
+        qsort(samples, options->reps, sizeof(double), bench_compareDouble);
+        double median = options->reps % 2 ? samples[options->reps / 2]
+                            : (samples[options->reps / 2 - 1] + samples[options->reps / 2]) / 2;
+        bench_printResult(c, stage, bench_stageBytes(c, stage->bytes), options->reps, median,
+                          bench_percentile(samples, options->reps, 0.99), options, first);
+    }
+    return failed ? -1 : 1;
+}
+
+// Generate the corpus file unless an earlier run left it there
+static int bench_corpusFile(const struct bench_options *options, int kind, uint32_t size,
+                            char *path, size_t len) {
+    snprintf(path, len, "%s/%s_%ux%u.png", options->dir, corpus_kindName(kind), size, size);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    fprintf(stderr, "Generating %s\n", path);
+    return corpus_write(path, kind, size, size, size * CORPUS_KINDS + kind + 1);
+}
+
+static int bench_parseSizes(struct bench_options *options, const char *list) {
+    options->nsizes = 0;
+    while (*list) {
+        char *end;
+        unsigned long size = strtoul(list, &end, 10);
+        if (end == list || size == 0 || size > 65535 || options->nsizes == BENCH_MAX_SIZES) {
+            return -1;
+        }
+        options->sizes[options->nsizes++] = size;
+        list = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return options->nsizes > 0 ? 1 : -1;
+}
+
+static int bench_parseKinds(struct bench_options *options, const char *list) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    memset(options->kinds, 0, sizeof(options->kinds));
+    for (char *name = strtok(buf, ","); name; name = strtok(NULL, ",")) {
+        int kind = corpus_kindFromName(name);
+        if (kind < 0) {
+            return -1;
+        }
+        options->kinds[kind] = 1;
+    }
+    return 1;
+}
+
+static void bench_usage(void) {
+    printf("Usage: ./pngbench [OPTIONS]\n\n");
+    printf("Generates a synthetic corpus and times every codec stage on each image,\n");
+    printf("one result per image and stage as CSV (default) or JSON on stdout.\n\n");
+    printf("Options:\n");
+    printf("  --sizes=N,...\tSquare image sizes (default 16,256,1024,2048, up to 16384)\n");
+    printf("  --kinds=K,...\tgradient, noise, flat, palette, stored (default all)\n");
+    printf("  --warmup=N\tUntimed runs before each stage (default 1)\n");
+    printf("  --reps=N\tTimed runs per stage, median and p99 over these (default 10)\n");
+    printf("  --level=0-9\tCompression level of the deflate and write stages (default %d)\n",
+           DEFLATE_DEFAULT_LEVEL);
+    printf("  --dir=DIR\tCorpus directory, created if missing (default bench_corpus)\n");
+    printf("  --generate\tOnly write the corpus\n");
+    printf("  --json\tJSON instead of CSV\n");
+    printf("  -h, --help\tShow this help message and exit\n\n");
+    printf("Stages: parse and crc run over the file, inflate, adler32, unfilter and\n");
+    printf("deflate over the filtered scanlines, convert, decode, filter and write\n");
+    printf("over the decoded pixels. decode is the whole png_decodeInto path, write\n");
+    printf("the whole png_save path including the file.\n");
+}
+
+int main(int argc, char **argv) {
+    struct bench_options options = {
+        .nsizes = 4,
+        .sizes = {16, 256, 1024, 2048},
+        .kinds = {1, 1, 1, 1, 1},
+        .warmup = 1,
+        .reps = 10,
+        .level = DEFLATE_DEFAULT_LEVEL,
+        .dir = "bench_corpus",
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            bench_usage();
+            return 0;
+        } else if (strncmp(argv[i], "--sizes=", 8) == 0) {
+            if (bench_parseSizes(&options, argv[i] + 8) != 1) {
+                fprintf(stderr, "Invalid sizes: %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--kinds=", 8) == 0) {
+            if (bench_parseKinds(&options, argv[i] + 8) != 1) {
+                fprintf(stderr, "Invalid kinds: %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            options.warmup = atoi(argv[i] + 9);
+            if (options.warmup < 0) {
+                fprintf(stderr, "Invalid warmup count: %d\n", options.warmup);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--reps=", 7) == 0) {
+            options.reps = atoi(argv[i] + 7);
+            if (options.reps < 1) {
+                fprintf(stderr, "Invalid repetition count: %d\n", options.reps);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--level=", 8) == 0) {
+            options.level = atoi(argv[i] + 8);
+            if (options.level < 0 || options.level > DEFLATE_MAX_LEVEL) {
+                fprintf(stderr, "Invalid compression level: %d\n", options.level);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+            options.dir = argv[i] + 6;
+        } else if (strcmp(argv[i], "--generate") == 0) {
+            options.generate_only = 1;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.json = 1;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            bench_usage();
+            return 1;
+        }
+    }
+
+    if (mkdir(options.dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s\n", options.dir);
+        return 1;
+    }
+
+    if (!options.generate_only) {
+        if (options.json) {
+            printf("[");
+        } else {
+            printf("image,kind,width,height,stage,bytes,reps,median_ms,p99_ms,mb_s,ns_px\n");
+        }
+    }
+
+    int failed = 0;
+    int first = 1;
+    for (int s = 0; s < options.nsizes; s++) {
+        for (int k = 0; k < CORPUS_KINDS; k++) {
+            if (!options.kinds[k]) {
+                continue;
+            }
+            struct bench_case *c = calloc(1, sizeof(struct bench_case));
+            if (c == NULL) {
+                return 1;
+            }
+            c->kind = corpus_kindName(k);
+            if (bench_corpusFile(&options, k, options.sizes[s], c->path,
+                                 sizeof(c->path)) != 1) {
+                fprintf(stderr, "Failed to generate %s\n", c->path);
+                failed = 1;
+            } else if (!options.generate_only) {
+                if (bench_setup(c, &options) != 1 || bench_runCase(c, &options, &first) != 1) {
+                    failed = 1;
+                }
+                bench_release(c);
+            }
+            free(c);
+        }
+    }
+
+    if (!options.generate_only && options.json) {
+        printf("\n]\n");
+    }
+    return failed;
+}
@@ -0,0 +1,278 @@
+#include "corpus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/png/png_write.h"
+#include "../src/png/deflate.h"
+#include "../src/png/adler32.h"
+#include "../src/crc/crc.h"
+#include "../src/log.h"
+
+static const char *corpus_names[CORPUS_KINDS] = {"gradient", "noise", "flat", "palette",
+                                                    "stored"};
+
+const char *corpus_kindName(enum corpus_kind kind) {
+    return kind < CORPUS_KINDS ? corpus_names[kind] : "unknown";
+}
+
+int corpus_kindFromName(const char *name) {
+    for (int k = 0; k < CORPUS_KINDS; k++) {
+        if (strcmp(name, corpus_names[k]) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// xorshift32, never seeded with 0
+static uint32_t corpus_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void corpus_gradient(uint8_t *px, uint32_t width, uint32_t height) {
+    uint32_t wd = width > 1 ? width - 1 : 1;
+    uint32_t hd = height > 1 ? height - 1 : 1;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t *p = px + ((size_t)y * width + x) * 3;
+            p[0] = x * 255 / wd;
+            p[1] = y * 255 / hd;
+            p[2] = (uint64_t)(x + y) * 255 / (wd + hd);
+        }
+    }
+}
+
+static void corpus_noise(uint8_t *px, size_t size, uint32_t *rng) {
+    for (size_t i = 0; i < size; i++) {
+        px[i] = corpus_random(rng) >> 24;
+    }
+}
+
+static void corpus_fillRect(uint8_t *px, uint32_t width, uint32_t height, uint32_t x0,
+                            uint32_t y0, uint32_t w, uint32_t h, uint32_t rgb) {
+    for (uint32_t y = y0; y < y0 + h && y < height; y++) {
+        for (uint32_t x = x0; x < x0 + w && x < width; x++) {
+            uint8_t *p = px + ((size_t)y * width + x) * 3;
+            p[0] = rgb >> 16;
+            p[1] = rgb >> 8;
+            p[2] = rgb;
+        }
+    }
+}
+
+// Windows with a title bar over a flat desktop, text as short dark runs
+static void corpus_flat(uint8_t *px, uint32_t width, uint32_t height, uint32_t *rng) {
+    corpus_fillRect(px, width, height, 0, 0, width, height, 0x3A6EA5);
+
+    uint64_t windows = 1 + (uint64_t)width * height / (200 * 200);
+    if (windows > 256) windows = 256;
+    for (uint64_t i = 0; i < windows; i++) {
+        uint32_t w = width / 4 + corpus_random(rng) % (width / 2 + 1);
+        uint32_t h = height / 4 + corpus_random(rng) % (height / 2 + 1);
+        uint32_t x0 = corpus_random(rng) % (width - w + 1);
+        uint32_t y0 = corpus_random(rng) % (height - h + 1);
+        corpus_fillRect(px, width, height, x0, y0, w, h, 0xF0F0F0);
+        corpus_fillRect(px, width, height, x0, y0, w, 18, 0x2B579A);
+
+        for (uint32_t line = y0 + 26; line + 8 < y0 + h; line += 14) {
+            uint32_t x = x0 + 8;
+            while (x + 18 < x0 + w) {
+                uint32_t run = 2 + corpus_random(rng) % 8;
+                corpus_fillRect(px, width, height, x, line, run, 8, 0x202020);
+                x += run + 1 + corpus_random(rng) % 5;
+            }
+        }
+    }
+}
+
+static void corpus_writeChunk(FILE *fptr, const char type[4], const uint8_t *data,
+                              uint32_t length) {
+    uint32_t be = __builtin_bswap32(length);
+    uint32_t c = update_crc(0xffffffffL, (const unsigned char *)type, 4);
+    c = __builtin_bswap32(update_crc(c, data, length) ^ 0xffffffffL);
+    fwrite(&be, 4, 1, fptr);
+    fwrite(type, 4, 1, fptr);
+    if (length > 0) {
+        fwrite(data, length, 1, fptr);
+    }
+    fwrite(&c, 4, 1, fptr);
+}
+
+// 8-bit image of color_type around an already deflated zlib stream
+static int corpus_writeFile(const char *path, uint32_t width, uint32_t height,
+                            uint8_t color_type, const uint8_t *palette, uint32_t palette_size,
+                            const uint8_t *zlib, size_t zlib_size) {
+    uint8_t ihdr[13];
+    uint32_t w = __builtin_bswap32(width);
+    uint32_t h = __builtin_bswap32(height);
+    memcpy(ihdr, &w, 4);
+    memcpy(ihdr + 4, &h, 4);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = color_type;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    FILE *fptr = fopen(path, "wb");
+    if (fptr == NULL) {
+        LOGE("Failed to open file %s for writing\n", path);
+        return -1;
+    }
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, sizeof(signature), 1, fptr);
+    corpus_writeChunk(fptr, "IHDR", ihdr, sizeof(ihdr));
+    if (palette_size > 0) {
+        corpus_writeChunk(fptr, "PLTE", palette, palette_size);
+    }
+    corpus_writeChunk(fptr, "IDAT", zlib, zlib_size);
+    corpus_writeChunk(fptr, "IEND", NULL, 0);
+    return fclose(fptr) == 0 ? 1 : -1;
+}
+
+/*
+ * png_save only writes truecolour and gray, so indexed images are put
+ * together here: one unfiltered scanline per row (filter type None, as
+ * libpng picks for palettes) deflated at the default level.
+ */
+static int corpus_writePalette(const char *path, uint32_t width, uint32_t height,
+                               uint32_t *rng) {
+    size_t stride = (size_t)width + 1;
+    size_t size = stride * height;
+    size_t cap = deflate_bound(size) + 6;
+    uint8_t *raw = malloc(size);
+    uint8_t *zlib = malloc(cap);
+    if (raw == NULL || zlib == NULL) {
+        free(raw);
+        free(zlib);
+        return -1;
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = raw + y * stride;
+        row[0] = 0;
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t index = ((x / 16 + y / 16) * 5 + ((x ^ y) >> 3)) & 63;
+            if ((corpus_random(rng) & 15) == 0) {
+                index = corpus_random(rng) & 63; // dithering
+            }
+            row[1 + x] = index;
+        }
+    }
+
+    struct bitStream bs;
+    bitstream_init(&bs, zlib, cap);
+    bitstream_write(&bs, 8, 0x78);
+    bitstream_write(&bs, 8, 0x9C);
+    int res = deflate_compress(raw, size, DEFLATE_DEFAULT_LEVEL, &bs);
+    bitstream_flush(&bs);
+    bitstream_write(&bs, 32, __builtin_bswap32(adler32_update(1, raw, size)));
+    bitstream_flush(&bs);
+    free(raw);
+    if (res != 0) {
+        free(zlib);
+        return -1;
+    }
+
+    uint8_t palette[64 * 3];
+    for (int i = 0; i < 64; i++) {
+        palette[3 * i] = (i & 3) * 85;
+        palette[3 * i + 1] = ((i >> 2) & 3) * 85;
+        palette[3 * i + 2] = ((i >> 4) & 3) * 85;
+    }
+    res = corpus_writeFile(path, width, height, 3, palette, sizeof(palette), zlib,
+                           bitstream_get_size(&bs));
+    free(zlib);
+    return res;
+}
+
+/*
+ * Unfiltered RGB gradient stored at level 0 in blocks of 1 to 8 bytes, a
+ * quarter of them followed by the empty block of a sync flush, as an
+ * encoder that flushes every few bytes writes it. The blocks are shorter
+ * than what the decoder's bit buffer reads ahead, and the sync points let
+ * --decode-threads split the stream.
+ */
+static int corpus_writeStored(const char *path, uint32_t width, uint32_t height,
+                              uint32_t *rng) {
+    size_t stride = (size_t)width * 3 + 1;
+    size_t size = stride * height;
+    // Each block adds 5 bytes of header, with its sync flush at most 10 per byte of data
+    size_t cap = size * 11 + 6;
+    uint8_t *raw = malloc(size);
+    uint8_t *zlib = malloc(cap);
+    if (raw == NULL || zlib == NULL) {
+        free(raw);
+        free(zlib);
+        return -1;
+    }
+
+    corpus_gradient(raw, width, height);
+    // Spread the packed pixels out to make room for the filter bytes, bottom up
+    for (uint32_t y = height; y-- > 0;) {
+        memmove(raw + y * stride + 1, raw + (size_t)y * width * 3, stride - 1);
+        raw[y * stride] = 0;
+    }
+
+    struct bitStream bs;
+    bitstream_init(&bs, zlib, cap);
+    bitstream_write(&bs, 8, 0x78);
+    bitstream_write(&bs, 8, 0x01);
+    int res = 0;
+    for (size_t start = 0; start < size && res == 0;) {
+        size_t end = start + 1 + corpus_random(rng) % 8;
+        if (end > size) end = size;
+        res = deflate_compress_range(raw, start, start, end, 0, &bs, end == size);
+        if (end < size && (corpus_random(rng) & 3) == 0) {
+            res |= deflate_compress_range(raw, end, end, end, 0, &bs, 0);
+        }
+        start = end;
+    }
+    bitstream_flush(&bs);
+    bitstream_write(&bs, 32, __builtin_bswap32(adler32_update(1, raw, size)));
+    bitstream_flush(&bs);
+    free(raw);
+    if (res != 0) {
+        free(zlib);
+        return -1;
+    }
+    res = corpus_writeFile(path, width, height, 2, NULL, 0, zlib, bitstream_get_size(&bs));
+    free(zlib);
+    return res;
+}
+
+int corpus_write(const char *path, enum corpus_kind kind, uint32_t width, uint32_t height,
+                 uint32_t seed) {
+    uint32_t rng = seed ? seed : 0x9E3779B9;
+    if (width == 0 || height == 0) {
+        return -1;
+    }
+    if (kind == CORPUS_PALETTE) {
+        return corpus_writePalette(path, width, height, &rng);
+    }
+    if (kind == CORPUS_STORED) {
+        return corpus_writeStored(path, width, height, &rng);
+    }
+
+    size_t size = (size_t)width * height * 3;
+    uint8_t *px = malloc(size);
+    if (px == NULL) {
+        LOGE("Failed to allocate %zu bytes for a %ux%u image\n", size, width, height);
+        return -1;
+    }
+    switch (kind) {
+        case CORPUS_GRADIENT: corpus_gradient(px, width, height); break;
+        case CORPUS_NOISE: corpus_noise(px, size, &rng); break;
+        default: corpus_flat(px, width, height, &rng); break;
+    }
+
+    struct png_writeOptions options = {
+        .level = DEFLATE_DEFAULT_LEVEL,
+        .threads = 1,
+        .filter = PNG_FILTER_ADAPTIVE,
+    };
+    int res = png_save((char *)path, px, width, height, 3, &options);
+    free(px);
+    return res;
+}
@@ -0,0 +1,27 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdint.h>
+
+// Synthetic image content, each stresses the codec differently
+enum corpus_kind {
+    CORPUS_GRADIENT, // smooth RGB ramps, filters predict almost everything
+    CORPUS_NOISE,    // random RGB bytes, incompressible
+    CORPUS_FLAT,     // screenshot-like: flat windows, bars and text runs
+    CORPUS_PALETTE,  // 8-bit indexed with a 64 colour palette
+    CORPUS_STORED,   // uncompressed, in stored blocks of a few bytes each
+    CORPUS_KINDS
+};
+
+const char *corpus_kindName(enum corpus_kind kind);
+int corpus_kindFromName(const char *name);
+
+/*
+ * Write a deterministic width x height image of the given kind to path.
+ * The same kind, size and seed always produce the same file.
+ * Returns 1 on success, -1 on failure.
+ */
+int corpus_write(const char *path, enum corpus_kind kind, uint32_t width, uint32_t height,
+                 uint32_t seed);
+
+#endif  // CORPUS_H
@@ -0,0 +1,403 @@
+#include "batch.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bmp/bmp.h"
+#include "png/png.h"
+#include "log.h"
+
+struct batch_list {
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+struct batch_result {
+    int ok;
+    double ms;
+    const char *format;        // "png" or "bmp"
+    struct image_probe probe;  // filled by every mode
+};
+
+struct batch_job;
+
+/*
+ * Each worker owns a contiguous range of the file list and takes files from
+ * its front. A worker that runs dry steals single files from the back of
+ * another worker's range, so neighbouring files stay on one thread and
+ * owner and thief only meet on the last file of a range.
+ */
+struct batch_worker {
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    size_t head;   // next file to take
+    size_t tail;   // end of the range, thieves take tail - 1
+    int index;
+    struct batch_job *job;
+
+    struct png_decoder decoder;
+    uint8_t *pixels;   // output buffer reused across files
+    size_t capacity;
+};
+
+struct batch_job {
+    const struct batch_options *options;
+    struct batch_list list;
+    struct batch_result *results;
+    struct batch_worker *workers;
+    int nworkers;
+};
+
+static double batch_nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static const char *batch_format(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext && strcasecmp(ext, ".png") == 0) {
+        return "png";
+    }
+    if (ext && strcasecmp(ext, ".bmp") == 0) {
+        return "bmp";
+    }
+    return NULL;
+}
+
+static int batch_add(struct batch_list *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 64;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            LOGE("Failed to allocate the file list\n");
+            return -1;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    if ((list->paths[list->count] = strdup(path)) == NULL) {
+        LOGE("Failed to allocate the file list\n");
+        return -1;
+    }
+    list->count++;
+    return 1;
+}
+
+static int batch_comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// The .png and .bmp files directly inside dir, sorted by name
+static int batch_addDirectory(struct batch_list *list, const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        LOGE("Failed to open directory %s\n", dir);
+        return -1;
+    }
+
+    size_t first = list->count;
+    int res = 1;
+    struct dirent *entry;
+    while (res == 1 && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' || batch_format(entry->d_name) == NULL) {
+            continue;
+        }
+        size_t len = strlen(dir) + strlen(entry->d_name) + 2;
+        char *path = malloc(len);
+        if (path == NULL) {
+            LOGE("Failed to allocate the file list\n");
+            res = -1;
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir, entry->d_name);
+
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            res = batch_add(list, path);
+        }
+        free(path);
+    }
+    closedir(d);
+
+    qsort(list->paths + first, list->count - first, sizeof(char *), batch_comparePaths);
+    return res;
+}
+
+// One path per line, blank lines are skipped
+static int batch_readList(struct batch_list *list, FILE *fptr) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int res = 1;
+
+    while (res == 1 && (len = getline(&line, &size, fptr)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            res = batch_add(list, line);
+        }
+    }
+    free(line);
+    return res;
+}
+
+static int batch_collect(struct batch_list *list, char **inputs, int count) {
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        int res;
+        if (strcmp(inputs[i], "-") == 0) {
+            res = batch_readList(list, stdin);
+        } else if (stat(inputs[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            res = batch_addDirectory(list, inputs[i]);
+        } else {
+            res = batch_add(list, inputs[i]);
+        }
+        if (res != 1) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Decode into the worker's buffer and, for BATCH_SAVE, write it back out
+static int batch_decodePng(struct batch_worker *w, const char *path, struct batch_result *result) {
+    const struct batch_options *options = w->job->options;
+    struct png_info info;
+    if (png_readHeader(&w->decoder, path, &info) != 1) {
+        return -1;
+    }
+    result->probe.width = info.width;
+    result->probe.height = info.height;
+    result->probe.bitDepth = info.bitDepth;
+    result->probe.colorType = info.colorType;
+    result->probe.interlaced = 0;
+
+    int bpp = png_formatBpp(info.format);
+    size_t size;
+    if (png_mulSize((size_t)info.width * bpp, info.height, &size) != 0) {
+        LOGE("%s: image of %ux%u pixels is too big\n", path, info.width, info.height);
+        return -1;
+    }
+    if (size > w->capacity) {
+        uint8_t *pixels = realloc(w->pixels, size);
+        if (pixels == NULL) {
+            // The next png_readHeader releases the file
+            LOGE("%s: failed to allocate %zu bytes of pixels\n", path, size);
+            return -1;
+        }
+        w->pixels = pixels;
+        w->capacity = size;
+    }
+    if (png_decodeInto(&w->decoder, w->pixels, (size_t)info.width * bpp, info.format) != 1) {
+        return -1;
+    }
+
+    if (options->mode == BATCH_SAVE) {
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        size_t len = strlen(options->out_dir) + strlen(name) + 2;
+        char *out = malloc(len);
+        if (out == NULL) {
+            return -1;
+        }
+        snprintf(out, len, "%s/%s", options->out_dir, name);
+        int res = png_save(out, w->pixels, info.width, info.height, bpp, options->write_options);
+        free(out);
+        if (res != 1) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static void batch_process(struct batch_worker *w, size_t index) {
+    const char *path = w->job->list.paths[index];
+    struct batch_result *result = &w->job->results[index];
+    double start = batch_nowMs();
+
+    result->format = batch_format(path);
+    int res = -1;
+    if (result->format == NULL) {
+        LOGE("%s: unsupported file format\n", path);
+    } else if (w->job->options->mode == BATCH_PROBE) {
+        res = strcmp(result->format, "png") == 0 ? png_probe(path, &result->probe)
+                                                 : bmp_probe(path, &result->probe);
+    } else if (strcmp(result->format, "png") == 0) {
+        res = batch_decodePng(w, path, result);
+    } else {
+        LOGE("%s: BMP files can only be probed in batch mode\n", path);
+    }
+
+    result->ok = (res == 1);
+    result->ms = batch_nowMs() - start;
+}
+
+static int batch_take(struct batch_worker *w, size_t *index) {
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *index = w->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static int batch_steal(struct batch_worker *w, size_t *index) {
+    struct batch_job *job = w->job;
+    for (int i = 1; i < job->nworkers; i++) {
+        struct batch_worker *victim = &job->workers[(w->index + i) % job->nworkers];
+        int found = 0;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *index = --victim->tail;
+            found = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (found) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *batch_worker(void *arg) {
+    struct batch_worker *w = arg;
+    size_t index;
+    // Nothing is ever added, so once stealing fails everyone is nearly done
+    while (batch_take(w, &index) || batch_steal(w, &index)) {
+        batch_process(w, index);
+    }
+    return NULL;
+}
+
+static void batch_report(const struct batch_job *job, double wall_ms) {
+    size_t ok = 0;
+    double busy_ms = 0;
+    double pixels = 0;
+
+    for (size_t i = 0; i < job->list.count; i++) {
+        const struct batch_result *r = &job->results[i];
+        const char *path = job->list.paths[i];
+        busy_ms += r->ms;
+        if (!r->ok) {
+            printf("%s\terror\t%.3f\n", path, r->ms);
+            continue;
+        }
+        ok++;
+        pixels += (double)r->probe.width * r->probe.height;
+        if (job->options->mode == BATCH_PROBE) {
+            printf("%s\t%s\t%u\t%u\t%u\t%u\t%u\t%.3f\n", path, r->format, r->probe.width,
+                   r->probe.height, r->probe.bitDepth, r->probe.colorType, r->probe.interlaced,
+                   r->ms);
+        } else {
+            printf("%s\tok\t%u\t%u\t%.3f\n", path, r->probe.width, r->probe.height, r->ms);
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "%zu files, %zu ok, %zu failed on %d workers: %.1f ms wall, %.1f ms in files",
+            job->list.count, ok, job->list.count - ok, job->nworkers, wall_ms, busy_ms);
+    if (wall_ms > 0) {
+        fprintf(stderr, ", %.1f files/s", job->list.count * 1000.0 / wall_ms);
+        if (job->options->mode != BATCH_PROBE) {
+            fprintf(stderr, ", %.1f Mpixel/s", pixels / 1000.0 / wall_ms);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+int batch_run(char **inputs, int count, const struct batch_options *options) {
+    struct batch_job job = {.options = options};
+    int res = 1;
+
+    if (batch_collect(&job.list, inputs, count) != 1) {
+        goto out;
+    }
+    if (job.list.count == 0) {
+        LOGE("No input files\n");
+        goto out;
+    }
+
+    int jobs = options->jobs;
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)jobs > job.list.count) {
+        jobs = (int)job.list.count;
+    }
+
+    job.results = calloc(job.list.count, sizeof(struct batch_result));
+    job.workers = calloc(jobs, sizeof(struct batch_worker));
+    if (job.results == NULL || job.workers == NULL) {
+        LOGE("Failed to allocate batch state\n");
+        goto out;
+    }
+    job.nworkers = jobs;
+
+    for (int i = 0; i < jobs; i++) {
+        struct batch_worker *w = &job.workers[i];
+        w->index = i;
+        w->job = &job;
+        w->head = job.list.count * i / jobs;
+        w->tail = job.list.count * (i + 1) / jobs;
+        pthread_mutex_init(&w->lock, NULL);
+        png_decoderInit(&w->decoder, NULL);
+    }
+
+    double start = batch_nowMs();
+    // The calling thread is worker 0; a worker that fails to start is stolen from
+    for (int i = 1; i < jobs; i++) {
+        job.workers[i].started = pthread_create(&job.workers[i].thread, NULL, batch_worker,
+                                                &job.workers[i]) == 0;
+    }
+    batch_worker(&job.workers[0]);
+    for (int i = 1; i < jobs; i++) {
+        if (job.workers[i].started) {
+            pthread_join(job.workers[i].thread, NULL);
+        }
+    }
+    double wall_ms = batch_nowMs() - start;
+
+    // Worker logs went out when they exited, the calling thread's go now
+    log_flush();
+    batch_report(&job, wall_ms);
+    if (options->stats) {
+        struct png_stats stats = {0};
+        for (int i = 0; i < jobs; i++) {
+            png_statsMerge(&stats, &job.workers[i].decoder.stats);
+        }
+        png_statsPrint(&stats, stderr);
+    }
+    res = 0;
+    for (size_t i = 0; i < job.list.count; i++) {
+        if (!job.results[i].ok) {
+            res = 1;
+        }
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_destroy(&job.workers[i].lock);
+        png_decoderRelease(&job.workers[i].decoder);
+        free(job.workers[i].pixels);
+    }
+
+out:
+    for (size_t i = 0; i < job.list.count; i++) {
+        free(job.list.paths[i]);
+    }
+    free(job.list.paths);
+    free(job.results);
+    free(job.workers);
+    return res;
+}
@@ -0,0 +1,29 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "png/png_write.h"
+
+// What to do with every file of a batch
+enum batch_mode {
+    BATCH_DECODE, // decode and drop the pixels
+    BATCH_SAVE,   // decode and re-encode into out_dir
+    BATCH_PROBE,  // headers only
+};
+
+struct batch_options {
+    enum batch_mode mode;
+    int jobs;            // worker threads, 0 = one per online CPU
+    const char *out_dir; // BATCH_SAVE output directory
+    const struct png_writeOptions *write_options;
+    int stats;           // print the merged decoder stats as JSON on stderr
+};
+
+/*
+ * Run mode over every input: a file, a directory (its .png/.bmp files) or
+ * "-" for a newline separated list of paths on stdin. Prints one line per
+ * file in input order and a summary on stderr.
+ * Returns 0 when every file succeeded, 1 otherwise.
+ */
+int batch_run(char **inputs, int count, const struct batch_options *options);
+
+#endif  // BATCH_H
@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "./bmp.h"
+#include "../log.h"
 
 void bmp_printFileHeader(struct bmp_fileHeader *header) {
     printf("signature: %c%c\n", header->signature[0],
@@ -168,3 +172,50 @@ void bmp_open(char filename[]) {
     fclose(fptr);
     free(pixels);
 }
+
+/*
+ * Read both headers with one 54-byte read and validate them, without
+ * touching the pixel data. Returns 1 on success, -1 on failure.
+ */
+int bmp_probe(const char *filename, struct image_probe *probe) {
+    uint8_t buf[sizeof(struct bmp_fileHeader) + sizeof(struct bmp_bitmapInfoHeader)];
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Failed to open file %s\n", filename);
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n != (ssize_t)sizeof(buf)) {
+        LOGE("%s: too short for a BMP header\n", filename);
+        return -1;
+    }
+
+    struct bmp_fileHeader fileHeader;
+    struct bmp_bitmapInfoHeader infoHeader;
+    memcpy(&fileHeader, buf, sizeof(fileHeader));
+    memcpy(&infoHeader, buf + sizeof(fileHeader), sizeof(infoHeader));
+
+    if (fileHeader.signature[0] != 'B' || fileHeader.signature[1] != 'M') {
+        LOGE("%s: not a BMP file\n", filename);
+        return -1;
+    }
+    // 40 is BITMAPINFOHEADER, the V4/V5 headers extend it
+    int bitCount = infoHeader.bitCount;
+    if (infoHeader.size < sizeof(struct bmp_bitmapInfoHeader) || infoHeader.planes != 1 ||
+        infoHeader.width <= 0 || infoHeader.height == 0 || infoHeader.height == INT32_MIN ||
+        (bitCount != 1 && bitCount != 4 && bitCount != 8 &&
+         bitCount != 16 && bitCount != 24 && bitCount != 32)) {
+        LOGE("%s: invalid BMP header\n", filename);
+        return -1;
+    }
+
+    probe->width = infoHeader.width;
+    // Negative height means the rows are stored top-down
+    probe->height = infoHeader.height < 0 ? -infoHeader.height : infoHeader.height;
+    probe->bitDepth = bitCount;
+    probe->colorType = 0;
+    probe->interlaced = 0;
+    return 1;
+}
@@ -35,5 +35,6 @@ int bmp_readFileHeader(FILE *fptr, struct bmp_fileHeader *header);
 int bmp_readBitmapInfoHeader(FILE *fptr, struct bmp_bitmapInfoHeader *header);
 void* bmp_readPixels(FILE *fptr, struct bmp_bitmapInfoHeader *header);
 void bmp_open(char filename[]);
+int bmp_probe(const char *filename, struct image_probe *probe);
 
 #endif  // BMP_H
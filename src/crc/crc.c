@@ -1,52 +1,158 @@
 #include "crc.h"
+#include "crc_table.h"
+#include <pthread.h>
+#include <string.h>
 
-/* Table of CRCs of all 8-bit messages. */
-unsigned long crc_table[256];
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
 
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
+/* Update a running CRC eight bytes at a time: the word is split into
+   bytes and each byte looked up in the table that already accounts for
+   the bytes behind it. */
+static uint32_t crc_slice8(uint32_t c, const unsigned char *buf, size_t len)
+{
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, buf, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
+		w ^= c;
+		c = crc_table[7][w & 0xff] ^
+		    crc_table[6][(w >> 8) & 0xff] ^
+		    crc_table[5][(w >> 16) & 0xff] ^
+		    crc_table[4][(w >> 24) & 0xff] ^
+		    crc_table[3][(w >> 32) & 0xff] ^
+		    crc_table[2][(w >> 40) & 0xff] ^
+		    crc_table[1][(w >> 48) & 0xff] ^
+		    crc_table[0][w >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) {
+		c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+	}
+	return c;
+}
 
-/* Make the table for a fast CRC. */
-void make_crc_table(void)
+#ifdef CRC_X86
+/* Carry-less multiply folding (Intel, "Fast CRC Computation for Generic
+   Polynomials Using PCLMULQDQ Instruction"), bit-reflected constants for
+   the PNG polynomial. Takes len >= 64, a multiple of 16. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_pclmul(uint32_t c, const unsigned char *buf, size_t len)
 {
-	unsigned long c;
-	int n, k;
-
-	for (n = 0; n < 256; n++) {
-		c = (unsigned long) n;
-		for (k = 0; k < 8; k++) {
-			if (c & 1)
-				c = 0xedb88320L ^ (c >> 1);
-			else
-				c = c >> 1;
-		}
-		crc_table[n] = c;
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+	buf += 64;
+	len -= 64;
+
+	/* Fold four 128-bit lanes forward 512 bits at a time */
+	while (len >= 64) {
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+				   _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+				   _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+				   _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the lanes into one, then the remaining 16-byte blocks */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), t1);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), t1);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), t1);
+
+	while (len >= 16) {
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
 	}
-	crc_table_computed = 1;
+
+	/* 128 -> 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/* Has the CPU carry-less multiply? Checked once, by the first caller. */
+static pthread_once_t crc_pclmul_once = PTHREAD_ONCE_INIT;
+static int crc_use_pclmul = 0;
+
+static void crc_check_pclmul(void)
+{
+	__builtin_cpu_init();
+	crc_use_pclmul = __builtin_cpu_supports("pclmul") &&
+			 __builtin_cpu_supports("sse4.1");
 }
+#endif
 
 /* Update a running CRC with the bytes buf[0..len-1]--the CRC
    should be initialized to all 1's, and the transmitted value
    is the 1's complement of the final running CRC (see the
    crc() routine below)). */
 
-unsigned long update_crc(unsigned long crc, unsigned char *buf,
-		int len)
+uint32_t update_crc(uint32_t crc, const unsigned char *buf,
+		size_t len)
 {
-	unsigned long c = crc;
-	int n;
-
-	if (!crc_table_computed)
-		make_crc_table();
-	for (n = 0; n < len; n++) {
-		c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+#ifdef CRC_X86
+	pthread_once(&crc_pclmul_once, crc_check_pclmul);
+	if (crc_use_pclmul && len >= 64) {
+		size_t n = len & ~(size_t)15;
+		crc = crc_pclmul(crc, buf, n);
+		buf += n;
+		len -= n;
 	}
-	return c;
+#endif
+	return crc_slice8(crc, buf, len);
 }
 
 /* Return the CRC of the bytes buf[0..len-1]. */
-unsigned long crc(unsigned char *buf, int len)
+uint32_t crc(const unsigned char *buf, size_t len)
 {
 	return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
 }
-
@@ -1,4 +1,11 @@
-void make_crc_table(void);
-unsigned long update_crc(unsigned long crc, unsigned char *buf,
-		int len);
-unsigned long crc(unsigned char *buf, int len);
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t update_crc(uint32_t crc, const unsigned char *buf,
+		size_t len);
+uint32_t crc(const unsigned char *buf, size_t len);
+
+#endif  // CRC_H
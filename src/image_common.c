@@ -20,78 +20,58 @@ void print_binary(uint32_t value, int bits) {
 
 void bitstream_init(struct bitStream *bs, uint8_t *data, size_t length) {
     bs->data = data;
-    bs->bitpos = 0;
     bs->length = length;
+    bs->bitbuf = 0;
+    bs->bitcount = 0;
+    bs->bytepos = 0;
 }
 
-int bitstream_read(struct bitStream *bs, int n, uint32_t *out) {
-    if (n <= 0 || n > 32) return -1;  // invalid number of bits
-
-    uint32_t result = 0;
-    for (int i = 0; i < n; i++) {
-        size_t byte_pos = bs->bitpos / 8;
-        size_t bit_in_byte = bs->bitpos % 8;
-
-        if (byte_pos >= bs->length) {
-            return -1; // end of stream
-        }
-
-        uint8_t bit = (bs->data[byte_pos] >> bit_in_byte) & 1;
-        result |= (bit << i); // LSB first
-        bs->bitpos++;
-    }
-    *out = result;
-    return 0; // success
+// Pad with zero bits to the next byte boundary and store everything buffered
+int bitstream_flush(struct bitStream *bs) {
+    bs->bitcount = (bs->bitcount + 7) & ~7u;
+    return bitstream_store(bs);
 }
 
-// Write n bits from 'in' to the bitstream (LSB first)
-int bitstream_write(struct bitStream *bs, int n, uint32_t in) {
-    if (n <= 0 || n > 32) return -1; // invalid number of bits
-
-    for (int i = 0; i < n; i++) {
-        size_t byte_pos = bs->bitpos / 8;
-        size_t bit_in_byte = bs->bitpos % 8;
+// Pad to a byte boundary, then copy n whole bytes into the stream
+int bitstream_write_bytes(struct bitStream *bs, const uint8_t *in, size_t n) {
+    if (bitstream_flush(bs) != 0) return -1;
+    if (bs->bytepos + n > bs->length) return -1; // end of buffer
+    memcpy(bs->data + bs->bytepos, in, n);
+    bs->bytepos += n;
+    return 0;
+}
 
-        if (byte_pos >= bs->length) {
-            return -1; // end of buffer
-        }
+void bitstream_align_byte(struct bitStream *bs) {
+    bs->bitbuf >>= bs->bitcount & 7;
+    bs->bitcount &= ~7u;
+}
 
-        uint8_t bit = (in >> i) & 1; // LSB first
-        bs->data[byte_pos] &= ~(1 << bit_in_byte); // clear target bit
-        bs->data[byte_pos] |= bit << bit_in_byte; // set target bit
+// Copy n whole bytes out of a byte-aligned stream
+int bitstream_read_bytes(struct bitStream *bs, uint8_t *out, size_t n) {
+    if (bs->bitcount & 7) return -1; // not byte aligned
+    if (bitstream_bits_left(bs) < n * 8) return -1; // end of stream
 
-        bs->bitpos++;
+    // Drain what is already buffered, then copy straight from the data
+    while (n > 0 && bs->bitcount > 0) {
+        *out++ = (uint8_t)bs->bitbuf;
+        bitstream_consume(bs, 8);
+        n--;
     }
-    return 0; // success
-}
-
-int bitstream_flush(struct bitStream *bs) {
-    size_t byte_pos = bs->bitpos / 8;
-    size_t bit_in_byte = bs->bitpos % 8;
-    if (bit_in_byte == 0) {
+    if (n == 0) {
         return 0;
     }
-    uint8_t padding_amt = 8 - bit_in_byte;
-    bs->data[byte_pos] &= (1 << bit_in_byte) - 1; // clear bits after current pos to the byte end
-    bs->bitpos += padding_amt;
+    // Only now the accumulator is empty, its lookahead bits above bitcount
+    // belong to the bytes copied below
+    bs->bitbuf = 0;
+    memcpy(out, bs->data + bs->bytepos, n);
+    bs->bytepos += n;
     return 0;
 }
 
-int bitstream_peek(struct bitStream *bs, int n, uint32_t *out) {
-    size_t original_pos = bs->bitpos;
-    int res = bitstream_read(bs, n, out);
-    bs->bitpos = original_pos;
-    return res;
-}
-
-void bitstream_align_byte(struct bitStream *bs) {
-    bs->bitpos = (bs->bitpos + 7) & ~7;
-}
-
 void bitstream_print(struct bitStream *bs) {
-    size_t total_bytes = (bs->bitpos + 7) / 8; // how many bytes are actually written
+    size_t total_bytes = bs->bytepos; // how many bytes are actually written
 
-    printf("Bitstream (%zu bits, %zu bytes):\n", bs->bitpos, total_bytes);
+    printf("Bitstream (%zu bits, %zu bytes):\n", bs->bytepos * 8, total_bytes);
 
     for (size_t i = 0; i < total_bytes; i++) {
         uint8_t byte = bs->data[i];
@@ -106,6 +86,6 @@ void bitstream_print(struct bitStream *bs) {
     }
 }
 
-int bitstream_get_size(struct bitStream *bs) {
-    return (bs->bitpos + 7)/8;
+size_t bitstream_get_size(struct bitStream *bs) {
+    return bs->bytepos + (bs->bitcount + 7) / 8;
 }
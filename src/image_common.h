@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 struct __attribute__((packed)) rgbPixel {
     uint8_t r;
@@ -17,22 +18,133 @@ struct __attribute__((packed)) rgbaPixel {
     uint8_t a;
 };
 
+// Header metadata from png_probe / bmp_probe, no pixels are decoded
+struct image_probe {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bitDepth;    // bits per channel for PNG, per pixel for BMP
+    uint8_t colorType;   // PNG colour type, 0 for BMP
+    uint8_t interlaced;
+};
+
 struct bitStream {
     uint8_t *data;   // pointer to the byte buffer
-    size_t bitpos;   // current bit position in the stream
     size_t length;   // total length of data in bytes
+
+    // Bits go through a 64-bit accumulator, LSB first. The reader refills it
+    // a whole byte (or 8 bytes) at a time, the writer stores whole bytes
+    uint64_t bitbuf;   // buffered bits, next bit in the LSB
+    uint32_t bitcount; // number of valid bits in bitbuf
+    size_t bytepos;    // next byte of data to load into / store from bitbuf
 };
 
 void bitstream_init(struct bitStream *bs, uint8_t *data, size_t length);
-int bitstream_read(struct bitStream *bs, int n, uint32_t *out);
-int bitstream_peek(struct bitStream *bs, int n, uint32_t *out);
 void bitstream_align_byte(struct bitStream *bs);
-int bitstream_write(struct bitStream *bs, int n, uint32_t in);
+int bitstream_read_bytes(struct bitStream *bs, uint8_t *out, size_t n);
+int bitstream_write_bytes(struct bitStream *bs, const uint8_t *in, size_t n);
 int bitstream_flush(struct bitStream *bs);
 void print_binary(uint32_t value, int bits);
 void bitstream_print(struct bitStream *bs);
-int bitstream_get_size(struct bitStream *bs);
+size_t bitstream_get_size(struct bitStream *bs);
 
 uint32_t reverse_bits(uint32_t x, int n);
 
+static inline uint64_t load_le64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Top up the accumulator to at least 56 bits, unless the data runs out.
+// Bits above bitcount are always either zero or the next bits of data, so
+// loading overlapping bytes again is harmless.
+static inline void bitstream_refill(struct bitStream *bs) {
+    if (bs->bytepos + 8 <= bs->length) {
+        bs->bitbuf |= load_le64(bs->data + bs->bytepos) << bs->bitcount;
+        bs->bytepos += (63 - bs->bitcount) >> 3;
+        bs->bitcount |= 56;
+        return;
+    }
+    while (bs->bitcount <= 56 && bs->bytepos < bs->length) {
+        bs->bitbuf |= (uint64_t)bs->data[bs->bytepos++] << bs->bitcount;
+        bs->bitcount += 8;
+    }
+}
+
+// Number of unread bits left in the stream
+static inline size_t bitstream_bits_left(const struct bitStream *bs) {
+    return bs->bitcount + (bs->length - bs->bytepos) * 8;
+}
+
+// Peek up to 32 bits; bits past the end of the stream read as zero
+static inline uint32_t bitstream_peek_bits(struct bitStream *bs, int n) {
+    if (bs->bitcount < (uint32_t)n) {
+        bitstream_refill(bs);
+    }
+    return (uint32_t)(bs->bitbuf & ((1ULL << n) - 1));
+}
+
+// Drop n bits that have already been peeked (n <= bitcount)
+static inline void bitstream_consume(struct bitStream *bs, int n) {
+    bs->bitbuf >>= n;
+    bs->bitcount -= n;
+}
+
+static inline int bitstream_peek(struct bitStream *bs, int n, uint32_t *out) {
+    if (n <= 0 || n > 32) return -1;  // invalid number of bits
+    *out = bitstream_peek_bits(bs, n);
+    return bs->bitcount < (uint32_t)n ? -1 : 0;
+}
+
+static inline int bitstream_read(struct bitStream *bs, int n, uint32_t *out) {
+    if (bitstream_peek(bs, n, out) != 0) {
+        return -1; // end of stream
+    }
+    bitstream_consume(bs, n);
+    return 0; // success
+}
+
+static inline void store_le64(uint8_t *p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+// Move whole bytes from the accumulator out to data
+static inline int bitstream_store(struct bitStream *bs) {
+    if (bs->bytepos + 8 <= bs->length) {
+        uint32_t nbytes = bs->bitcount >> 3;
+        store_le64(bs->data + bs->bytepos, bs->bitbuf);
+        bs->bytepos += nbytes;
+        bs->bitbuf = nbytes == 8 ? 0 : bs->bitbuf >> (nbytes * 8);
+        bs->bitcount &= 7;
+        return 0;
+    }
+    while (bs->bitcount >= 8) {
+        if (bs->bytepos >= bs->length) {
+            return -1; // end of buffer
+        }
+        bs->data[bs->bytepos++] = (uint8_t)bs->bitbuf;
+        bs->bitbuf >>= 8;
+        bs->bitcount -= 8;
+    }
+    return 0;
+}
+
+// Write n bits from 'in' to the bitstream (LSB first)
+static inline int bitstream_write(struct bitStream *bs, int n, uint32_t in) {
+    if (n <= 0 || n > 32) return -1; // invalid number of bits
+
+    bs->bitbuf |= (uint64_t)(in & (uint32_t)((1ULL << n) - 1)) << bs->bitcount;
+    bs->bitcount += n;
+    if (bs->bitcount >= 32) {
+        return bitstream_store(bs);
+    }
+    return 0; // success
+}
+
 #endif  // IMAGE_COMMON_H
@@ -0,0 +1,106 @@
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define LOG_BUFFER_SIZE 8192
+
+/*
+ * Each thread formats into its own buffer and hands whole messages to
+ * stderr with one write(), so threads never wait on each other or on the
+ * stderr lock. Info messages stay buffered until the buffer fills, an
+ * error or warning comes along, log_flush is called or the thread exits;
+ * errors and warnings go out straight away.
+ */
+struct log_buffer {
+    size_t len;
+    char data[LOG_BUFFER_SIZE];
+};
+
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static void log_writeAll(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void log_flushBuffer(struct log_buffer *b) {
+    log_writeAll(b->data, b->len);
+    b->len = 0;
+}
+
+// pthread key destructor: flush what a finished worker left behind
+static void log_threadExit(void *ptr) {
+    log_flushBuffer(ptr);
+    free(ptr);
+}
+
+static void log_init(void) {
+    pthread_key_create(&log_key, log_threadExit);
+    // The main thread never runs key destructors
+    atexit(log_flush);
+}
+
+static struct log_buffer *log_buffer(void) {
+    pthread_once(&log_once, log_init);
+    struct log_buffer *b = pthread_getspecific(log_key);
+    if (b == NULL && (b = malloc(sizeof(struct log_buffer))) != NULL) {
+        b->len = 0;
+        pthread_setspecific(log_key, b);
+    }
+    return b;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap, retry;
+    va_start(ap, fmt);
+    struct log_buffer *b = log_buffer();
+    if (b == NULL) {
+        vdprintf(STDERR_FILENO, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    va_copy(retry, ap);
+    int n = vsnprintf(b->data + b->len, LOG_BUFFER_SIZE - b->len, fmt, ap);
+    if (n >= 0 && (size_t)n >= LOG_BUFFER_SIZE - b->len) {
+        // Didn't fit behind what is buffered: flush, then format again
+        log_flushBuffer(b);
+        if (n < LOG_BUFFER_SIZE) {
+            n = vsnprintf(b->data, LOG_BUFFER_SIZE, fmt, retry);
+        } else {
+            vdprintf(STDERR_FILENO, fmt, retry);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        b->len += n;
+    }
+    va_end(retry);
+    va_end(ap);
+
+    if (level <= LOG_WARN) {
+        log_flushBuffer(b);
+    }
+}
+
+// Write out the calling thread's buffered messages
+void log_flush(void) {
+    pthread_once(&log_once, log_init);
+    struct log_buffer *b = pthread_getspecific(log_key);
+    if (b != NULL) {
+        log_flushBuffer(b);
+    }
+}
@@ -1,26 +1,36 @@
 #pragma once
 #include <stdio.h>
 
-enum {
-    LOG_ERROR = 0,
-    LOG_WARN  = 1,
-    LOG_INFO  = 2
-};
+// Plain macros rather than an enum so LOG_MAX_LEVEL works in #if
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+
+// Highest level compiled in, e.g. make LOG_MAX_LEVEL=1. Calls above it are
+// removed with their arguments, as are dump loops guarded by LOG_ENABLED
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_INFO
+#endif
 
 extern int g_log_level;
 
+#define LOG_ENABLED(level) (LOG_MAX_LEVEL >= (level) && g_log_level >= (level))
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+
 #define LOGE(fmt, ...) \
-do { if (g_log_level >= LOG_ERROR) \
-    fprintf(stderr, "[ERROR] " fmt , ##__VA_ARGS__); } while (0)
+do { if (LOG_ENABLED(LOG_ERROR)) \
+    log_write(LOG_ERROR, "[ERROR] " fmt , ##__VA_ARGS__); } while (0)
 
 #define LOGW(fmt, ...) \
-do { if (g_log_level >= LOG_WARN) \
-    fprintf(stderr, "[WARN ] " fmt , ##__VA_ARGS__); } while (0)
+do { if (LOG_ENABLED(LOG_WARN)) \
+    log_write(LOG_WARN, "[WARN ] " fmt , ##__VA_ARGS__); } while (0)
 
 #define LOGI(fmt, ...) \
-do { if (g_log_level >= LOG_INFO) \
-    fprintf(stderr, "[INFO ] " fmt , ##__VA_ARGS__); } while (0)
+do { if (LOG_ENABLED(LOG_INFO)) \
+    log_write(LOG_INFO, "[INFO ] " fmt , ##__VA_ARGS__); } while (0)
 
 #define LOGI_RAW(fmt, ...) \
-do { if (g_log_level >= LOG_INFO) \
-    fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+do { if (LOG_ENABLED(LOG_INFO)) \
+    log_write(LOG_INFO, fmt, ##__VA_ARGS__); } while (0)
@@ -5,26 +5,47 @@
 #include "bmp/bmp.h"
 #include "png/png.h"
 #include "png/png_write.h"
+#include "batch.h"
 #include "display/display.h"
 #include "log.h"
 
 int g_log_level = LOG_WARN;
 
 void printUsage() {
-    printf("Usage: ./parser [OPTIONS] INPUT_FILE\n\n");
+    printf("Usage: ./parser [OPTIONS] INPUT_FILE\n");
+    printf("       ./parser --probe INPUT_FILE...\n");
+    printf("       ./parser --batch [OPTIONS] INPUT...\n\n");
     printf("Arguments:\n");
     printf("  INPUT_FILE\tPath to the input file to parse (required)\n\n");
     printf("Options:\n");
     printf("  -d, --disp, --display\tDisplay the parsed image\n");
     printf("  -s, --save\tSave the raw pixels back to a png file\n");
+    printf("  --level=0-9\tCompression level for --save (0=fastest, 9=smallest, default %d)\n",
+           DEFLATE_DEFAULT_LEVEL);
+    printf("  --threads=N\tCompress --save output on N threads (default 1)\n");
+    printf("  --decode-threads=N\tInflate large images on N threads when the encoder\n");
+    printf("           \tleft flush points, e.g. --threads output (default 1)\n");
+    printf("  --filter=none|sub|up|avg|paeth|adaptive|brute\n");
+    printf("           \tRow filter selection for --save (default adaptive)\n");
+    printf("  --probe\tOnly read the headers, print one line per file:\n");
+    printf("         \tFILE FORMAT WIDTH HEIGHT DEPTH COLOR_TYPE INTERLACED\n");
+    printf("  --batch\tProcess many inputs on a worker pool, INPUT is a file, a directory\n");
+    printf("         \tor - for a list of paths on stdin. Decodes, or with --save\n");
+    printf("         \tre-encodes into --out-dir, or with --probe reads headers\n");
+    printf("  --jobs=N\tBatch worker threads (default one per CPU)\n");
+    printf("  --out-dir=DIR\tWhere --batch --save writes its files\n");
+    printf("  --stats\tPrint decoder stage timings and counters as JSON on stderr,\n");
+    printf("         \tneeds a make STATS=1 build\n");
     printf("  --log=0|1|2\tSpecify log level (0=ERROR, 1=WARNING, 2=INFO)\n");
     printf("  -h, --help\tShow this help message and exit\n\n");
     printf("Examples:\n");
     printf("  ./parser image.png\n");
     printf("  ./parser --display image.png\n");
+    printf("  ./parser --probe *.png\n");
+    printf("  find . -name '*.png' | ./parser --batch --jobs=8 -\n");
 }
 
-struct output_image *openImage(char *filename) {
+struct output_image *openImage(char *filename, int threads, int stats) {
     char *ext = strrchr(filename, '.');
     if (ext == NULL) {
         printf("Error: No file extension found in \"%s\"\n", filename);
@@ -34,22 +55,68 @@ struct output_image *openImage(char *filename) {
     if (strcasecmp(ext, ".bmp") == 0) {
         bmp_open(filename);
     } else if (strcasecmp(ext, ".png") == 0) {
-        return png_open(filename);
+        struct png_decoder decoder;
+        png_decoderInit(&decoder, NULL);
+        decoder.threads = threads;
+        struct output_image *image = png_decode(&decoder, filename);
+        if (stats) {
+            png_statsPrint(&decoder.stats, stderr);
+        }
+        png_decoderRelease(&decoder);
+        return image;
     } else {
         printf("Error: Unsupported file format \"%s\"\n", ext);
     }
     return NULL;
 }
 
+// Print the header metadata of one file as a tab separated line
+int probeImage(char *filename) {
+    struct image_probe probe;
+    const char *format = NULL;
+    int res = -1;
+
+    char *ext = strrchr(filename, '.');
+    if (ext && strcasecmp(ext, ".png") == 0) {
+        format = "png";
+        res = png_probe(filename, &probe);
+    } else if (ext && strcasecmp(ext, ".bmp") == 0) {
+        format = "bmp";
+        res = bmp_probe(filename, &probe);
+    }
+
+    if (res != 1) {
+        printf("%s\terror\n", filename);
+        return -1;
+    }
+    printf("%s\t%s\t%u\t%u\t%u\t%u\t%u\n", filename, format, probe.width, probe.height,
+           probe.bitDepth, probe.colorType, probe.interlaced);
+    return 1;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printUsage();
         return 1;
     }
 
-    char *input_file = NULL;
+    char *inputs[argc];
+    int input_count = 0;
     int display = 0;
+    int probe = 0;
     int save = 0;
+    int batch = 0;
+    int decode_threads = 1;
+    int stats = 0;
+    struct batch_options batch_options = {
+        .jobs = 0,
+        .out_dir = NULL,
+    };
+    struct png_writeOptions write_options = {
+        .level = DEFLATE_DEFAULT_LEVEL,
+        .threads = 1,
+        .filter = PNG_FILTER_ADAPTIVE,
+    };
 
     // Iterate over arguments
     for (int i = 1; i < argc; i++) {
@@ -68,19 +135,70 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Invalid log level: %d\n", g_log_level);
                 return 1;
             }
+            if (g_log_level > LOG_MAX_LEVEL) {
+                fprintf(stderr, "Warning: log level %d is compiled out, built with "
+                        "LOG_MAX_LEVEL=%d\n", g_log_level, LOG_MAX_LEVEL);
+            }
+        } else if (strncmp(argv[i], "--level=", 8) == 0)
+        {
+            write_options.level = atoi(argv[i] + 8);
+            if (write_options.level < 0 || write_options.level > DEFLATE_MAX_LEVEL) {
+                fprintf(stderr, "Invalid compression level: %d\n", write_options.level);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            write_options.threads = atoi(argv[i] + 10);
+            if (write_options.threads < 1) {
+                fprintf(stderr, "Invalid thread count: %d\n", write_options.threads);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--decode-threads=", 17) == 0)
+        {
+            decode_threads = atoi(argv[i] + 17);
+            if (decode_threads < 1) {
+                fprintf(stderr, "Invalid thread count: %d\n", decode_threads);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--filter=", 9) == 0)
+        {
+            static const char *filters[] = {"none", "sub", "up", "avg", "paeth", "adaptive", "brute"};
+            write_options.filter = -1;
+            for (int f = 0; f < (int)(sizeof(filters) / sizeof(filters[0])); f++) {
+                if (strcmp(argv[i] + 9, filters[f]) == 0) {
+                    write_options.filter = f;
+                }
+            }
+            if (write_options.filter < 0) {
+                fprintf(stderr, "Invalid filter: %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--probe") == 0)
+        {
+            probe = 1;
+        } else if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats = 1;
+        } else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = 1;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            batch_options.jobs = atoi(argv[i] + 7);
+            if (batch_options.jobs < 1) {
+                fprintf(stderr, "Invalid job count: %d\n", batch_options.jobs);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--out-dir=", 10) == 0)
+        {
+            batch_options.out_dir = argv[i] + 10;
         } else if (strcmp(argv[i], "-s") == 0 ||
             strcmp(argv[i], "--save") == 0)
         {
             save = 1;
-        } else if (argv[i][0] != '-') {
-            // first non-flag argument is INPUT_FILE
-            if (!input_file) {
-                input_file = argv[i];
-            } else {
-                fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
-                printUsage();
-                return 1;
-            }
+        } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            // INPUT_FILE, --probe and --batch take any number
+            inputs[input_count++] = argv[i];
         } else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             printUsage();
@@ -88,13 +206,44 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (!input_file) {
+    if (input_count == 0) {
         fprintf(stderr, "Error: INPUT_FILE is required\n");
         printUsage();
         return 1;
     }
 
-    struct output_image *image = openImage(input_file);
+    if (stats && !PNG_STATS_ENABLED) {
+        fprintf(stderr, "Warning: built without STATS=1, --stats will be all zeros\n");
+    }
+
+    if (batch) {
+        batch_options.stats = stats;
+        batch_options.mode = probe ? BATCH_PROBE : save ? BATCH_SAVE : BATCH_DECODE;
+        batch_options.write_options = &write_options;
+        if (batch_options.mode == BATCH_SAVE && batch_options.out_dir == NULL) {
+            fprintf(stderr, "Error: --batch --save needs --out-dir\n");
+            return 1;
+        }
+        return batch_run(inputs, input_count, &batch_options);
+    }
+
+    if (probe) {
+        int failed = 0;
+        for (int i = 0; i < input_count; i++) {
+            if (probeImage(inputs[i]) != 1) {
+                failed = 1;
+            }
+        }
+        return failed;
+    }
+
+    if (input_count > 1) {
+        fprintf(stderr, "Unexpected argument: more than one INPUT_FILE\n");
+        printUsage();
+        return 1;
+    }
+
+    struct output_image *image = openImage(inputs[0], decode_threads, stats);
     if (image == NULL) {
         printf("Error opening the image\n");
         return 1;
@@ -105,7 +254,8 @@ int main(int argc, char **argv) {
     }
 
     if (save) {
-        png_save("output.png", image->pixels, image->width, image->height, image->bpp);
+        png_save("output.png", image->pixels, image->width, image->height, image->bpp,
+                 &write_options);
     }
 
     free(image->pixels);
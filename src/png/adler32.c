@@ -0,0 +1,160 @@
+#include "adler32.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ADLER32_X86 1
+#endif
+
+/*
+ * Both sums are reduced once per ADLER32_NMAX bytes rather than once per
+ * byte. The vector kernels go 32 bytes at a time: a += sum(x[i]) and
+ * b += 32 * a_before + sum((32 - i) * x[i]), with the 32 * a_before terms
+ * collected in ps and added once per NMAX run.
+ */
+static uint32_t adler32_scalar(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    while (len > 0) {
+        size_t n = len < ADLER32_NMAX ? len : ADLER32_NMAX;
+        len -= n;
+        while (n >= 8) {
+            a += data[0]; b += a;
+            a += data[1]; b += a;
+            a += data[2]; b += a;
+            a += data[3]; b += a;
+            a += data[4]; b += a;
+            a += data[5]; b += a;
+            a += data[6]; b += a;
+            a += data[7]; b += a;
+            data += 8;
+            n -= 8;
+        }
+        while (n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
+    }
+    return (b << 16) | a;
+}
+
+#ifdef ADLER32_X86
+static inline uint32_t hsum_epi32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("ssse3")))
+static uint32_t adler32_ssse3(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    size_t blocks = len / 32;
+
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (blocks > 0) {
+        size_t n = blocks < ADLER32_NMAX / 32 ? blocks : ADLER32_NMAX / 32;
+        blocks -= n;
+
+        __m128i v_ps = _mm_cvtsi32_si128((int)(a * n));
+        __m128i v_a = zero;
+        __m128i v_b = _mm_cvtsi32_si128((int)b);
+        do {
+            __m128i x1 = _mm_loadu_si128((const __m128i *)data);
+            __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+            v_ps = _mm_add_epi32(v_ps, v_a);
+            v_a = _mm_add_epi32(v_a, _mm_sad_epu8(x1, zero));
+            v_a = _mm_add_epi32(v_a, _mm_sad_epu8(x2, zero));
+            v_b = _mm_add_epi32(v_b, _mm_madd_epi16(_mm_maddubs_epi16(x1, tap1), ones));
+            v_b = _mm_add_epi32(v_b, _mm_madd_epi16(_mm_maddubs_epi16(x2, tap2), ones));
+            data += 32;
+        } while (--n);
+        v_b = _mm_add_epi32(v_b, _mm_slli_epi32(v_ps, 5));
+
+        a = (a + hsum_epi32(v_a)) % ADLER32_BASE;
+        b = hsum_epi32(v_b) % ADLER32_BASE;
+    }
+    return adler32_scalar((b << 16) | a, data, len % 32);
+}
+
+__attribute__((target("avx2")))
+static uint32_t adler32_avx2(uint32_t adler, const uint8_t *data, size_t len) {
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    size_t blocks = len / 32;
+
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                         24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9,
+                                         8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    while (blocks > 0) {
+        size_t n = blocks < ADLER32_NMAX / 32 ? blocks : ADLER32_NMAX / 32;
+        blocks -= n;
+
+        __m256i v_ps = _mm256_setr_epi32((int)(a * n), 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_a = zero;
+        __m256i v_b = _mm256_setr_epi32((int)b, 0, 0, 0, 0, 0, 0, 0);
+        do {
+            __m256i x = _mm256_loadu_si256((const __m256i *)data);
+            v_ps = _mm256_add_epi32(v_ps, v_a);
+            v_a = _mm256_add_epi32(v_a, _mm256_sad_epu8(x, zero));
+            v_b = _mm256_add_epi32(v_b, _mm256_madd_epi16(_mm256_maddubs_epi16(x, tap), ones));
+            data += 32;
+        } while (--n);
+        v_b = _mm256_add_epi32(v_b, _mm256_slli_epi32(v_ps, 5));
+
+        __m128i sum_a = _mm_add_epi32(_mm256_castsi256_si128(v_a), _mm256_extracti128_si256(v_a, 1));
+        __m128i sum_b = _mm_add_epi32(_mm256_castsi256_si128(v_b), _mm256_extracti128_si256(v_b, 1));
+        a = (a + hsum_epi32(sum_a)) % ADLER32_BASE;
+        b = hsum_epi32(sum_b) % ADLER32_BASE;
+    }
+    return adler32_scalar((b << 16) | a, data, len % 32);
+}
+#endif
+
+static uint32_t (*adler32_kernel)(uint32_t adler, const uint8_t *data, size_t len);
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+    adler32_kernel = adler32_scalar;
+#ifdef ADLER32_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        adler32_kernel = adler32_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        adler32_kernel = adler32_ssse3;
+    }
+#endif
+}
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t len) {
+    pthread_once(&kernel_once, select_kernel);
+    return adler32_kernel(adler, data, len);
+}
+
+// Adler-32 of A followed by B, from the checksums of A and B and the length of B
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    const uint32_t base = ADLER32_BASE;
+    uint32_t rem = len2 % base;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= base * 2) sum2 -= base * 2;
+    if (sum2 >= base) sum2 -= base;
+    return (sum2 << 16) | sum1;
+}
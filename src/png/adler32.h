@@ -0,0 +1,14 @@
+#ifndef ADLER32_H
+#define ADLER32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADLER32_BASE 65521
+// Most bytes that can be summed before b may overflow 32 bits
+#define ADLER32_NMAX 5552
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t len);
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+
+#endif  // ADLER32_H
@@ -0,0 +1,913 @@
+#include "deflate.h"
+#include "adler32.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*                  LENGTH TABLE                    */
+//      Extra               Extra               Extra
+// Code Bits Length(s) Code Bits Lengths   Code Bits Length(s)
+// ---- ---- ------     ---- ---- -------   ---- ---- -------
+//  257   0     3       267   1   15,16     277   4   67-82
+//  258   0     4       268   1   17,18     278   4   83-98
+//  259   0     5       269   2   19-22     279   4   99-114
+//  260   0     6       270   2   23-26     280   4  115-130
+//  261   0     7       271   2   27-30     281   5  131-162
+//  262   0     8       272   2   31-34     282   5  163-194
+//  263   0     9       273   3   35-42     283   5  195-226
+//  264   0    10       274   3   43-50     284   5  227-257
+//  265   1  11,12      275   3   51-58     285   0    258
+//  266   1  13,14      276   3   59-66
+//
+/*                  DISTANCE TABLE                  */
+//      Extra           Extra               Extra
+// Code Bits Dist  Code Bits   Dist     Code Bits Distance
+// ---- ---- ----  ---- ----  ------    ---- ---- --------
+//   0   0    1     10   4     33-48    20    9   1025-1536
+//   1   0    2     11   4     49-64    21    9   1537-2048
+//   2   0    3     12   5     65-96    22   10   2049-3072
+//   3   0    4     13   5     97-128   23   10   3073-4096
+//   4   1   5,6    14   6    129-192   24   11   4097-6144
+//   5   1   7,8    15   6    193-256   25   11   6145-8192
+//   6   2   9-12   16   7    257-384   26   12  8193-12288
+//   7   2  13-16   17   7    385-512   27   12 12289-16384
+//   8   3  17-24   18   8    513-768   28   13 16385-24576
+//   9   3  25-32   19   8   769-1024   29   13 24577-32768
+const uint16_t deflate_dist_base[30] = {
+    1,2,3,4,         // 0-3
+    5,7,9,13,        // 4-7
+    17,25,33,49,     // 8-11
+    65,97,129,193,   // 12-15
+    257,385,513,769, // 16-19
+    1025,1537,2049,3073, // 20-23
+    4097,6145,8193,12289,// 24-27
+    16385,24577         // 28-29
+};
+const uint8_t deflate_dist_extra[30] = {
+    0,0,0,0,
+    1,1,2,2,
+    3,3,4,4,
+    5,5,6,6,
+    7,7,8,8,
+    9,9,10,10,
+    11,11,12,12,
+    13,13
+};
+const uint16_t deflate_len_base[29] = {
+    3,4,5,6,7,8,9,10,   // 257-264
+    11,13,15,17,         // 265-268
+    19,23,27,31,         // 269-272
+    35,43,51,59,         // 273-276
+    67,83,99,115,        // 277-280
+    131,163,195,227,     // 281-284
+    258                  // 285
+};
+const uint8_t deflate_len_extra[29] = {
+    0,0,0,0,0,0,0,0,   // 257-264
+    1,1,1,1,            // 265-268
+    2,2,2,2,            // 269-272
+    3,3,3,3,            // 273-276
+    4,4,4,4,            // 277-280
+    5,5,5,5,            // 281-284
+    0                   // 285
+};
+
+// Order in which the code length code lengths are transmitted
+const uint8_t deflate_cl_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5,
+    11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/*
+ * Match finder tuning per compression level, as in zlib:
+ *   good_length  shorten the chain search once we already have a match this long
+ *   max_lazy     only look for a better match at the next byte below this length
+ *                (for greedy levels: only index the inside of matches up to this length)
+ *   nice_length  stop searching as soon as a match is this long
+ *   max_chain    maximum number of hash chain entries to visit
+ */
+struct deflateConfig {
+    uint16_t good_length;
+    uint16_t max_lazy;
+    uint16_t nice_length;
+    uint16_t max_chain;
+    uint8_t lazy;
+};
+
+static const struct deflateConfig deflate_configs[DEFLATE_MAX_LEVEL + 1] = {
+    {0,   0,   0,    0, 0}, // 0: stored blocks only
+    {4,   4,   8,    4, 0}, // 1: fastest
+    {4,   5,  16,    8, 0},
+    {4,   6,  32,   32, 0},
+    {4,   4,  16,   16, 1}, // 4: lazy matching from here on
+    {8,  16,  32,   32, 1},
+    {8,  16, 128,  128, 1}, // 6: default
+    {8,  32, 128,  256, 1},
+    {32, 128, 258, 1024, 1},
+    {32, 258, 258, 4096, 1}, // 9: smallest output
+};
+
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define WMASK (DEFLATE_WSIZE - 1)
+#define BLOCK_TOKENS 16384
+#define TOO_FAR 4096 // 3-byte matches further back than this cost more than literals
+#define STORED_MAX 65535 // largest stored block
+#define LL_CODES 286
+#define DIST_CODES 30
+#define CL_CODES 19
+
+struct deflateState {
+    const uint8_t *data;
+    size_t end;
+    size_t inserted; // next position to enter into the hash chains
+    const struct deflateConfig *config;
+
+    int32_t head[HASH_SIZE];     // most recent position for each hash
+    int32_t prev[DEFLATE_WSIZE]; // previous position with the same hash, by pos & WMASK
+
+    struct deflateToken tokens[BLOCK_TOKENS];
+    size_t ntokens;
+    size_t block_start; // first input byte covered by the pending tokens
+    size_t block_bytes; // input bytes covered by the pending tokens
+};
+
+/* Fixed literal/length and distance codes, already bit-reversed for the LSB-first writer */
+static struct huffmanCode fixed_codes[288];
+static struct huffmanCode fixed_dist_codes[30];
+
+/* Length (3..258) to length code (0..28) and distance to distance code lookups */
+static uint8_t len_code[DEFLATE_MAX_MATCH + 1];
+static uint8_t dist_code[512];
+
+/* The tables are computed once, even with several compressing threads. */
+static pthread_once_t deflate_tables_once = PTHREAD_ONCE_INIT;
+
+void build_canonical_huffman(uint8_t *lengths, uint32_t num_symbols,
+                             uint32_t *codes, uint32_t max_bits) {
+    uint32_t bl_count[16] = {0};
+
+    // Count codes of each length
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        if (lengths[i] > 0) {
+            bl_count[lengths[i]]++;
+        }
+    }
+
+    // Find first code for each length
+    uint32_t next_code[16] = {0};
+    uint32_t code = 0;
+    for (uint32_t bits = 1; bits < max_bits; bits++) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+
+    // Assign codes to symbols
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        uint32_t len = lengths[i];
+        if (len > 0) {
+            codes[i] = next_code[len];
+            next_code[len]++;
+        }
+    }
+}
+
+struct huffmanCode fixed_huffman_code(uint16_t symbol) {
+    struct huffmanCode hc;
+    if (symbol <= 143) {
+        hc.code = 0b00110000 + (symbol - 0);
+        hc.length = 8;
+    } else if (symbol <= 255) {
+        hc.code = 0b110010000 + (symbol - 144);
+        hc.length = 9;
+    } else if (symbol <= 279) {
+        hc.code = 0b0000000 + (symbol - 256);
+        hc.length = 7;
+    } else if (symbol <= 287) {
+        hc.code = 0b11000000 + (symbol - 280);
+        hc.length = 8;
+    } else {
+        hc.code = 0;
+        hc.length = 0; // invalid
+    }
+    return hc;
+}
+
+static void make_deflate_tables(void) {
+    for (uint16_t symbol = 0; symbol < 288; symbol++) {
+        struct huffmanCode hc = fixed_huffman_code(symbol);
+        hc.code = reverse_bits(hc.code, hc.length);
+        fixed_codes[symbol] = hc;
+    }
+    for (uint16_t symbol = 0; symbol < 30; symbol++) {
+        fixed_dist_codes[symbol].code = reverse_bits(symbol, 5);
+        fixed_dist_codes[symbol].length = 5;
+    }
+
+    for (int code = 0; code < 29; code++) {
+        int count = 1 << deflate_len_extra[code];
+        for (int i = 0; i < count && deflate_len_base[code] + i <= DEFLATE_MAX_MATCH; i++) {
+            len_code[deflate_len_base[code] + i] = code;
+        }
+    }
+    len_code[DEFLATE_MAX_MATCH] = 28; // 258 has its own code, not 284 + 31
+
+    // Distances up to 256 are looked up directly, longer ones by (dist - 1) >> 7
+    for (int code = 0; code < 30; code++) {
+        int count = 1 << deflate_dist_extra[code];
+        for (int i = 0; i < count; i++) {
+            int d = deflate_dist_base[code] + i - 1;
+            if (d < 256) {
+                dist_code[d] = code;
+            } else {
+                dist_code[256 + (d >> 7)] = code;
+            }
+        }
+    }
+}
+
+static inline uint32_t dist_to_code(uint32_t dist) {
+    return dist <= 256 ? dist_code[dist - 1] : dist_code[256 + ((dist - 1) >> 7)];
+}
+
+// Worst-case compressed size: fixed-code literals take 9 bits, plus block
+// overhead and the sync flush of every parallel segment
+size_t deflate_bound(size_t size) {
+    return size + size / 8 + (size / BLOCK_TOKENS + 1) * 2 + (size / DEFLATE_SEGMENT_MIN + 1) * 24 + 16;
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Enter every position up to and including pos into the hash chains
+static inline void insert_upto(struct deflateState *s, size_t pos) {
+    // Only positions with MIN_MATCH bytes left can start a match
+    size_t stop = pos + 1;
+    if (stop + DEFLATE_MIN_MATCH - 1 > s->end) {
+        stop = s->end >= DEFLATE_MIN_MATCH ? s->end - DEFLATE_MIN_MATCH + 1 : 0;
+    }
+    for (size_t p = s->inserted; p < stop; p++) {
+        uint32_t h = hash3(s->data + p);
+        s->prev[p & WMASK] = s->head[h];
+        s->head[h] = (int32_t)p;
+    }
+    if (pos + 1 > s->inserted) {
+        s->inserted = pos + 1;
+    }
+}
+
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t max_len) {
+    size_t n = 0;
+    while (n + 8 <= max_len) {
+        uint64_t diff = load_le64(a + n) ^ load_le64(b + n);
+        if (diff) {
+            return n + (__builtin_ctzll(diff) >> 3);
+        }
+        n += 8;
+    }
+    while (n < max_len && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Longest match for pos (already inserted) that beats prev_len, 0 if none
+static size_t longest_match(struct deflateState *s, size_t pos, size_t prev_len, uint32_t *dist) {
+    const struct deflateConfig *c = s->config;
+    size_t max_len = s->end - pos;
+    if (max_len > DEFLATE_MAX_MATCH) max_len = DEFLATE_MAX_MATCH;
+    if (max_len < DEFLATE_MIN_MATCH || prev_len >= max_len) return 0;
+
+    size_t nice = c->nice_length < max_len ? c->nice_length : max_len;
+    uint32_t chain = c->max_chain;
+    if (prev_len >= c->good_length) chain >>= 2;
+
+    int64_t limit = (int64_t)pos - DEFLATE_WSIZE;
+    const uint8_t *cur = s->data + pos;
+    size_t best = prev_len < DEFLATE_MIN_MATCH - 1 ? DEFLATE_MIN_MATCH - 1 : prev_len;
+    uint32_t best_dist = 0;
+
+    int32_t cand = s->prev[pos & WMASK];
+    while (cand >= 0 && cand >= limit && chain-- > 0) {
+        const uint8_t *m = s->data + cand;
+        if (m[best] == cur[best] && m[0] == cur[0] && m[1] == cur[1]) {
+            size_t len = match_length(cur, m, max_len);
+            if (len > best) {
+                best = len;
+                best_dist = (uint32_t)(pos - cand);
+                if (len >= nice) break;
+            }
+        }
+        int32_t next = s->prev[cand & WMASK];
+        if (next >= cand) break; // slot reused by a newer position, the chain ends here
+        cand = next;
+    }
+
+    if (best_dist == 0) return 0;
+    if (best == DEFLATE_MIN_MATCH && best_dist > TOO_FAR) return 0;
+    *dist = best_dist;
+    return best;
+}
+
+/*
+ * Huffman code lengths for the given symbol frequencies, limited to max_bits.
+ * Code lengths come from Moffat's in-place algorithm over the frequency-sorted
+ * symbols; if the tree is too deep the per-length counts are rebalanced so the
+ * Kraft sum is exact again, and lengths are handed out longest-first to the
+ * least frequent symbols.
+ */
+struct symFreq {
+    uint32_t freq;
+    uint16_t sym;
+};
+
+static int compare_sym_freq(const void *a, const void *b) {
+    const struct symFreq *x = a, *y = b;
+    if (x->freq != y->freq) return x->freq < y->freq ? -1 : 1;
+    return (int)x->sym - (int)y->sym;
+}
+
+static void build_code_lengths(const uint32_t *freqs, int num_symbols, int max_bits,
+                               uint8_t *lengths) {
+    struct symFreq items[LL_CODES];
+    uint32_t depth[LL_CODES];
+    int n = 0;
+
+    memset(lengths, 0, num_symbols);
+    for (int i = 0; i < num_symbols; i++) {
+        if (freqs[i]) {
+            items[n].freq = freqs[i];
+            items[n].sym = i;
+            n++;
+        }
+    }
+    if (n == 0) return;
+    if (n == 1) {
+        lengths[items[0].sym] = 1;
+        return;
+    }
+    qsort(items, n, sizeof(items[0]), compare_sym_freq);
+
+    // Moffat & Katajainen: parent pointers, then depths, in one array
+    uint32_t *a = depth;
+    for (int i = 0; i < n; i++) a[i] = items[i].freq;
+    a[0] += a[1];
+    int root = 0, leaf = 2, next;
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--) {
+        a[next] = a[a[next]] + 1;
+    }
+    int avail = 1, used = 0;
+    uint32_t d = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avail > 0) {
+        while (root >= 0 && a[root] == d) {
+            used++;
+            root--;
+        }
+        while (avail > used) {
+            a[next--] = d;
+            avail--;
+        }
+        avail = 2 * used;
+        d++;
+        used = 0;
+    }
+
+    // Count codes per length, folding anything too long into max_bits
+    uint32_t bl_count[LL_CODES + 1] = {0};
+    for (int i = 0; i < n; i++) {
+        bl_count[a[i] > (uint32_t)max_bits ? (uint32_t)max_bits : a[i]]++;
+    }
+    uint32_t total = 0;
+    for (int len = max_bits; len > 0; len--) {
+        total += bl_count[len] << (max_bits - len);
+    }
+    while (total != (1u << max_bits)) {
+        bl_count[max_bits]--;
+        for (int len = max_bits - 1; len > 0; len--) {
+            if (bl_count[len]) {
+                bl_count[len]--;
+                bl_count[len + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    int k = 0;
+    for (int len = max_bits; len > 0; len--) {
+        for (uint32_t i = 0; i < bl_count[len]; i++) {
+            lengths[items[k++].sym] = len;
+        }
+    }
+}
+
+// Bit-reversed canonical codes for a set of code lengths
+static void build_codes(uint8_t *lengths, int num_symbols, struct huffmanCode *codes) {
+    uint32_t canonical[LL_CODES];
+    build_canonical_huffman(lengths, num_symbols, canonical, 16);
+    for (int i = 0; i < num_symbols; i++) {
+        codes[i].length = lengths[i];
+        codes[i].code = lengths[i] ? reverse_bits(canonical[i], lengths[i]) : 0;
+    }
+}
+
+// Run-length encoding of the concatenated code lengths (symbols 16, 17, 18)
+struct clToken {
+    uint8_t sym;
+    uint8_t extra;
+};
+
+static int encode_code_lengths(const uint8_t *lens, int count, struct clToken *out) {
+    int n = 0;
+    int i = 0;
+    while (i < count) {
+        uint8_t cur = lens[i];
+        int run = 1;
+        while (i + run < count && lens[i + run] == cur) run++;
+        i += run;
+
+        if (cur == 0) {
+            while (run >= 11) {
+                int r = run < 138 ? run : 138;
+                out[n++] = (struct clToken){18, r - 11};
+                run -= r;
+            }
+            if (run >= 3) {
+                out[n++] = (struct clToken){17, run - 3};
+                run = 0;
+            }
+        } else {
+            out[n++] = (struct clToken){cur, 0};
+            run--;
+            while (run >= 3) {
+                int r = run < 6 ? run : 6;
+                out[n++] = (struct clToken){16, r - 3};
+                run -= r;
+            }
+        }
+        while (run-- > 0) {
+            out[n++] = (struct clToken){cur, 0};
+        }
+    }
+    return n;
+}
+
+static const uint8_t cl_extra_bits[CL_CODES] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 2, 3, 7
+};
+
+static int write_tokens(struct deflateState *s, struct bitStream *bs,
+                        const struct huffmanCode *ll_codes,
+                        const struct huffmanCode *dist_codes) {
+    int err = 0;
+    for (size_t i = 0; i < s->ntokens; i++) {
+        struct deflateToken t = s->tokens[i];
+        if (t.dist == 0) {
+            struct huffmanCode hc = ll_codes[t.litlen];
+            err |= bitstream_write(bs, hc.length, hc.code);
+            continue;
+        }
+
+        uint32_t lc = len_code[t.litlen];
+        struct huffmanCode hc = ll_codes[257 + lc];
+        err |= bitstream_write(bs, hc.length, hc.code);
+        if (deflate_len_extra[lc]) {
+            err |= bitstream_write(bs, deflate_len_extra[lc], t.litlen - deflate_len_base[lc]);
+        }
+
+        uint32_t dc = dist_to_code(t.dist);
+        hc = dist_codes[dc];
+        err |= bitstream_write(bs, hc.length, hc.code);
+        if (deflate_dist_extra[dc]) {
+            err |= bitstream_write(bs, deflate_dist_extra[dc], t.dist - deflate_dist_base[dc]);
+        }
+    }
+
+    struct huffmanCode eob = ll_codes[256];
+    err |= bitstream_write(bs, eob.length, eob.code);
+    return err;
+}
+
+// Stored blocks for data[0..size), split at 64K
+static int write_stored(const uint8_t *data, size_t size, struct bitStream *bs, int final) {
+    int err = 0;
+    do {
+        uint32_t len = size < STORED_MAX ? (uint32_t)size : STORED_MAX;
+        size -= len;
+        err |= bitstream_write(bs, 1, final && size == 0); // BFINAL
+        err |= bitstream_write(bs, 2, 0);                  // BTYPE stored
+        err |= bitstream_flush(bs);
+        err |= bitstream_write(bs, 16, len);
+        err |= bitstream_write(bs, 16, len ^ 0xFFFF);
+        if (len > 0) {
+            err |= bitstream_write_bytes(bs, data, len);
+            data += len;
+        }
+    } while (size > 0);
+    return err;
+}
+
+static uint64_t stored_cost(size_t size) {
+    size_t blocks = size / STORED_MAX + 1;
+    return blocks * (3 + 7 + 32) + (uint64_t)size * 8;
+}
+
+/*
+ * Write the pending tokens as one block, picking whichever of stored, fixed
+ * or dynamic Huffman comes out smallest for them.
+ */
+static int write_block(struct deflateState *s, struct bitStream *bs, int final) {
+    uint32_t ll_freq[LL_CODES] = {0};
+    uint32_t dist_freq[DIST_CODES] = {0};
+    uint64_t extra_bits = 0;
+
+    for (size_t i = 0; i < s->ntokens; i++) {
+        struct deflateToken t = s->tokens[i];
+        if (t.dist == 0) {
+            ll_freq[t.litlen]++;
+        } else {
+            uint32_t lc = len_code[t.litlen];
+            uint32_t dc = dist_to_code(t.dist);
+            ll_freq[257 + lc]++;
+            dist_freq[dc]++;
+            extra_bits += deflate_len_extra[lc] + deflate_dist_extra[dc];
+        }
+    }
+    ll_freq[256] = 1;
+
+    // Decoders want at least one distance code; two keeps every tree a real tree
+    uint32_t dist_tree_freq[DIST_CODES];
+    int dist_used = 0;
+    for (int i = 0; i < DIST_CODES; i++) {
+        dist_tree_freq[i] = dist_freq[i];
+        dist_used += dist_freq[i] != 0;
+    }
+    for (int i = 0; dist_used < 2; i++) {
+        if (!dist_tree_freq[i]) {
+            dist_tree_freq[i] = 1;
+            dist_used++;
+        }
+    }
+
+    uint8_t ll_lens[LL_CODES];
+    uint8_t dist_lens[DIST_CODES];
+    build_code_lengths(ll_freq, LL_CODES, 15, ll_lens);
+    build_code_lengths(dist_tree_freq, DIST_CODES, 15, dist_lens);
+
+    int hlit = LL_CODES;
+    while (hlit > 257 && ll_lens[hlit - 1] == 0) hlit--;
+    int hdist = DIST_CODES;
+    while (hdist > 1 && dist_lens[hdist - 1] == 0) hdist--;
+
+    uint8_t lens[LL_CODES + DIST_CODES];
+    memcpy(lens, ll_lens, hlit);
+    memcpy(lens + hlit, dist_lens, hdist);
+
+    struct clToken cl_tokens[LL_CODES + DIST_CODES];
+    int ncl = encode_code_lengths(lens, hlit + hdist, cl_tokens);
+    uint32_t cl_freq[CL_CODES] = {0};
+    for (int i = 0; i < ncl; i++) cl_freq[cl_tokens[i].sym]++;
+    uint8_t cl_lens[CL_CODES];
+    build_code_lengths(cl_freq, CL_CODES, 7, cl_lens);
+    int hclen = CL_CODES;
+    while (hclen > 4 && cl_lens[deflate_cl_order[hclen - 1]] == 0) hclen--;
+
+    // Estimated sizes in bits
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra_bits;
+    for (int i = 0; i < ncl; i++) {
+        dynamic_bits += cl_lens[cl_tokens[i].sym] + cl_extra_bits[cl_tokens[i].sym];
+    }
+    uint64_t fixed_bits = 3 + extra_bits;
+    for (int i = 0; i < LL_CODES; i++) {
+        dynamic_bits += (uint64_t)ll_freq[i] * ll_lens[i];
+        fixed_bits += (uint64_t)ll_freq[i] * fixed_codes[i].length;
+    }
+    for (int i = 0; i < DIST_CODES; i++) {
+        dynamic_bits += (uint64_t)dist_freq[i] * dist_lens[i];
+        fixed_bits += (uint64_t)dist_freq[i] * 5;
+    }
+
+    int err = 0;
+    if (stored_cost(s->block_bytes) <= dynamic_bits && stored_cost(s->block_bytes) <= fixed_bits) {
+        err = write_stored(s->data + s->block_start, s->block_bytes, bs, final);
+    } else if (fixed_bits <= dynamic_bits) {
+        err |= bitstream_write(bs, 1, final); // BFINAL
+        err |= bitstream_write(bs, 2, 1);     // BTYPE fixed Huffman
+        err |= write_tokens(s, bs, fixed_codes, fixed_dist_codes);
+    } else {
+        struct huffmanCode ll_codes[LL_CODES];
+        struct huffmanCode dist_codes[DIST_CODES];
+        struct huffmanCode cl_codes[CL_CODES];
+        build_codes(ll_lens, LL_CODES, ll_codes);
+        build_codes(dist_lens, DIST_CODES, dist_codes);
+        build_codes(cl_lens, CL_CODES, cl_codes);
+
+        err |= bitstream_write(bs, 1, final); // BFINAL
+        err |= bitstream_write(bs, 2, 2);     // BTYPE dynamic Huffman
+        err |= bitstream_write(bs, 5, hlit - 257);
+        err |= bitstream_write(bs, 5, hdist - 1);
+        err |= bitstream_write(bs, 4, hclen - 4);
+        for (int i = 0; i < hclen; i++) {
+            err |= bitstream_write(bs, 3, cl_lens[deflate_cl_order[i]]);
+        }
+        for (int i = 0; i < ncl; i++) {
+            struct huffmanCode hc = cl_codes[cl_tokens[i].sym];
+            err |= bitstream_write(bs, hc.length, hc.code);
+            if (cl_extra_bits[cl_tokens[i].sym]) {
+                err |= bitstream_write(bs, cl_extra_bits[cl_tokens[i].sym], cl_tokens[i].extra);
+            }
+        }
+        err |= write_tokens(s, bs, ll_codes, dist_codes);
+    }
+
+    s->block_start += s->block_bytes;
+    s->block_bytes = 0;
+    s->ntokens = 0;
+    return err ? -1 : 0;
+}
+
+static inline int emit_token(struct deflateState *s, struct bitStream *bs,
+                             uint16_t litlen, uint16_t dist) {
+    s->tokens[s->ntokens].litlen = litlen;
+    s->tokens[s->ntokens].dist = dist;
+    s->block_bytes += dist ? litlen : 1;
+    if (++s->ntokens == BLOCK_TOKENS) {
+        return write_block(s, bs, 0);
+    }
+    return 0;
+}
+
+// A state with empty hash chains, for deflate_compress_state
+struct deflateState *deflate_state_new(void) {
+    struct deflateState *s = malloc(sizeof(struct deflateState));
+    if (s != NULL) {
+        memset(s->head, 0xFF, sizeof(s->head)); // -1: empty chain
+    }
+    return s;
+}
+
+void deflate_state_free(struct deflateState *s) {
+    free(s);
+}
+
+// Body of deflate_compress_range, s has empty hash chains
+static int compress_range(struct deflateState *s, const struct deflateConfig *c,
+                          const uint8_t *data, size_t dict_start, size_t start, size_t end,
+                          struct bitStream *bs, int final) {
+    s->data = data;
+    s->end = end;
+    s->inserted = dict_start;
+    s->config = c;
+    s->ntokens = 0;
+    s->block_start = start;
+    s->block_bytes = 0;
+
+    if (start > dict_start) {
+        insert_upto(s, start - 1);
+    }
+
+    int err = 0;
+    size_t pos = start;
+
+    while (pos < end && !err) {
+        uint32_t dist = 0;
+        insert_upto(s, pos);
+        size_t len = longest_match(s, pos, 0, &dist);
+
+        if (len == 0) {
+            err |= emit_token(s, bs, data[pos], 0);
+            pos++;
+            continue;
+        }
+
+        // Lazy matching: while the next byte starts a longer match, emit a literal instead
+        while (c->lazy && len < c->max_lazy && pos + 1 < end) {
+            uint32_t next_dist;
+            insert_upto(s, pos + 1);
+            size_t next_len = longest_match(s, pos + 1, len, &next_dist);
+            if (next_len <= len) break;
+            err |= emit_token(s, bs, data[pos], 0);
+            pos++;
+            len = next_len;
+            dist = next_dist;
+        }
+
+        err |= emit_token(s, bs, (uint16_t)len, (uint16_t)dist);
+
+        // Index the inside of the match; greedy levels skip this for long matches
+        if (c->lazy || len <= c->max_lazy) {
+            insert_upto(s, pos + len - 1);
+        } else {
+            s->inserted = pos + len;
+        }
+        pos += len;
+    }
+
+    if (!err && (final || s->ntokens > 0)) {
+        err = write_block(s, bs, final);
+    }
+    if (!err && !final) {
+        err = write_stored(NULL, 0, bs, 0);
+    }
+    return err ? -1 : 0;
+}
+
+static int check_range(int level, size_t dict_start, size_t start, size_t end) {
+    if (level < 0 || level > DEFLATE_MAX_LEVEL || dict_start > start || start > end) {
+        return -1;
+    }
+    pthread_once(&deflate_tables_once, make_deflate_tables);
+    return 0;
+}
+
+/*
+ * Compress data[start..end) as a sequence of DEFLATE blocks. data[dict_start..start)
+ * is already known to the decoder and primes the match finder as a dictionary.
+ * With final set the last block has BFINAL and the output ends unaligned;
+ * otherwise it ends with an empty stored block (a sync flush) on a byte boundary.
+ */
+int deflate_compress_range(const uint8_t *data, size_t dict_start, size_t start, size_t end,
+                           int level, struct bitStream *bs, int final) {
+    if (check_range(level, dict_start, start, end) != 0) {
+        return -1;
+    }
+    const struct deflateConfig *c = &deflate_configs[level];
+    if (c->max_chain == 0) {
+        return write_stored(data + start, end - start, bs, final) ? -1 : 0;
+    }
+
+    struct deflateState *s = deflate_state_new();
+    if (s == NULL) {
+        return -1;
+    }
+    int err = compress_range(s, c, data, dict_start, start, end, bs, final);
+    deflate_state_free(s);
+    return err;
+}
+
+/*
+ * deflate_compress_range with a state from deflate_state_new, for many small
+ * ranges such as trial compressions. Instead of clearing the whole hash
+ * table each time, only the chains this range entered are emptied again
+ * afterwards, so a call costs in proportion to end - dict_start.
+ */
+int deflate_compress_state(struct deflateState *s, const uint8_t *data, size_t dict_start,
+                           size_t start, size_t end, int level, struct bitStream *bs,
+                           int final) {
+    if (check_range(level, dict_start, start, end) != 0) {
+        return -1;
+    }
+    const struct deflateConfig *c = &deflate_configs[level];
+    if (c->max_chain == 0) {
+        return write_stored(data + start, end - start, bs, final) ? -1 : 0;
+    }
+
+    int err = compress_range(s, c, data, dict_start, start, end, bs, final);
+    // insert_upto enters positions with a full hash3 ahead of them only
+    size_t stop = end >= DEFLATE_MIN_MATCH ? end - DEFLATE_MIN_MATCH + 1 : 0;
+    if (stop > s->inserted) stop = s->inserted;
+    for (size_t p = dict_start; p < stop; p++) {
+        s->head[hash3(data + p)] = -1;
+    }
+    return err;
+}
+
+int deflate_compress(const uint8_t *data, size_t size, int level,
+                     struct bitStream *bs) {
+    return deflate_compress_range(data, 0, 0, size, level, bs, 1);
+}
+
+/*
+ * Parallel compression: the input is cut into segments that are compressed
+ * independently on worker threads, each primed with the 32K before it as a
+ * dictionary. Every segment but the last ends in a sync flush, so the outputs
+ * are byte aligned and concatenate into one valid DEFLATE stream.
+ */
+struct deflateSegment {
+    size_t start;
+    size_t end;
+    uint8_t *out;
+    size_t out_len;
+    uint32_t adler;
+    int err;
+};
+
+struct deflateParallelJob {
+    const uint8_t *data;
+    int level;
+    struct deflateSegment *segments;
+    int nsegments;
+    int next; // next segment to pick up, shared by the workers
+};
+
+static void compress_segment(struct deflateParallelJob *job, int index) {
+    struct deflateSegment *seg = &job->segments[index];
+    size_t dict_start = seg->start > DEFLATE_WSIZE ? seg->start - DEFLATE_WSIZE : 0;
+    size_t cap = deflate_bound(seg->end - seg->start) + 8; // + sync flush
+
+    seg->adler = adler32_update(1, job->data + seg->start, seg->end - seg->start);
+    seg->out = malloc(cap);
+    if (seg->out == NULL) {
+        seg->err = -1;
+        return;
+    }
+
+    struct bitStream bs;
+    bitstream_init(&bs, seg->out, cap);
+    int final = index == job->nsegments - 1;
+    seg->err = deflate_compress_range(job->data, dict_start, seg->start, seg->end,
+                                      job->level, &bs, final);
+    if (seg->err == 0) {
+        seg->err = bitstream_flush(&bs);
+    }
+    seg->out_len = bitstream_get_size(&bs);
+}
+
+static void *segment_worker(void *arg) {
+    struct deflateParallelJob *job = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nsegments) {
+        compress_segment(job, index);
+    }
+    return NULL;
+}
+
+int deflate_compress_parallel(const uint8_t *data, size_t size, int level, int threads,
+                              struct bitStream *bs, uint32_t *adler) {
+    if (level < 0 || level > DEFLATE_MAX_LEVEL) {
+        return -1;
+    }
+    pthread_once(&deflate_tables_once, make_deflate_tables);
+
+    // Several segments per thread so uneven segments still balance out
+    size_t segment_size = size / ((size_t)threads * 4) + 1;
+    if (segment_size < DEFLATE_SEGMENT_MIN) segment_size = DEFLATE_SEGMENT_MIN;
+    int nsegments = (int)((size + segment_size - 1) / segment_size);
+    if (nsegments < 1) nsegments = 1;
+
+    struct deflateParallelJob job = {
+        .data = data,
+        .level = level,
+        .nsegments = nsegments,
+        .next = 0,
+    };
+    job.segments = calloc(nsegments, sizeof(struct deflateSegment));
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (job.segments == NULL || workers == NULL) {
+        free(job.segments);
+        free(workers);
+        return -1;
+    }
+    for (int i = 0; i < nsegments; i++) {
+        job.segments[i].start = (size_t)i * segment_size;
+        job.segments[i].end = i == nsegments - 1 ? size : (size_t)(i + 1) * segment_size;
+    }
+
+    // The calling thread works too; failing to start a worker just means less help
+    int started = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&workers[started], NULL, segment_worker, &job) == 0) {
+            started++;
+        }
+    }
+    segment_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int err = 0;
+    uint32_t combined = 1;
+    for (int i = 0; i < nsegments; i++) {
+        struct deflateSegment *seg = &job.segments[i];
+        err |= seg->err;
+        if (!err) {
+            err |= bitstream_write_bytes(bs, seg->out, seg->out_len);
+            combined = adler32_combine(combined, seg->adler, seg->end - seg->start);
+        }
+        free(seg->out);
+    }
+    free(job.segments);
+    free(workers);
+
+    *adler = combined;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,52 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../image_common.h"
+
+#define DEFLATE_WSIZE 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_LEVEL 9
+#define DEFLATE_DEFAULT_LEVEL 6
+#define DEFLATE_SEGMENT_MIN (256 * 1024) // smallest input slice for parallel compression
+
+struct huffmanCode {
+    uint16_t code; // the bit pattern
+    uint8_t length; // number of bits
+};
+
+// LZ77 output: a literal byte (dist == 0) or a length/distance pair
+struct deflateToken {
+    uint16_t litlen;
+    uint16_t dist;
+};
+
+extern const uint16_t deflate_dist_base[30];
+extern const uint8_t deflate_dist_extra[30];
+extern const uint16_t deflate_len_base[29];
+extern const uint8_t deflate_len_extra[29];
+extern const uint8_t deflate_cl_order[19];
+
+struct huffmanCode fixed_huffman_code(uint16_t symbol);
+void build_canonical_huffman(uint8_t *lengths, uint32_t num_symbols,
+                             uint32_t *codes, uint32_t max_bits);
+
+// Match finder state, opaque outside deflate.c
+struct deflateState;
+
+size_t deflate_bound(size_t size);
+struct deflateState *deflate_state_new(void);
+void deflate_state_free(struct deflateState *s);
+int deflate_compress_state(struct deflateState *s, const uint8_t *data, size_t dict_start,
+                           size_t start, size_t end, int level, struct bitStream *bs,
+                           int final);
+int deflate_compress_range(const uint8_t *data, size_t dict_start, size_t start, size_t end,
+                           int level, struct bitStream *bs, int final);
+int deflate_compress(const uint8_t *data, size_t size, int level,
+                     struct bitStream *bs);
+int deflate_compress_parallel(const uint8_t *data, size_t size, int level, int threads,
+                              struct bitStream *bs, uint32_t *adler);
+
+#endif  // DEFLATE_H
@@ -0,0 +1,1015 @@
+#include "inflate.h"
+#include "deflate.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+
+/*
+ * Table-driven Huffman decoding.
+ *
+ * The primary table is indexed by the next HUFFMAN_FAST_BITS bits of the
+ * stream (LSB first, so codes are stored bit-reversed). Codes that fit are
+ * replicated across every index sharing their prefix; longer codes go through
+ * a link entry to a secondary table indexed by the remaining bits.
+ *
+ * Entry layout:
+ *   bits  0-3   code length in bits (0 = invalid code)
+ *   bit   4     link to secondary table
+ *   bits  8-15  secondary table index bits (links only)
+ *   bits 16-31  symbol, or secondary table offset for links
+ */
+#define HUFFMAN_ENTRY_LINK 0x10
+
+// Speculative decodes run into bad data by design, keep those failures quiet
+#define INFLATE_LOGE(s, fmt, ...) \
+do { if ((s)->speculative) LOGI(fmt, ##__VA_ARGS__); else LOGE(fmt, ##__VA_ARGS__); } while (0)
+
+#define INFLATE_COPY_SLACK 16 // copy_bytes_fast may write this far past a match
+#define INFLATE_FAST_ROOM (DEFLATE_MAX_MATCH + INFLATE_COPY_SLACK)
+
+int build_huffman_table(struct huffmanTable *table, uint8_t *lengths,
+                        uint32_t num_symbols) {
+    uint32_t bl_count[HUFFMAN_MAX_BITS + 1] = {0};
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        if (lengths[i] > HUFFMAN_MAX_BITS) return -1;
+        bl_count[lengths[i]]++;
+    }
+
+    // Reject over-subscribed code sets, they can't be decoded unambiguously
+    int left = 1;
+    for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+        left = (left << 1) - bl_count[len];
+        if (left < 0) {
+            LOGI("Over-subscribed Huffman code lengths\n");
+            return -1;
+        }
+    }
+
+    uint32_t codes[HUFFMAN_MAX_SYMBOLS];
+    build_canonical_huffman(lengths, num_symbols, codes, HUFFMAN_MAX_BITS + 1);
+
+    const uint32_t fast_size = 1u << HUFFMAN_FAST_BITS;
+    const uint32_t fast_mask = fast_size - 1;
+    memset(table->entries, 0, fast_size * sizeof(table->entries[0]));
+
+    // Size the secondary table behind each long-code prefix
+    uint8_t sub_bits[1 << HUFFMAN_FAST_BITS] = {0};
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        if (lengths[i] <= HUFFMAN_FAST_BITS) continue;
+        uint32_t prefix = reverse_bits(codes[i], lengths[i]) & fast_mask;
+        uint8_t bits = lengths[i] - HUFFMAN_FAST_BITS;
+        if (bits > sub_bits[prefix]) sub_bits[prefix] = bits;
+    }
+
+    uint32_t offset = fast_size;
+    for (uint32_t prefix = 0; prefix < fast_size; prefix++) {
+        if (sub_bits[prefix] == 0) continue;
+        uint32_t size = 1u << sub_bits[prefix];
+        if (offset + size > HUFFMAN_TABLE_SIZE) {
+            LOGI("Huffman table overflow\n");
+            return -1;
+        }
+        memset(&table->entries[offset], 0, size * sizeof(table->entries[0]));
+        table->entries[prefix] = (offset << 16) | (sub_bits[prefix] << 8) | HUFFMAN_ENTRY_LINK;
+        offset += size;
+    }
+
+    // Fill every slot whose low bits match the reversed code
+    for (uint32_t sym = 0; sym < num_symbols; sym++) {
+        uint32_t len = lengths[sym];
+        if (len == 0) continue;
+
+        uint32_t rev = reverse_bits(codes[sym], len);
+        uint32_t entry = (sym << 16) | len;
+
+        if (len <= HUFFMAN_FAST_BITS) {
+            for (uint32_t i = rev; i < fast_size; i += 1u << len) {
+                table->entries[i] = entry;
+            }
+        } else {
+            uint32_t link = table->entries[rev & fast_mask];
+            uint32_t base = link >> 16;
+            uint32_t size = 1u << ((link >> 8) & 0xFF);
+            for (uint32_t i = rev >> HUFFMAN_FAST_BITS; i < size; i += 1u << (len - HUFFMAN_FAST_BITS)) {
+                table->entries[base + i] = entry;
+            }
+        }
+    }
+    return 0;
+}
+
+// Table entry for the next code in the stream, without consuming it
+static inline uint32_t peek_entry(struct bitStream *ds, const struct huffmanTable *table) {
+    uint32_t bits = bitstream_peek_bits(ds, HUFFMAN_MAX_BITS);
+
+    uint32_t entry = table->entries[bits & ((1u << HUFFMAN_FAST_BITS) - 1)];
+    if (entry & HUFFMAN_ENTRY_LINK) {
+        uint32_t sub_mask = (1u << ((entry >> 8) & 0xFF)) - 1;
+        entry = table->entries[(entry >> 16) + ((bits >> HUFFMAN_FAST_BITS) & sub_mask)];
+    }
+    return entry;
+}
+
+uint32_t decode_symbol(struct bitStream *ds, const struct huffmanTable *table) {
+    uint32_t entry = peek_entry(ds, table);
+
+    uint32_t len = entry & 0xF;
+    if (len == 0 || len > ds->bitcount) {
+        return 0xFFFFFFFF; // Error: no match found
+    }
+
+    bitstream_consume(ds, len);
+    return entry >> 16;
+}
+
+// Extra bits of a length or distance code, -1 when the stream ends inside them
+static inline int read_extra(struct bitStream *ds, uint32_t n, uint32_t *extra) {
+    *extra = bitstream_peek_bits(ds, n);
+    if (ds->bitcount < n) {
+        return -1;
+    }
+    bitstream_consume(ds, n);
+    return 0;
+}
+
+// Static tables for BTYPE=1, built on first use by whichever thread gets there
+static struct huffmanTable fixed_ll_table;
+static struct huffmanTable fixed_dist_table;
+static pthread_once_t fixed_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_fixed_tables(void) {
+    uint8_t lengths[288];
+    for (int i = 0; i < 144; i++) lengths[i] = 8;
+    for (int i = 144; i < 256; i++) lengths[i] = 9;
+    for (int i = 256; i < 280; i++) lengths[i] = 7;
+    for (int i = 280; i < 288; i++) lengths[i] = 8;
+    build_huffman_table(&fixed_ll_table, lengths, 288);
+
+    for (int i = 0; i < 32; i++) lengths[i] = 5;
+    build_huffman_table(&fixed_dist_table, lengths, 32);
+}
+
+
+void inflate_init(struct inflateState *s, uint8_t *in, size_t in_len, int input_done) {
+    bitstream_init(&s->bs, in, in_len);
+    s->input_done = input_done;
+    s->mode = INFLATE_MODE_HEADER;
+    s->final = 0;
+    s->stored_left = 0;
+    s->copy_len = 0;
+    s->copy_dist = 0;
+    s->ll_table = NULL;
+    s->dist_table = NULL;
+    s->block_end = 0;
+    s->speculative = 0;
+    s->stats = NULL;
+}
+
+/*
+ * Move the unread input to the front of the buffer and top it up to
+ * capacity bytes from read(). A short read marks the end of the input.
+ * Bits already in the accumulator stay valid, they sit ahead of bytepos.
+ */
+int inflate_feed(struct inflateState *s, size_t capacity,
+                 size_t (*read)(void *ctx, uint8_t *dst, size_t n), void *ctx) {
+    struct bitStream *bs = &s->bs;
+    if (s->input_done) {
+        return 0;
+    }
+
+    size_t left = bs->length - bs->bytepos;
+    memmove(bs->data, bs->data + bs->bytepos, left);
+    bs->bytepos = 0;
+    bs->length = left;
+
+    while (bs->length < capacity) {
+        size_t n = read(ctx, bs->data + bs->length, capacity - bs->length);
+        if (n == 0) {
+            s->input_done = 1;
+            break;
+        }
+        bs->length += n;
+    }
+    return 0;
+}
+
+static inline int inflate_starved(const struct inflateState *s) {
+    return !s->input_done && s->bs.bytepos + INFLATE_INPUT_MARGIN > s->bs.length;
+}
+
+static int read_dynamic_tables(struct inflateState *s) {
+    struct bitStream *ds = &s->bs;
+
+    // Read headers
+    uint32_t hlit, hdist, hclen;
+    if (bitstream_read(ds, 5, &hlit) != 0 ||
+        bitstream_read(ds, 5, &hdist) != 0 ||
+        bitstream_read(ds, 4, &hclen) != 0) {
+        return -1;
+    }
+    hlit += 257;
+    hdist += 1;
+    hclen += 4;
+    if (hlit > 286 || hdist > 30) {
+        INFLATE_LOGE(s, "Invalid dynamic block header (HLIT=%u HDIST=%u)\n", hlit, hdist);
+        return -1;
+    }
+
+    // Read code-length code lengths
+    uint8_t cl_lengths[19] = {0};
+    for (uint32_t i = 0; i < hclen; i++) {
+        uint32_t v;
+        if (bitstream_read(ds, 3, &v) != 0) return -1;
+        cl_lengths[deflate_cl_order[i]] = (uint8_t)v;
+    }
+
+    // Build code-length tree
+    struct huffmanTable cl_table;
+    if (build_huffman_table(&cl_table, cl_lengths, 19) != 0) {
+        return -1;
+    }
+
+    // Decode literal/length and distance code lengths as one sequence
+    uint8_t lengths[286 + 30] = {0};
+    uint32_t total_codes = hlit + hdist;
+    uint32_t decoded = 0;
+
+    while (decoded < total_codes) {
+        uint32_t symbol = decode_symbol(ds, &cl_table);
+        uint32_t repeat;
+        uint8_t value = 0;
+
+        if (symbol < 16) {
+            lengths[decoded++] = symbol;
+            continue;
+        } else if (symbol == 16) {
+            if (decoded == 0 || bitstream_read(ds, 2, &repeat) != 0) return -1;
+            repeat += 3;
+            value = lengths[decoded - 1];
+        } else if (symbol == 17) {
+            if (bitstream_read(ds, 3, &repeat) != 0) return -1;
+            repeat += 3;
+        } else if (symbol == 18) {
+            if (bitstream_read(ds, 7, &repeat) != 0) return -1;
+            repeat += 11;
+        } else {
+            INFLATE_LOGE(s, "Invalid code length symbol\n");
+            return -1;
+        }
+
+        if (decoded + repeat > total_codes) {
+            INFLATE_LOGE(s, "Code length repeat overruns HLIT + HDIST\n");
+            return -1;
+        }
+        memset(&lengths[decoded], value, repeat);
+        decoded += repeat;
+    }
+
+    // Build literal/length and distance trees
+    if (build_huffman_table(&s->dyn_ll_table, lengths, hlit) != 0 ||
+        build_huffman_table(&s->dyn_dist_table, lengths + hlit, hdist) != 0) {
+        return -1;
+    }
+    s->ll_table = &s->dyn_ll_table;
+    s->dist_table = &s->dyn_dist_table;
+    return 0;
+}
+
+static int read_block_header(struct inflateState *s) {
+    uint32_t bfinal, btype;
+    if (bitstream_read(&s->bs, 1, &bfinal) != 0 ||
+        bitstream_read(&s->bs, 2, &btype) != 0) {
+        INFLATE_LOGE(s, "DEFLATE stream truncated\n");
+        return -1;
+    }
+    s->final = bfinal;
+
+    LOGI("BFINAL=%u BTYPE=%u\n", bfinal, btype);
+    if (btype < 3) {
+        PNG_STATS_ADD(s->stats, blocks[btype], 1);
+    }
+
+    switch (btype) {
+        case 0: {
+            uint32_t len, nlen;
+            bitstream_align_byte(&s->bs);
+            if (bitstream_read(&s->bs, 16, &len) != 0 ||
+                bitstream_read(&s->bs, 16, &nlen) != 0) {
+                INFLATE_LOGE(s, "Stored block truncated\n");
+                return -1;
+            }
+            if ((len ^ 0xFFFF) != nlen) {
+                INFLATE_LOGE(s, "Stored block LEN/NLEN mismatch (LEN=%u NLEN=%u)\n", len, nlen);
+                return -1;
+            }
+            s->stored_left = len;
+            s->mode = INFLATE_MODE_STORED;
+            return 0;
+        }
+        case 1:
+            pthread_once(&fixed_tables_once, build_fixed_tables);
+            s->ll_table = &fixed_ll_table;
+            s->dist_table = &fixed_dist_table;
+            s->mode = INFLATE_MODE_HUFFMAN;
+            return 0;
+        case 2:
+            if (read_dynamic_tables(s) != 0) {
+                INFLATE_LOGE(s, "Invalid dynamic Huffman tables\n");
+                return -1;
+            }
+            s->mode = INFLATE_MODE_HUFFMAN;
+            return 0;
+        default:
+            INFLATE_LOGE(s, "Invalid BTYPE (%u)\n", btype);
+            return -1;
+    }
+}
+
+static int inflate_stored(struct inflateState *s, uint8_t *out,
+                          size_t *out_pos, size_t out_end) {
+    struct bitStream *bs = &s->bs;
+    while (s->stored_left > 0) {
+        size_t avail = bs->bitcount / 8 + (bs->length - bs->bytepos);
+        size_t n = s->stored_left;
+        if (n > avail) n = avail;
+        if (n > out_end - *out_pos) n = out_end - *out_pos;
+
+        if (n == 0) {
+            if (*out_pos == out_end) return INFLATE_OUTPUT_FULL;
+            if (s->input_done) {
+                LOGE("Stored block truncated\n");
+                return INFLATE_ERROR;
+            }
+            return INFLATE_NEED_INPUT;
+        }
+        bitstream_read_bytes(bs, out + *out_pos, n);
+        *out_pos += n;
+        s->stored_left -= n;
+        PNG_STATS_ADD(s->stats, stored_bytes, n);
+    }
+    s->mode = INFLATE_MODE_HEADER;
+    return 0;
+}
+
+// Copy n bytes from dist bytes back, writing nothing past dst + n
+static inline void copy_bytes(uint8_t *dst, size_t dist, size_t n) {
+    const uint8_t *src = dst - dist;
+    if (dist >= n) {
+        memcpy(dst, src, n);
+        return;
+    }
+    if (dist == 1) {
+        memset(dst, *src, n);
+        return;
+    }
+    // Overlapping: the output repeats with period dist, so keep doubling
+    // the part already written
+    memcpy(dst, src, dist);
+    size_t done = dist;
+    while (done < n) {
+        size_t c = done < n - done ? done : n - done;
+        memcpy(dst + done, dst, c);
+        done += c;
+    }
+}
+
+// Same as copy_bytes but in whole 8 or 16 byte words, so it may write up to
+// INFLATE_COPY_SLACK bytes past dst + n
+static inline void copy_bytes_fast(uint8_t *dst, size_t dist, size_t n) {
+    const uint8_t *src = dst - dist;
+    uint8_t *end = dst + n;
+
+    if (dist >= 16) {
+        do {
+            memcpy(dst, src, 16);
+            dst += 16;
+            src += 16;
+        } while (dst < end);
+    } else if (dist >= 8) {
+        do {
+            memcpy(dst, src, 8);
+            dst += 8;
+            src += 8;
+        } while (dst < end);
+    } else if (dist == 1) {
+        uint64_t v = 0x0101010101010101ULL * *src;
+        do {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        } while (dst < end);
+    } else {
+        // Short period: lay down 8 bytes one at a time, then repeat them in
+        // steps of the largest multiple of dist that fits in a word
+        for (int i = 0; i < 8; i++) {
+            dst[i] = src[i];
+        }
+        size_t step = 8 - 8 % dist;
+        for (uint8_t *p = dst + step; p < end; p += step) {
+            uint64_t v;
+            memcpy(&v, p - step, 8);
+            memcpy(p, &v, 8);
+        }
+    }
+}
+
+#ifdef PNG_STATS
+// Fold the counts of one decode loop into s->stats: out bytes produced of
+// which match_bytes by matches, the rest one literal symbol each
+static void inflate_countSymbols(struct inflateState *s, size_t out, uint64_t matches,
+                                 uint64_t match_bytes, int eob) {
+    if (s->stats) {
+        s->stats->symbols += out - match_bytes + matches + eob;
+        s->stats->literal_bytes += out - match_bytes;
+        s->stats->match_bytes += match_bytes;
+        s->stats->matches += matches;
+    }
+}
+#endif
+
+static inline size_t copy_match(uint8_t *out, size_t pos, size_t end,
+                                uint32_t *len, uint32_t dist) {
+    size_t n = *len;
+    if (n > end - pos) n = end - pos;
+    copy_bytes(out + pos, dist, n);
+    *len -= n;
+    return pos + n;
+}
+
+/*
+ * Decode symbols while there is room for a maximum-length match plus copy
+ * slack and enough input for one more symbol, so neither the output end
+ * nor a cut-short match has to be handled per symbol. Returns 0 when room
+ * or input runs low, 1 at the end of the block, INFLATE_ERROR on bad data.
+ */
+static int inflate_fast(struct inflateState *s, uint8_t *out,
+                        size_t *out_pos, size_t out_end) {
+    struct bitStream *ds = &s->bs;
+    size_t pos = *out_pos;
+    int ret = 0;
+    PNG_STATS_ONLY(size_t start = pos; uint64_t matches = 0, match_bytes = 0;)
+
+    while (out_end - pos >= INFLATE_FAST_ROOM && !inflate_starved(s)) {
+        uint32_t symbol = decode_symbol(ds, s->ll_table);
+
+        if (symbol < 256) {
+            out[pos++] = (uint8_t)symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            LOGI("End of block symbol encountered\n");
+            ret = 1;
+            break;
+        }
+        if (symbol > 285) {
+            LOGE("Unexpected symbol %u\n", symbol);
+            ret = INFLATE_ERROR;
+            break;
+        }
+
+        uint32_t index = symbol - 257;
+        uint32_t length;
+        if (read_extra(ds, deflate_len_extra[index], &length) != 0) {
+            LOGE("Stream ends inside a match length\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        length += deflate_len_base[index];
+
+        uint32_t dist_sym = decode_symbol(ds, s->dist_table);
+        if (dist_sym > 29) {
+            LOGE("Invalid distance symbol %u\n", dist_sym);
+            ret = INFLATE_ERROR;
+            break;
+        }
+        uint32_t distance;
+        if (read_extra(ds, deflate_dist_extra[dist_sym], &distance) != 0) {
+            LOGE("Stream ends inside a match distance\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        distance += deflate_dist_base[dist_sym];
+
+        if (distance > pos) {
+            LOGE("Invalid back-reference distance %u\n", distance);
+            ret = INFLATE_ERROR;
+            break;
+        }
+        copy_bytes_fast(out + pos, distance, length);
+        pos += length;
+        PNG_STATS_ONLY(matches++; match_bytes += length;)
+    }
+
+    PNG_STATS_ONLY(inflate_countSymbols(s, pos - start, matches, match_bytes, ret == 1);)
+    *out_pos = pos;
+    return ret;
+}
+
+static int inflate_huffman(struct inflateState *s, uint8_t *out,
+                           size_t *out_pos, size_t out_end) {
+    struct bitStream *ds = &s->bs;
+    size_t pos = *out_pos;
+    int ret;
+
+    if (s->copy_len > 0) {
+        pos = copy_match(out, pos, out_end, &s->copy_len, s->copy_dist);
+        PNG_STATS_ADD(s->stats, match_bytes, pos - *out_pos);
+    }
+
+    if (s->copy_len == 0 && out_end - pos >= INFLATE_FAST_ROOM) {
+        ret = inflate_fast(s, out, &pos, out_end);
+        if (ret != 0) {
+            if (ret == 1) {
+                s->mode = INFLATE_MODE_HEADER;
+                ret = 0;
+            }
+            *out_pos = pos;
+            return ret;
+        }
+    }
+
+    // Careful loop for the last stretch of output or input
+    PNG_STATS_ONLY(size_t start = pos; uint64_t matches = 0, match_bytes = 0; int eob = 0;)
+    while (1) {
+        if (inflate_starved(s)) {
+            ret = INFLATE_NEED_INPUT;
+            break;
+        }
+        if (pos >= out_end) {
+            // A full buffer can still take the end-of-block code, so a
+            // stream that exactly fills the output runs to completion
+            uint32_t entry = peek_entry(ds, s->ll_table);
+            if (s->copy_len == 0 && (entry >> 16) == 256 && (entry & 0xF) != 0 &&
+                (entry & 0xF) <= ds->bitcount) {
+                bitstream_consume(ds, entry & 0xF);
+                s->mode = INFLATE_MODE_HEADER;
+                ret = 0;
+                PNG_STATS_ONLY(eob = 1;)
+            } else {
+                ret = INFLATE_OUTPUT_FULL;
+            }
+            break;
+        }
+
+        uint32_t symbol = decode_symbol(ds, s->ll_table);
+
+        // Literal byte
+        if (symbol < 256) {
+            out[pos++] = (uint8_t)symbol;
+            continue;
+        }
+
+        // End of block
+        if (symbol == 256) {
+            LOGI("End of block symbol encountered\n");
+            s->mode = INFLATE_MODE_HEADER;
+            ret = 0;
+            PNG_STATS_ONLY(eob = 1;)
+            break;
+        }
+
+        // Length/distance pair (257-285)
+        if (symbol > 285) {
+            LOGE("Unexpected symbol %u\n", symbol);
+            ret = INFLATE_ERROR;
+            break;
+        }
+
+        uint32_t index = symbol - 257;
+        uint32_t length;
+        if (read_extra(ds, deflate_len_extra[index], &length) != 0) {
+            LOGE("Stream ends inside a match length\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        length += deflate_len_base[index];
+
+        uint32_t dist_sym = decode_symbol(ds, s->dist_table);
+        if (dist_sym > 29) {
+            LOGE("Invalid distance symbol %u\n", dist_sym);
+            ret = INFLATE_ERROR;
+            break;
+        }
+        uint32_t distance;
+        if (read_extra(ds, deflate_dist_extra[dist_sym], &distance) != 0) {
+            LOGE("Stream ends inside a match distance\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        distance += deflate_dist_base[dist_sym];
+
+        if (distance > pos) {
+            LOGE("Invalid back-reference distance %u\n", distance);
+            ret = INFLATE_ERROR;
+            break;
+        }
+        PNG_STATS_ONLY(size_t before = pos;)
+        pos = copy_match(out, pos, out_end, &length, distance);
+        PNG_STATS_ONLY(matches++; match_bytes += pos - before;)
+        if (length > 0) {
+            s->copy_len = length;
+            s->copy_dist = distance;
+        }
+    }
+
+    PNG_STATS_ONLY(inflate_countSymbols(s, pos - start, matches, match_bytes, eob);)
+    *out_pos = pos;
+    return ret;
+}
+
+/*
+ * Inflate into out[*out_pos, out_end). Returns INFLATE_OUTPUT_FULL,
+ * INFLATE_NEED_INPUT, INFLATE_STREAM_END or INFLATE_ERROR.
+ */
+int inflate_run(struct inflateState *s, uint8_t *out, size_t *out_pos, size_t out_end) {
+    while (1) {
+        int res;
+        switch (s->mode) {
+            case INFLATE_MODE_HEADER:
+                if (s->final) {
+                    s->mode = INFLATE_MODE_DONE;
+                    return INFLATE_STREAM_END;
+                }
+                if (inflate_starved(s)) {
+                    return INFLATE_NEED_INPUT;
+                }
+                if (read_block_header(s) != 0) {
+                    return INFLATE_ERROR;
+                }
+                break;
+            case INFLATE_MODE_STORED:
+                res = inflate_stored(s, out, out_pos, out_end);
+                if (res != 0) return res;
+                if (s->block_end) return INFLATE_BLOCK_END;
+                break;
+            case INFLATE_MODE_HUFFMAN:
+                res = inflate_huffman(s, out, out_pos, out_end);
+                if (res != 0) return res;
+                if (s->block_end) return INFLATE_BLOCK_END;
+                break;
+            case INFLATE_MODE_DONE:
+                return INFLATE_STREAM_END;
+        }
+    }
+}
+
+/*
+ * Speculative inflate of a run of blocks whose 32 KiB of history is not
+ * known yet. Output is 16 bits per byte: literals and bytes copied from
+ * within out are stored as is, a byte copied from before out[0] is stored
+ * as INFLATE_MARKER + its offset in the unknown window, to be filled in
+ * once the data before it has been decoded. Stops after every block with
+ * INFLATE_BLOCK_END, otherwise returns as inflate_run. The input must be
+ * complete (input_done).
+ */
+static int inflate_stored_wide(struct inflateState *s, uint16_t *out,
+                               size_t *out_pos, size_t out_end) {
+    uint8_t buf[256];
+    while (s->stored_left > 0) {
+        size_t n = s->stored_left;
+        if (n > sizeof(buf)) n = sizeof(buf);
+        if (n > out_end - *out_pos) n = out_end - *out_pos;
+        if (n == 0) {
+            return INFLATE_OUTPUT_FULL;
+        }
+        if (bitstream_read_bytes(&s->bs, buf, n) != 0) {
+            INFLATE_LOGE(s, "Stored block truncated\n");
+            return INFLATE_ERROR;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[*out_pos + i] = buf[i];
+        }
+        *out_pos += n;
+        s->stored_left -= n;
+    }
+    s->mode = INFLATE_MODE_HEADER;
+    return 0;
+}
+
+static int inflate_huffman_wide(struct inflateState *s, uint16_t *out,
+                                size_t *out_pos, size_t out_end) {
+    struct bitStream *ds = &s->bs;
+    size_t pos = *out_pos;
+    int ret;
+
+    while (1) {
+        // Also resumes a match cut short by out_end
+        for (; s->copy_len > 0 && pos < out_end; s->copy_len--, pos++) {
+            if (s->copy_dist > pos) {
+                out[pos] = INFLATE_MARKER + DEFLATE_WSIZE - (s->copy_dist - pos);
+            } else {
+                out[pos] = out[pos - s->copy_dist];
+            }
+        }
+        if (pos >= out_end) {
+            ret = INFLATE_OUTPUT_FULL;
+            break;
+        }
+
+        uint32_t symbol = decode_symbol(ds, s->ll_table);
+        if (symbol < 256) {
+            out[pos++] = symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            s->mode = INFLATE_MODE_HEADER;
+            ret = 0;
+            break;
+        }
+        if (symbol > 285) {
+            INFLATE_LOGE(s, "Unexpected symbol %u\n", symbol);
+            ret = INFLATE_ERROR;
+            break;
+        }
+
+        uint32_t index = symbol - 257;
+        uint32_t length;
+        if (read_extra(ds, deflate_len_extra[index], &length) != 0) {
+            INFLATE_LOGE(s, "Stream ends inside a match length\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        length += deflate_len_base[index];
+
+        uint32_t dist_sym = decode_symbol(ds, s->dist_table);
+        if (dist_sym > 29) {
+            INFLATE_LOGE(s, "Invalid distance symbol %u\n", dist_sym);
+            ret = INFLATE_ERROR;
+            break;
+        }
+        if (read_extra(ds, deflate_dist_extra[dist_sym], &s->copy_dist) != 0) {
+            INFLATE_LOGE(s, "Stream ends inside a match distance\n");
+            ret = INFLATE_ERROR;
+            break;
+        }
+        s->copy_dist += deflate_dist_base[dist_sym];
+        s->copy_len = length;
+    }
+
+    *out_pos = pos;
+    return ret;
+}
+
+static int inflate_run_wide(struct inflateState *s, uint16_t *out,
+                            size_t *out_pos, size_t out_end) {
+    int res;
+    switch (s->mode) {
+        case INFLATE_MODE_HEADER:
+            if (s->final) {
+                s->mode = INFLATE_MODE_DONE;
+                return INFLATE_STREAM_END;
+            }
+            if (read_block_header(s) != 0) {
+                return INFLATE_ERROR;
+            }
+            return inflate_run_wide(s, out, out_pos, out_end);
+        case INFLATE_MODE_STORED:
+            res = inflate_stored_wide(s, out, out_pos, out_end);
+            break;
+        case INFLATE_MODE_HUFFMAN:
+            res = inflate_huffman_wide(s, out, out_pos, out_end);
+            break;
+        default:
+            return INFLATE_STREAM_END;
+    }
+    return res != 0 ? res : INFLATE_BLOCK_END;
+}
+
+/*
+ * Parallel inflate. A sync or full flush ends in an empty stored block, the
+ * byte-aligned 00 00 FF FF, so the block after it starts at a known byte
+ * offset. A quick scan picks one such point per segment and every segment
+ * is decoded at once, the first one normally and the others speculatively
+ * (inflate_run_wide). A segment only counts once the one before it has
+ * stopped at a block boundary exactly where it starts; a candidate that
+ * merely looked like a flush is then never reached and its output is
+ * dropped. The markers are resolved front to back, each segment against
+ * the output of the ones before it.
+ */
+struct inflateSegment {
+    size_t start;               // stream offset of the segment's first block
+    struct inflateState state;  // where the segment stopped
+    uint16_t *out;              // speculative output
+    size_t len, cap;
+    int end;                    // segment it ran into, nsegments at the final block
+    int err;
+};
+
+struct inflateParallelJob {
+    uint8_t *data;
+    size_t size;
+    uint8_t *out;       // the first segment decodes straight into it
+    size_t out_size;
+    size_t out_len;     // output of the first segment
+    struct inflateSegment *segments;
+    int nsegments;
+    int next;           // next segment to pick up, shared by the workers
+    const struct png_allocator *allocator;
+};
+
+static inline size_t inflate_bit_pos(const struct bitStream *bs) {
+    return bs->bytepos * 8 - bs->bitcount;
+}
+
+// Offset just past the first 00 00 FF FF at or after from, 0 if none
+static size_t find_sync_point(const uint8_t *data, size_t from, size_t size) {
+    if (from < 1) from = 1;
+    for (size_t i = from; i + 4 <= size; ) {
+        const uint8_t *p = memchr(data + i + 3, 0xFF, size - i - 3);
+        if (p == NULL) {
+            return 0;
+        }
+        i = p - data - 3;
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0xFF) {
+            return i + 4;
+        }
+        i++;
+    }
+    return 0;
+}
+
+// Run one segment until it reaches the start of a later one or the final block
+static void decode_segment(struct inflateParallelJob *job, int index) {
+    struct inflateSegment *seg = &job->segments[index];
+    struct inflateState *s = &seg->state;
+    int next = index + 1;
+
+    if (index > 0) {
+        inflate_init(s, job->data, job->size, 1);
+        s->bs.bytepos = seg->start;
+        s->speculative = 1;
+    }
+    s->block_end = 1;
+
+    while (1) {
+        if (s->mode == INFLATE_MODE_HEADER) {
+            size_t bit = inflate_bit_pos(&s->bs);
+            while (next < job->nsegments && job->segments[next].start * 8 < bit) {
+                next++;
+            }
+            if (next < job->nsegments && job->segments[next].start * 8 == bit) {
+                seg->end = next;
+                return;
+            }
+            if (s->final) {
+                seg->end = job->nsegments;
+                return;
+            }
+        }
+
+        int res;
+        if (index == 0) {
+            res = inflate_run(s, job->out, &job->out_len, job->out_size);
+        } else {
+            res = inflate_run_wide(s, seg->out, &seg->len, seg->cap);
+            if (res == INFLATE_OUTPUT_FULL && seg->cap < job->out_size) {
+                size_t cap = seg->cap ? 2 * seg->cap : 64 * 1024;
+                if (cap > job->out_size) cap = job->out_size;
+                // The allocator hooks have no realloc
+                uint16_t *out = png_alloc(job->allocator, cap * sizeof(uint16_t));
+                if (out != NULL) {
+                    if (seg->len > 0) {
+                        memcpy(out, seg->out, seg->len * sizeof(uint16_t));
+                    }
+                    png_free(job->allocator, seg->out);
+                    seg->out = out;
+                    seg->cap = cap;
+                    continue;
+                }
+            }
+        }
+        if (res != INFLATE_BLOCK_END) {
+            seg->err = -1;
+            return;
+        }
+    }
+}
+
+static void *inflate_worker(void *arg) {
+    struct inflateParallelJob *job = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nsegments) {
+        decode_segment(job, index);
+    }
+    return NULL;
+}
+
+/*
+ * Inflate the whole stream in s (set up with input_done, at a block
+ * boundary) into out on up to threads threads. Returns 0 with the output
+ * length in *out_len and s at the end of the stream, or -1 when the stream
+ * has no usable flush points, doesn't fit in out_size or fails to decode;
+ * the caller then decodes it serially with inflate_run. Scratch memory
+ * comes from allocator, also on the worker threads.
+ */
+int inflate_parallel(struct inflateState *s, uint8_t *out, size_t out_size,
+                     size_t *out_len, int threads, const struct png_allocator *allocator) {
+    struct bitStream *bs = &s->bs;
+    if (threads < 2 || !s->input_done || s->mode != INFLATE_MODE_HEADER) {
+        return -1;
+    }
+
+    // A few segments per thread so uneven segments still balance out
+    size_t first = bs->bytepos;
+    size_t size = bs->length - first;
+    int nsegments = threads * 4;
+    if ((size_t)nsegments > size / INFLATE_SEGMENT_MIN) {
+        nsegments = (int)(size / INFLATE_SEGMENT_MIN);
+    }
+    if (nsegments < 2) {
+        return -1;
+    }
+
+    struct inflateParallelJob job = {
+        .data = bs->data,
+        .size = bs->length,
+        .out = out,
+        .out_size = out_size,
+        .nsegments = 0,
+        .allocator = allocator,
+    };
+    job.segments = png_alloc(allocator, nsegments * sizeof(struct inflateSegment));
+    pthread_t *workers = png_alloc(allocator, threads * sizeof(pthread_t));
+    if (job.segments == NULL || workers == NULL) {
+        png_free(allocator, job.segments);
+        png_free(allocator, workers);
+        return -1;
+    }
+    memset(job.segments, 0, nsegments * sizeof(struct inflateSegment));
+
+    // Segments are not counted: they run concurrently and some are dropped
+    job.segments[0].state = *s;
+    job.segments[0].state.stats = NULL;
+    job.segments[0].start = first;
+    job.nsegments = 1;
+    for (int i = 1; i < nsegments; i++) {
+        size_t from = first + size / nsegments * i;
+        size_t prev = job.segments[job.nsegments - 1].start;
+        size_t at = find_sync_point(bs->data, from > prev ? from : prev + 1, bs->length);
+        if (at == 0 || at >= bs->length) {
+            break;
+        }
+        if (at > prev) {
+            job.segments[job.nsegments++].start = at;
+        }
+    }
+    LOGI("Parallel inflate: %d segments\n", job.nsegments);
+
+    int ret = -1;
+    if (job.nsegments > 1) {
+        // The calling thread works too; failing to start a worker just means less help
+        int started = 0;
+        for (int i = 0; i < threads - 1 && i < job.nsegments - 1; i++) {
+            if (pthread_create(&workers[started], NULL, inflate_worker, &job) == 0) {
+                started++;
+            }
+        }
+        inflate_worker(&job);
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+
+        // Follow the chain of segments that met up, resolving markers on the way
+        size_t pos = job.out_len;
+        int k = 0;
+        ret = job.segments[0].err;
+        while (ret == 0 && job.segments[k].end < job.nsegments) {
+            struct inflateSegment *seg = &job.segments[job.segments[k].end];
+            if (seg->err != 0 || seg->len > out_size - pos) {
+                ret = -1;
+                break;
+            }
+            for (size_t i = 0; i < seg->len; i++) {
+                uint16_t v = seg->out[i];
+                size_t window = v - INFLATE_MARKER; // offset in the 32K before pos
+                if (v < INFLATE_MARKER) {
+                    out[pos + i] = (uint8_t)v;
+                } else if (pos + window >= DEFLATE_WSIZE) {
+                    out[pos + i] = out[pos + window - DEFLATE_WSIZE];
+                } else {
+                    LOGE("Invalid back-reference distance\n");
+                    ret = -1;
+                    break;
+                }
+            }
+            pos += seg->len;
+            k = job.segments[k].end;
+        }
+
+        if (ret == 0) {
+            struct png_stats *stats = s->stats;
+            *s = job.segments[k].state;
+            s->block_end = 0;
+            s->speculative = 0;
+            s->stats = stats;
+            *out_len = pos;
+        }
+    }
+
+    for (int i = 0; i < job.nsegments; i++) {
+        png_free(allocator, job.segments[i].out);
+    }
+    png_free(allocator, job.segments);
+    png_free(allocator, workers);
+    return ret;
+}
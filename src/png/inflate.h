@@ -0,0 +1,79 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../image_common.h"
+#include "png_arena.h"
+#include "png_stats.h"
+
+#define HUFFMAN_MAX_BITS 15
+#define HUFFMAN_MAX_SYMBOLS 288
+#define HUFFMAN_FAST_BITS 9
+#define HUFFMAN_TABLE_SIZE 2048 // primary table + secondary tables for long codes
+
+// Lookup table for decoding one Huffman alphabet, see build_huffman_table
+struct huffmanTable {
+    uint32_t entries[HUFFMAN_TABLE_SIZE];
+};
+
+// Unread input below which a streaming inflate stops and asks for more.
+// Covers the largest dynamic block header plus one length/distance pair.
+#define INFLATE_INPUT_MARGIN 1024
+
+// Return codes of inflate_run
+#define INFLATE_ERROR       -1
+#define INFLATE_OUTPUT_FULL  1 // out_end reached, call again with more room
+#define INFLATE_NEED_INPUT   2 // append input to bs (see inflate_feed)
+#define INFLATE_STREAM_END   3 // final block done
+#define INFLATE_BLOCK_END    4 // a block ended and block_end is set
+
+// Marker base in inflate_parallel's speculative 16-bit output
+#define INFLATE_MARKER 256
+// Smallest stretch of compressed input worth a parallel inflate segment
+#define INFLATE_SEGMENT_MIN (256 * 1024)
+
+enum inflateMode {
+    INFLATE_MODE_HEADER,  // next is a block header
+    INFLATE_MODE_STORED,  // inside a stored block
+    INFLATE_MODE_HUFFMAN, // inside a fixed or dynamic Huffman block
+    INFLATE_MODE_DONE
+};
+
+/*
+ * Resumable DEFLATE decoder. Output goes to a caller buffer and
+ * back-references are resolved against it, so the caller must keep at least
+ * DEFLATE_WSIZE bytes of history in front of out_pos when it recycles the
+ * buffer. inflate_run stops when out_end is reached or, unless input_done is
+ * set, when less than INFLATE_INPUT_MARGIN bytes of input remain.
+ */
+struct inflateState {
+    struct bitStream bs;
+    int input_done;   // bs holds the rest of the stream, never stop for input
+    enum inflateMode mode;
+    int final;        // current block is the last one
+
+    uint32_t stored_left;           // bytes left in a stored block
+    uint32_t copy_len, copy_dist;   // back-reference cut short by out_end
+    int block_end;    // return INFLATE_BLOCK_END after every block
+    int speculative;  // decoding from a guessed position, errors are expected
+    struct png_stats *stats; // block and symbol counters, may be NULL
+
+    const struct huffmanTable *ll_table;
+    const struct huffmanTable *dist_table;
+    struct huffmanTable dyn_ll_table;
+    struct huffmanTable dyn_dist_table;
+};
+
+int build_huffman_table(struct huffmanTable *table, uint8_t *lengths,
+                        uint32_t num_symbols);
+uint32_t decode_symbol(struct bitStream *ds, const struct huffmanTable *table);
+
+void inflate_init(struct inflateState *s, uint8_t *in, size_t in_len, int input_done);
+int inflate_feed(struct inflateState *s, size_t capacity,
+                 size_t (*read)(void *ctx, uint8_t *dst, size_t n), void *ctx);
+int inflate_run(struct inflateState *s, uint8_t *out, size_t *out_pos, size_t out_end);
+int inflate_parallel(struct inflateState *s, uint8_t *out, size_t out_size,
+                     size_t *out_len, int threads, const struct png_allocator *allocator);
+
+#endif  // INFLATE_H
@@ -1,11 +1,20 @@
 #include "png.h"
 #include "../crc/crc.h"
+#include "inflate.h"
+#include "png_map.h"
+#include "png_rows.h"
+#include "png_adam7.h"
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../log.h"
 
 void png_printPixels(void *pixels, struct png_IHDR *ihdr, struct png_PLTE *plte) {
+    if (!LOG_ENABLED(LOG_INFO)) {
+        return;
+    }
     for (uint32_t i = 0; i < ihdr->height; i++) {
         for (uint32_t j = 0; j < ihdr->width; j++) {
             switch (ihdr->colorType) {
@@ -40,598 +49,65 @@ void png_printPixels(void *pixels, struct png_IHDR *ihdr, struct png_PLTE *plte)
     }
 }
 
-int png_compareAdler32(struct png_IDAT *idat, uint8_t *output, size_t output_pos) {
-    uint32_t a = 1;
-    uint32_t b = 0;
-
-    for (size_t i = 0; i < output_pos; i++) {
-        a = (a + output[i]) % 65521;
-        b = (b + a) % 65521;
-    }
-
-    uint32_t calculated_adler32 = (b << 16) | a;
-    if (calculated_adler32 != idat->adler32) {
-        return -1;
-    }
-    return 1;
-}
-
-void png_printIDAT(struct png_IDAT *idat) {
-    LOGI("CMF: 0x%02X\n", idat->cmf);
-    LOGI("CM: %u\n", idat->cm);
-    LOGI("CINFO: %u\n", idat->cinfo);
-    LOGI("FLG: 0x%02X\n", idat->flg);
-    LOGI("FCHECK: %u\n", idat->fcheck);
-    LOGI("FDICT: %u\n", idat->fdict);
-    LOGI("FLEVEL: %u\n", idat->flevel);
-    LOGI("DATA_LENGTH: %u\n", idat->data_length);
-    LOGI("DATA: ...\n");
-    // for (uint32_t i = 0; i < idat->data_length; ++i) {
-    //     LOGI("%02x ", idat->data[i]);
-    //     if (i > 0 && i % 16 == 15) {
-    //         LOGI("\n");
-    //     }
-    // }
-    // printf("\n");
-    LOGI("ADLER32: 0x%08X\n", idat->adler32);
-}
-
-int png_readIDAT(void *data, uint32_t length, struct png_IDAT *idat) {
-    struct bitStream bs;
-    bitstream_init(&bs, (uint8_t *)data, length);
-
-    uint8_t cmf = ((uint8_t *)data)[0];
-    uint8_t flg = ((uint8_t *)data)[1];
-
-    if (((cmf << 8) | flg) % 31 != 0) {
-        LOGE("Invalid zlib header\n");
-        return -1;
-    }
-
-    uint32_t cm, cinfo;
-    uint32_t fcheck, fdict, flevel;
-    bitstream_read(&bs, 4, &cm);
-    bitstream_read(&bs, 4, &cinfo);
-    bitstream_read(&bs, 5, &fcheck);
-    bitstream_read(&bs, 1, &fdict);
-    bitstream_read(&bs, 2, &flevel);
-
-    uint32_t adler32 =
-        ((uint32_t)((uint8_t *)data)[length - 4] << 24) |
-        ((uint32_t)((uint8_t *)data)[length - 3] << 16) |
-        ((uint32_t)((uint8_t *)data)[length - 2] << 8)  |
-        ((uint32_t)((uint8_t *)data)[length - 1]);
-
-    // No need to do -2 (for the CM and CINFO bytes)
-    // as we are already skipping them by starting data+2
-    int data_length = length - 4; // ADLER32: 4 bytes
-    if (data_length < 0) {
-        LOGE("Invalid zlib data length\n");
-        return -1;
-    }
-    idat->cmf = cmf;
-    idat->flg = flg;
-    idat->cm = cm;
-    idat->cinfo = cinfo;
-    idat->fcheck = fcheck;
-    idat->fdict = fdict;
-    idat->flevel = flevel;
-    idat->data_length = data_length;
-    idat->data = (uint8_t *)data+2;
-    idat->adler32 = adler32;
-    return 1;
-}
-
-int png_decodeFixedHuffmanSymbol(struct bitStream *ds, uint32_t *symbol) {
-    uint32_t peeked;
-
-    // Peek up to 9 bits (max code length in fixed Huffman)
-    if (bitstream_peek(ds, 9, &peeked) != 0) {
-        return -1; // Error reading bits
-    }
-
-    uint32_t rev7 = reverse_bits(peeked, 7);
-    if (rev7 <= 23) {                 // symbols 256–279 (7-bit codes)
-        *symbol = 256 + rev7;
-        bitstream_read(ds, 7, &peeked);
-        return 0;
-    }
-
-    uint32_t rev8 = reverse_bits(peeked, 8);
-    if (rev8 >= 0x30 && rev8 <= 0xBF) {      // symbols 0–143 (8-bit codes)
-        *symbol = rev8 - 0x30;
-        bitstream_read(ds, 8, &peeked);
-        return 0;
-    } else if (rev8 >= 0xC0 && rev8 <= 0xC7) { // symbols 280–287 (8-bit codes)
-        *symbol = 280 + (rev8 - 0xC0);
-        bitstream_read(ds, 8, &peeked);
-        return 0;
+// Samples per pixel for a colour type, -1 for an unknown one
+static int png_channels(uint8_t colorType) {
+    switch (colorType) {
+        case 0: return 1; // Gray
+        case 2: return 3; // RGB
+        case 3: return 1; // Indexed
+        case 4: return 2; // Gray + alpha
+        case 6: return 4; // RGBA
     }
-
-    uint32_t rev9 = reverse_bits(peeked, 9);
-    if (rev9 >= 0x190 && rev9 <= 0x1FF) { // symbols 144–255 (9-bit codes)
-        *symbol = 144 + (rev9 - 0x190);
-        bitstream_read(ds, 9, &peeked);
-        return 0;
-    }
-
     return -1;
 }
 
-/*                  LENGTH TABLE                    */
-//      Extra               Extra               Extra
-// Code Bits Length(s) Code Bits Lengths   Code Bits Length(s)
-// ---- ---- ------     ---- ---- -------   ---- ---- -------
-//  257   0     3       267   1   15,16     277   4   67-82
-//  258   0     4       268   1   17,18     278   4   83-98
-//  259   0     5       269   2   19-22     279   4   99-114
-//  260   0     6       270   2   23-26     280   4  115-130
-//  261   0     7       271   2   27-30     281   5  131-162
-//  262   0     8       272   2   31-34     282   5  163-194
-//  263   0     9       273   3   35-42     283   5  195-226
-//  264   0    10       274   3   43-50     284   5  227-257
-//  265   1  11,12      275   3   51-58     285   0    258
-//  266   1  13,14      276   3   59-66
-//
-/*                  DISTANCE TABLE                  */
-//      Extra           Extra               Extra
-// Code Bits Dist  Code Bits   Dist     Code Bits Distance
-// ---- ---- ----  ---- ----  ------    ---- ---- --------
-//   0   0    1     10   4     33-48    20    9   1025-1536
-//   1   0    2     11   4     49-64    21    9   1537-2048
-//   2   0    3     12   5     65-96    22   10   2049-3072
-//   3   0    4     13   5     97-128   23   10   3073-4096
-//   4   1   5,6    14   6    129-192   24   11   4097-6144
-//   5   1   7,8    15   6    193-256   25   11   6145-8192
-//   6   2   9-12   16   7    257-384   26   12  8193-12288
-//   7   2  13-16   17   7    385-512   27   12 12289-16384
-//   8   3  17-24   18   8    513-768   28   13 16385-24576
-//   9   3  25-32   19   8   769-1024   29   13 24577-32768
-static const uint16_t dist_base[30] = {
-    1,2,3,4,         // 0-3
-    5,7,9,13,        // 4-7
-    17,25,33,49,     // 8-11
-    65,97,129,193,   // 12-15
-    257,385,513,769, // 16-19
-    1025,1537,2049,3073, // 20-23
-    4097,6145,8193,12289,// 24-27
-    16385,24577         // 28-29
-};
-static const uint8_t dist_extra[30] = {
-    0,0,0,0,
-    1,1,2,2,
-    3,3,4,4,
-    5,5,6,6,
-    7,7,8,8,
-    9,9,10,10,
-    11,11,12,12,
-    13,13
-};
-static const uint16_t len_base[29] = {
-    3,4,5,6,7,8,9,10,   // 257-264
-    11,13,15,17,         // 265-268
-    19,23,27,31,         // 269-272
-    35,43,51,59,         // 273-276
-    67,83,99,115,        // 277-280
-    131,163,195,227,     // 281-284
-    258                  // 285
-};
-static const uint8_t len_extra[29] = {
-    0,0,0,0,0,0,0,0,   // 257-264
-    1,1,1,1,            // 265-268
-    2,2,2,2,            // 269-272
-    3,3,3,3,            // 273-276
-    4,4,4,4,            // 277-280
-    5,5,5,5,            // 281-284
-    0                   // 285
-};
-int png_lenFromSym(struct bitStream *ds, uint32_t symbol) {
-    if (symbol < 257) return -1;
-
-    int length = 0;
-    int index = symbol - 257;
-    uint32_t extra_val = 0;
-    if (len_extra[index] > 0) {
-        bitstream_read(ds, len_extra[index], &extra_val);
-    }
-    length = len_base[index] + extra_val;
-    return length;
-}
-
-int png_distFromSym(struct bitStream *ds, uint32_t symbol) {
-    if (symbol > 29) return -1;
-    uint32_t extra_val = 0;
-    if (dist_extra[symbol] > 0) {
-        bitstream_read(ds, dist_extra[symbol], &extra_val);
-    }
-    return dist_base[symbol] + extra_val;
-}
-
-uint32_t decode_symbol(
-    struct bitStream *ds,
-    uint32_t *codes,
-    uint8_t *lengths,
-    uint32_t num_symbols,
-    uint32_t max_len
-) {
-    uint32_t code = 0;
-
-    for (uint32_t len = 1; len <= max_len; len++) {
-        uint32_t bit;
-        bitstream_read(ds, 1, &bit);
-        code = (code << 1) | bit;
-
-        // Check all symbols with this bit length
-        for (uint32_t i = 0; i < num_symbols; i++) {
-            if (lengths[i] == len && codes[i] == code) {
-                return i;  // Found the symbol!
-            }
-        }
-    }
-
-    return 0xFFFFFFFF; // Error: no match found
-}
-
-// Decode one symbol - works for both fixed and dynamic Huffman
-uint32_t decode_ll_symbol(struct bitStream *ds, int is_dynamic, 
-                          uint32_t *ll_codes, uint8_t *ll_lengths, uint32_t hlit) {
-    if (is_dynamic) {
-        return decode_symbol(ds, ll_codes, ll_lengths, hlit, 15);
-    } else {
-        uint32_t symbol;
-        png_decodeFixedHuffmanSymbol(ds, &symbol);
-        return symbol;
-    }
-}
-
-uint32_t decode_dist_symbol(struct bitStream *ds, int is_dynamic,
-                            uint32_t *dist_codes, uint8_t *dist_lengths, uint32_t hdist) {
-    if (is_dynamic) {
-        return decode_symbol(ds, dist_codes, dist_lengths, hdist, 15);
-    } else {
-        uint32_t dist_sym;
-        bitstream_read(ds, 5, &dist_sym);
-        return reverse_bits(dist_sym, 5);
+// Colour type / bit depth combinations allowed by the spec
+static int png_validDepth(uint8_t colorType, uint8_t bitDepth) {
+    switch (colorType) {
+        case 0: return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 ||
+                       bitDepth == 8 || bitDepth == 16;
+        case 3: return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8;
+        case 2:
+        case 4:
+        case 6: return bitDepth == 8 || bitDepth == 16;
+        default: return 0;
     }
 }
 
-int png_huffmanDecode(struct bitStream *ds,
-                      uint8_t *output,
-                      size_t *output_pos,
-                      uint32_t expected,
-                      int is_dynamic,
-                      uint32_t *ll_codes, uint8_t *ll_lengths, uint32_t hlit,
-                      uint32_t *dist_codes, uint8_t *dist_lengths, uint32_t hdist) {
-    while (1) {
-        uint32_t symbol = decode_ll_symbol(ds, is_dynamic, ll_codes, ll_lengths, hlit);
-
-        // End of block
-        if (symbol == 256) {
-            LOGI("End of block symbol encountered\n");
-            return 0;
-        }
-
-        // Literal byte
-        if (symbol < 256) {
-            if (*output_pos >= expected) {
-                LOGE("Output buffer overflow\n");
-                return -1;
-            }
-            output[*output_pos] = (uint8_t)symbol;
-            (*output_pos)++;
-            continue;
-        }
-
-        // Length/distance pair (257-285)
-        if (symbol >= 257 && symbol <= 285) {
-            int length = png_lenFromSym(ds, symbol);
-
-            uint32_t dist_sym = decode_dist_symbol(ds, is_dynamic, 
-                                                   dist_codes, dist_lengths, hdist);
-            int distance = png_distFromSym(ds, dist_sym);
-
-            if (*output_pos + length > expected) {
-                LOGE("Output buffer overflow\n");
-                return -1;
-            }
-            for (int i = 0; i < length; i++) {
-                output[*output_pos] = output[*output_pos - distance];
-                (*output_pos)++;
-            }
-            continue;
-        }
-
-        LOGE("Unexpected symbol %u\n", symbol);
+/*
+ * Bytes per complete pixel, rounded up to 1 for sub-byte depths: the
+ * distance to the left neighbour the filters use. -1 for combinations of
+ * colour type and bit depth the spec does not allow.
+ */
+int png_filteredBpp(const struct png_IHDR *ihdr) {
+    int channels = png_channels(ihdr->colorType);
+    if (channels < 0) {
+        LOGE("Unsupported color type %u\n", ihdr->colorType);
         return -1;
     }
 
-    LOGE("Unexpected return from huffmanDecode\n");
-    return 0;
-}
-
-void build_canonical_huffman(uint8_t *lengths, uint32_t num_symbols,
-                             uint32_t *codes, uint32_t max_bits) {
-    uint32_t bl_count[16] = {0};
-
-    // Count codes of each length
-    for (uint32_t i = 0; i < num_symbols; i++) {
-        if (lengths[i] > 0) {
-            bl_count[lengths[i]]++;
-        }
-    }
-
-    // Find first code for each length
-    uint32_t next_code[16] = {0};
-    uint32_t code = 0;
-    for (uint32_t bits = 1; bits < max_bits; bits++) {
-        code = (code + bl_count[bits - 1]) << 1;
-        next_code[bits] = code;
-    }
-
-    // Assign codes to symbols
-    for (uint32_t i = 0; i < num_symbols; i++) {
-        uint32_t len = lengths[i];
-        if (len > 0) {
-            codes[i] = next_code[len];
-            next_code[len]++;
-        }
-    }
-}
-
-int png_fixedHuffmanDecode(struct bitStream *ds, uint8_t *output,
-                           size_t *output_pos, uint32_t expected) {
-    return png_huffmanDecode(ds, output, output_pos, expected,
-                             0, NULL, NULL, 0, NULL, NULL, 0);
-}
-
-int png_dynamicHuffmanDecode(struct bitStream *ds, uint8_t *output,
-                             size_t *output_pos, uint32_t expected) {
-    static const uint8_t cl_order[19] = {
-        16, 17, 18, 0, 8, 7, 9, 6, 10, 5,
-        11, 4, 12, 3, 13, 2, 14, 1, 15
-    };
-
-    // Read headers
-    uint32_t hlit, hdist, hclen;
-    bitstream_read(ds, 5, &hlit); hlit += 257;
-    bitstream_read(ds, 5, &hdist); hdist += 1;
-    bitstream_read(ds, 4, &hclen); hclen += 4;
-
-    // Read code-length code lengths
-    uint8_t cl_lengths[19] = {0};
-    for (uint32_t i = 0; i < hclen; i++) {
-        uint32_t v;
-        bitstream_read(ds, 3, &v);
-        cl_lengths[cl_order[i]] = (uint8_t)v;
-    }
-
-    // Build code-length tree
-    uint32_t codes[19];
-    build_canonical_huffman(cl_lengths, 19, codes, 8);
-
-    // Decode literal/length and distance code lengths
-    uint8_t ll_lengths[288] = {0};
-    uint8_t dist_lengths[32] = {0};
-    uint32_t total_codes = hlit + hdist;
-    uint32_t decoded = 0;
-    uint8_t last_value = 0;
-
-    while (decoded < total_codes) {
-        uint32_t symbol = decode_symbol(ds, codes, cl_lengths, 19, 7);
-
-        if (symbol < 16) {
-            uint8_t *target = (decoded < hlit) ? &ll_lengths[decoded] : &dist_lengths[decoded - hlit];
-            *target = symbol;
-            last_value = symbol;
-            decoded++;
-        } else if (symbol == 16) {
-            uint32_t repeat;
-            bitstream_read(ds, 2, &repeat);
-            repeat += 3;
-            for (uint32_t i = 0; i < repeat && decoded < total_codes; i++) {
-                uint8_t *target = (decoded < hlit) ? &ll_lengths[decoded] : &dist_lengths[decoded - hlit];
-                *target = last_value;
-                decoded++;
-            }
-        } else if (symbol == 17) {
-            uint32_t repeat;
-            bitstream_read(ds, 3, &repeat);
-            repeat += 3;
-            decoded += repeat;
-            last_value = 0;
-        } else if (symbol == 18) {
-            uint32_t repeat;
-            bitstream_read(ds, 7, &repeat);
-            repeat += 11;
-            decoded += repeat;
-            last_value = 0;
-        }
+    if (!png_validDepth(ihdr->colorType, ihdr->bitDepth)) {
+        LOGE("Invalid bit depth %u for color type %u\n", ihdr->bitDepth, ihdr->colorType);
+        return -1;
     }
 
-    // Build literal/length and distance trees
-    uint32_t ll_codes[288];
-    uint32_t dist_codes[32];
-    build_canonical_huffman(ll_lengths, hlit, ll_codes, 16);
-    build_canonical_huffman(dist_lengths, hdist, dist_codes, 16);
-
-    // Decode using unified function
-    return png_huffmanDecode(ds, output, output_pos, expected,
-                             1, ll_codes, ll_lengths, hlit,
-                             dist_codes, dist_lengths, hdist);
+    int bits = channels * ihdr->bitDepth;
+    return bits < 8 ? 1 : bits / 8;
 }
 
-int png_nonCompressed(struct bitStream *ds,
-                      uint8_t *output,
-                      size_t *output_pos,
-                      uint32_t expected) {
-    uint32_t len, nlen;
-    bitstream_align_byte(ds);
-    bitstream_read(ds, 16, &len);
-    bitstream_read(ds, 16, &nlen);
-
-    if ((len ^ 0xFFFF) != nlen) {
-        LOGE("Stored block LEN/NLEN mismatch (LEN=%u NLEN=%u)\n", len, nlen);
+// 0 when width and height are within the spec's limits, -1 otherwise
+int png_checkDimensions(const struct png_IHDR *ihdr) {
+    if (ihdr->width == 0 || ihdr->height == 0 ||
+        ihdr->width > PNG_MAX_DIMENSION || ihdr->height > PNG_MAX_DIMENSION) {
+        LOGE("Invalid image size %ux%u\n", ihdr->width, ihdr->height);
         return -1;
     }
-
-    if (*output_pos + len > expected) {
-        LOGE("Stored block would overflow output buffer\n");
-        return -1;
-    }
-
-    /* ---- Copy raw bytes ---- */
-    for (uint32_t i = 0; i < len; i++) {
-        uint32_t val;
-        bitstream_read(ds, 8, &val);
-        output[*output_pos + i] = (uint8_t)val;
-    }
-
-    *output_pos += len;
     return 0;
 }
 
-uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
-    int p = a + b - c;
-    int pa = abs(p - a);
-    int pb = abs(p - b);
-    int pc = abs(p - c);
-    if (pa <= pb && pa <= pc) return a;
-    if (pb <= pc) return b;
-    return c;
-}
-
-uint8_t *png_processIDAT(void *data, uint32_t length,
-                         struct png_IHDR *ihdr,
-                         size_t *out_size) {
-    int width  = ihdr->width;
-    int height = ihdr->height;
-    int bpp;
-
-    switch (ihdr->colorType) {
-        case 2: // RGB
-            if (ihdr->bitDepth != 8) {
-                LOGE("Only 8-bit RGB supported\n");
-                return NULL;
-            }
-            bpp = 3;
-            break;
-
-        case 3: // Indexed
-            if (ihdr->bitDepth != 8) {
-                LOGE("Only 8-bit indexed supported\n");
-                return NULL;
-            }
-            bpp = 1;
-            break;
-
-        default:
-            LOGE("Unsupported color type %u\n", ihdr->colorType);
-            return NULL;
-    }
-
-    struct png_IDAT idat;
-    if (png_readIDAT(data, length, &idat) != 1) {
-        return NULL;
-    }
-
-    png_printIDAT(&idat);
-
-    struct bitStream ds;
-    bitstream_init(&ds, idat.data, idat.data_length);
-
-    size_t expected = height * (width * bpp + 1);
-    uint8_t *output = malloc(expected);
-    if (!output) {
-        LOGE("Failed to allocate output buffer\n");
-        return NULL;
-    }
-
-    size_t output_pos = 0;
-
-    /* ---- ZLIB / DEFLATE BLOCK LOOP ---- */
-    uint32_t bfinal, btype;
-    while (1) {
-        bitstream_read(&ds, 1, &bfinal);
-        bitstream_read(&ds, 2, &btype);
-
-        LOGI("BFINAL=%u BTYPE=%u\n", bfinal, btype);
-
-        int res;
-        switch (btype) {
-            case 0:
-                res = png_nonCompressed(&ds, output, &output_pos, expected);
-                break;
-            case 1:
-                res = png_fixedHuffmanDecode(&ds, output, &output_pos, expected);
-                break;
-            case 2:
-                res = png_dynamicHuffmanDecode(&ds, output, &output_pos, expected);
-                break;
-            default:
-                LOGE("Invalud BTYPE (%u)", btype);
-                free(output);
-                return NULL;
-        }
-
-        if (res != 0) {
-            LOGE("DEFLATE block decode failed\n");
-            free(output);
-            return NULL;
-        }
-
-        if (bfinal) break;
-    }
-
-    LOGI("Inflate done: %zu / %zu bytes\n", output_pos, expected);
-
-    if (png_compareAdler32(&idat, output, output_pos) != 1) {
-        LOGE("Adler32 mismatch\n");
-    }
-
-    /* ---- PNG FILTERING ---- */
-    int row_bytes = width * bpp + 1;
-    uint8_t *final_output = malloc(width * height * bpp);
-    if (!final_output) {
-        free(output);
-        return NULL;
-    }
-
-    int idx = 0;
-
-    for (int row = 0; row < height; row++) {
-        int row_start = row * row_bytes;
-        uint8_t filter = output[row_start];
-
-        for (int i = 0; i < width * bpp; i++) {
-            uint8_t raw = output[row_start + 1 + i];
-            uint8_t recon;
-
-            uint8_t left = (i >= bpp) ? final_output[idx - bpp] : 0;
-            uint8_t up   = (row > 0)  ? final_output[idx - width * bpp] : 0;
-            uint8_t up_left =
-                (row > 0 && i >= bpp) ? final_output[idx - width * bpp - bpp] : 0;
-
-            switch (filter) {
-                case 0: recon = raw; break;
-                case 1: recon = raw + left; break;
-                case 2: recon = raw + up; break;
-                case 3: recon = raw + ((left + up) >> 1); break;
-                case 4: recon = raw + paeth_predictor(left, up, up_left); break;
-                default:
-                    LOGE("Unknown filter %u\n", filter);
-                    free(output);
-                    free(final_output);
-                    return NULL;
-            }
-
-            final_output[idx++] = recon;
-        }
-    }
-
-    free(output);
-
-    *out_size = width * height * bpp;
-    return final_output;
+// Bytes in one filtered scanline, without the filter type byte
+size_t png_rowBytes(const struct png_IHDR *ihdr) {
+    return ((size_t)ihdr->width * png_channels(ihdr->colorType) * ihdr->bitDepth + 7) / 8;
 }
 
 void png_printIHDR(struct png_IHDR *ihdr) {
@@ -647,6 +123,9 @@ void png_printIHDR(struct png_IHDR *ihdr) {
 }
 
 void png_interpretzTXt(void *data, uint32_t length) {
+    if (!LOG_ENABLED(LOG_INFO)) {
+        return; // only ever printed
+    }
     if (data == NULL || length == 0) {
         LOGE("Invalid zTXt data\n");
         return;
@@ -678,25 +157,19 @@ void png_interpretzTXt(void *data, uint32_t length) {
 
     for (uint32_t i = 0; i < compText_length; i++) {
         if (i > 0 && i % 16 == 0) {
-            LOGI("\n");
+            LOGI_RAW("\n");
         }
-        LOGI("%02x ", (unsigned char)ztxt.compText[i]);
+        LOGI_RAW("%02x ", (unsigned char)ztxt.compText[i]);
     }
+    LOGI_RAW("\n");
 }
 
 int png_compareCRC(struct png_chunk *chunk) {
-    int crc_inp_len = sizeof(chunk->chunkType) + (int)chunk->length;
-    unsigned char *buff = malloc(crc_inp_len);
-    if (buff == NULL) {
-        LOGE("Failed to allocate memory for chunk crc buffer\n");
-        return -1;
-    }
-    memcpy(buff, chunk->chunkType, sizeof(chunk->chunkType));
-    memcpy(buff + sizeof(chunk->chunkType), chunk->chunkData, chunk->length);
-
-    unsigned long res = crc(buff, crc_inp_len);
-    LOGI("calculated crc: 0x%lX\n", res);
-    free(buff);
+    // Type and data are CRC'd as one message, no need to join them first
+    uint32_t res = update_crc(0xffffffffL, (unsigned char *)chunk->chunkType,
+                              sizeof(chunk->chunkType));
+    res = update_crc(res, chunk->chunkData, chunk->length) ^ 0xffffffffL;
+    LOGI("calculated crc: 0x%X\n", res);
     if (res == chunk->crc) {
         return 1;
     } else {
@@ -719,26 +192,13 @@ void png_printChunk(struct png_chunk *chunk, struct png_image *image) {
     } else if (strncmp(chunk->chunkType, "PLTE", 4) == 0) {
         image->plte.length = chunk->length;
         image->plte.data = chunk->chunkData;
-    } else if (strncmp(chunk->chunkType, "IDAT", 4) == 0) {
-        size_t old_len = image->idat_stream.length;
-        size_t new_len = old_len + chunk->length;
-
-        uint8_t *tmp = realloc(image->idat_stream.data, new_len);
-        if (!tmp) {
-            LOGE("Failed to realloc IDAT buffer\n");
-            return;
-        }
-
-        memcpy(tmp + old_len, chunk->chunkData, chunk->length);
-        image->idat_stream.data = tmp;
-        image->idat_stream.length = new_len;
     } else if (strncmp(chunk->chunkType, "zTXt", 4) == 0) {
         LOGI("zTXt chunk data: ...");
         png_interpretzTXt(chunk->chunkData, chunk->length);
     } else if (strncmp(chunk->chunkType, "tRNS", 4) == 0) {
         image->trns.alpha = chunk->chunkData;
         image->trns.length = chunk->length;
-    } else {
+    } else if (LOG_ENABLED(LOG_INFO)) {
         LOGI("chunkData:");
         for (uint32_t i = 0; i < chunk->length; ++i) {
             if (i % 16 == 0) {
@@ -755,6 +215,9 @@ void png_printChunk(struct png_chunk *chunk, struct png_image *image) {
 }
 
 void png_printFileSignature(struct png_fileSignature *fileSignature) {
+    if (!LOG_ENABLED(LOG_INFO)) {
+        return;
+    }
     LOGI("\n");
     LOGI("File Signature\n");
     LOGI("signature: ");
@@ -772,7 +235,7 @@ int png_readFileSignature(FILE *fptr, struct png_fileSignature *fileSignature) {
     return 1;
 }
 
-int png_readChunk(FILE *fptr, struct png_chunk *chunk) {
+int png_readChunkHeader(FILE *fptr, struct png_chunk *chunk) {
     if (fread(chunk, (sizeof(chunk->length) + sizeof(chunk->chunkType)), 1,
               fptr) != 1) {
         LOGE("Failed to read chunk layout\n");
@@ -780,6 +243,10 @@ int png_readChunk(FILE *fptr, struct png_chunk *chunk) {
     }
 
     chunk->length = __builtin_bswap32(chunk->length);
+    return 1;
+}
+
+int png_readChunkBody(FILE *fptr, struct png_chunk *chunk) {
     chunk->chunkData = (void *)malloc(chunk->length);
     if (chunk->chunkData == NULL) {
         LOGE("Failed to allocate memory for chunk data\n");
@@ -805,144 +272,433 @@ int png_readChunk(FILE *fptr, struct png_chunk *chunk) {
     return 1;
 }
 
-int png_readChunks(FILE *fptr, struct png_chunk **chunks, struct png_image *image) {
-    int chunkCount = 0;
+int png_formatBpp(enum png_format format) {
+    switch (format) {
+        case PNG_FORMAT_RGB:  return 3;
+        case PNG_FORMAT_RGBA: return 4;
+        case PNG_FORMAT_BGRA: return 4;
+        case PNG_FORMAT_GRAY: return 1;
+    }
+    return -1;
+}
+
+// What png_open returns: RGBA when there is an alpha channel or tRNS, RGB otherwise
+enum png_format png_defaultFormat(const struct png_image *image) {
+    uint8_t colorType = image->ihdr.colorType;
+    if (colorType == 4 || colorType == 6 || image->trns.length > 0) {
+        return PNG_FORMAT_RGBA;
+    }
+    return PNG_FORMAT_RGB;
+}
+
+// Drop whatever png_readHeader left behind and recycle the scratch memory
+static void png_decoderFinish(struct png_decoder *dec) {
+    png_unmapFile(&dec->map);
+    dec->idat = NULL;
+    dec->idatCount = 0;
+    png_arenaReset(&dec->arena);
+}
+
+// Chunks are views into the map; PLTE and tRNS point into it as well
+static int png_readMapHeader(struct png_decoder *dec) {
+    const struct png_map *map = &dec->map;
+    if (map->size < sizeof(struct png_fileSignature)) {
+        LOGE("Failed to read file signature\n");
+        return -1;
+    }
+    png_printFileSignature((struct png_fileSignature *)map->data);
+
+    struct png_chunkView *views;
+    int chunkCount = png_mapChunks(map, &dec->arena, &views);
+    if (chunkCount < 0) {
+        LOGE("Error reading chunks\n");
+        return -1;
+    }
 
-    while (1) {
-        if (chunkCount > 0) {
-            size_t cSize = (chunkCount + 1) * sizeof(struct png_chunk);
-            struct png_chunk *temp = realloc(*chunks, cSize);
-            if (temp == NULL) {
-                LOGE("Failed to allocte memory for chunks\n");
-                break;
+    struct png_chunkView *idat = png_arenaAlloc(&dec->arena,
+                                                (chunkCount ? chunkCount : 1) * sizeof(struct png_chunkView));
+    if (idat == NULL) {
+        LOGE("Failed to allocte memory for chunks\n");
+        return -1;
+    }
+
+    struct png_image *image = &dec->image;
+    memset(image, 0, sizeof(*image));
+    int idatCount = 0;
+    for (int i = 0; i < chunkCount; ++i) {
+        if (strncmp(views[i].chunkType, "IDAT", 4) == 0) {
+            LOGI("IDAT chunk: %u bytes at offset %zu\n", views[i].length, views[i].offset);
+            if (!png_viewCompareCRC(map, &views[i])) {
+                LOGE("CRC NOT MATCHING\n");
             }
-            *chunks = temp;
-        }
-        if (png_readChunk(fptr, &(*chunks)[chunkCount]) != 1) {
-            LOGE("Error reading chunk or end of file\n");
-            break;
+            idat[idatCount++] = views[i];
+            continue;
         }
-        png_printChunk(&(*chunks)[chunkCount], image);
 
-        if (strncmp((*chunks)[chunkCount].chunkType, "IEND", 4) == 0) {
-            LOGI("\n");
-            LOGI("End of file reached\n");
-            chunkCount++;
-            break;
-        }
-        chunkCount++;
+        struct png_chunk chunk;
+        chunk.length = views[i].length;
+        memcpy(chunk.chunkType, views[i].chunkType, sizeof(chunk.chunkType));
+        chunk.chunkData = (void *)(map->data + views[i].offset);
+        chunk.crc = views[i].crc;
+        png_printChunk(&chunk, image);
+    }
+
+    if (idatCount == 0) {
+        LOGE("No IDAT chunk\n");
+        return -1;
+    }
+    if (png_checkDimensions(&image->ihdr) != 0 || png_filteredBpp(&image->ihdr) < 0) {
+        return -1;
+    }
+    if (image->ihdr.colorType == 3 && image->plte.length == 0) {
+        LOGE("Indexed image without a PLTE chunk\n");
+        return -1;
+    }
+    if (image->ihdr.interlaceMethod > 1) {
+        LOGE("Unknown interlace method %u\n", image->ihdr.interlaceMethod);
+        return -1;
     }
 
-    return chunkCount;
+    dec->idat = idat;
+    dec->idatCount = idatCount;
+    return 1;
 }
 
-struct output_image *png_finalImageConstruction(struct png_image *image) {
-    struct output_image *output_image = malloc(sizeof(struct output_image));
+/*
+ * First half of a decode into caller memory: parse everything up to the
+ * pixel data and fill in info, so the caller can set up the buffer.
+ * The file stays open in the decoder until png_decodeInto (or the next
+ * png_readHeader). Returns 1 on success, -1 on failure.
+ */
+int png_readHeader(struct png_decoder *dec, const char *filename, struct png_info *info) {
+    png_decoderFinish(dec);
+    PNG_STATS_START(t);
+
+    if (png_mapFile(filename, &dec->map) != 1 &&
+        png_loadFile(filename, &dec->arena, &dec->map) != 1) {
+        png_decoderFinish(dec);
+        return -1;
+    }
+    if (png_readMapHeader(dec) != 1) {
+        png_decoderFinish(dec);
+        return -1;
+    }
 
-    output_image->width  = image->ihdr.width;
-    output_image->height = image->ihdr.height;
+    const struct png_image *image = &dec->image;
+    info->width = image->ihdr.width;
+    info->height = image->ihdr.height;
+    info->bitDepth = image->ihdr.bitDepth;
+    info->colorType = image->ihdr.colorType;
+    info->format = png_defaultFormat(image);
+    info->hasAlpha = info->format == PNG_FORMAT_RGBA;
+    PNG_STATS_STOP(&dec->stats, PNG_STAGE_HEADER, t);
+    return 1;
+}
 
-    int has_alpha = (image->trns.length > 0);
-    output_image->bpp = has_alpha ? 4 : 3;
+/*
+ * With dec->threads > 1 big images are inflated into one buffer up front,
+ * so the rows can be unfiltered and converted on several threads.
+ * Streams from encoders that flush now and then (multi-threaded ones do)
+ * are inflated in parallel too. Returns 0 with d ready for
+ * png_rowsUnfilterParallel, -1 to take the streaming path.
+ */
+static int png_inflateWhole(struct png_decoder *dec, struct png_idatReader *reader,
+                            struct png_rowDecoder *d) {
+    const struct png_IHDR *ihdr = &dec->image.ihdr;
+    // Rows have to be of one width, Adam7 passes each have their own
+    if (dec->threads < 2 || ihdr->interlaceMethod != 0) {
+        return -1;
+    }
+    // Too big to size is left to png_rowsInit to reject
+    size_t size;
+    if (png_mulSize(png_rowBytes(ihdr) + 1, ihdr->height, &size) != 0 || size < PNG_PARALLEL_MIN) {
+        return -1;
+    }
 
-    size_t pixel_count = output_image->width * output_image->height;
-    output_image->pixels = malloc(pixel_count * output_image->bpp);
+    // inflate_parallel needs the zlib stream in one piece
+    uint8_t *stream;
+    if (dec->idatCount == 1) {
+        stream = (uint8_t *)dec->map.data + dec->idat[0].offset;
+    } else if ((stream = png_arenaAlloc(&dec->arena, reader->total)) != NULL) {
+        png_idatCopy(reader, 0, stream, reader->total);
+        PNG_STATS_ADD(&dec->stats, copied_bytes, reader->total);
+    }
+    uint8_t *data = png_arenaAlloc(&dec->arena, size);
+    if (stream == NULL || data == NULL) {
+        return -1;
+    }
 
-    /* truecolor (RGB) */
-    if (image->ihdr.colorType == 2) {
-        for (size_t i = 0; i < pixel_count; i++) {
-            uint8_t r = image->pixels[i * 3 + 0];
-            uint8_t g = image->pixels[i * 3 + 1];
-            uint8_t b = image->pixels[i * 3 + 2];
+    struct inflateState inflate;
+    size_t len;
+    PNG_STATS_START(t);
+    inflate_init(&inflate, stream, reader->total, 1);
+    inflate.bs.bytepos = 2; // zlib header
+    inflate.stats = &dec->stats;
+    if (inflate_parallel(&inflate, data, size, &len, dec->threads,
+                         &dec->arena.allocator) != 0) {
+        LOGI("Parallel inflate not possible, inflating serially\n");
+        len = 0;
+        inflate_init(&inflate, stream, reader->total, 1);
+        inflate.bs.bytepos = 2;
+        inflate.stats = &dec->stats;
+        // Extra data past the image is left to the streaming path to report
+        if (inflate_run(&inflate, data, &len, size) != INFLATE_STREAM_END) {
+            return -1;
+        }
+    }
+    PNG_STATS_STOP(&dec->stats, PNG_STAGE_INFLATE, t);
+    if (len != size) {
+        return -1;
+    }
+    return png_rowsInitInflated(d, ihdr, data, size, &inflate, &dec->arena);
+}
 
-            output_image->pixels[i * output_image->bpp + 0] = r;
-            output_image->pixels[i * output_image->bpp + 1] = g;
-            output_image->pixels[i * output_image->bpp + 2] = b;
+/*
+ * Adam7: each pass row is converted into a scratch row as wide as the pass,
+ * then scattered to its pixels in the output. With an on_pass callback the
+ * rows also fill in the blocks below and to the right, for the preview.
+ */
+static int png_decodeInterlaced(struct png_decoder *dec, struct png_rowDecoder *d,
+                                uint8_t *pixels, size_t stride, enum png_format format) {
+    const struct png_image *image = &dec->image;
+    int bpp = png_formatBpp(format);
+    // No pass is wider than the image
+    uint8_t *converted = png_arenaAlloc(&dec->arena, (size_t)image->ihdr.width * bpp);
+    if (converted == NULL) {
+        LOGE("Failed to allocate the deinterlace row\n");
+        return -1;
+    }
 
-            if (has_alpha) {
-                output_image->pixels[i * output_image->bpp + 3] = 255;
-            }
+    for (uint32_t row = 0; row < d->height; row++) {
+        const uint8_t *src = png_rowsNext(d);
+        if (src == NULL) {
+            return -1;
+        }
+        PNG_STATS_START(t);
+        png_convertRow(image, src, converted, d->pass_width[d->pass], format);
+        png_adam7Scatter(pixels, stride, image->ihdr.width, image->ihdr.height, converted,
+                         d->pass, d->pass_row, bpp, dec->on_pass != NULL);
+        PNG_STATS_STOP(&dec->stats, PNG_STAGE_CONVERT, t);
+
+        if (dec->on_pass && d->pass_row + 1 == d->pass_height[d->pass]) {
+            dec->on_pass(dec->on_pass_ctx, pixels, stride, d->pass + 1);
         }
-        return output_image;
     }
+    return 0;
+}
 
-    /* indexed color (PLTE) */
-    if (image->ihdr.colorType == 3 && image->plte.length > 0) {
-        for (size_t i = 0; i < pixel_count; i++) {
-            uint8_t idx = image->pixels[i];
-            uint8_t *pal = &image->plte.data[idx * 3];
+/*
+ * Second half: decode the image from the last png_readHeader into pixels,
+ * one row every stride bytes, in format. Each scanline is inflated,
+ * checksummed, unfiltered and converted straight into the caller's buffer
+ * while it is still in cache. Returns 1 on success, -1 on failure; either
+ * way the decoder is ready for the next file.
+ */
+int png_decodeInto(struct png_decoder *dec, uint8_t *pixels, size_t stride,
+                   enum png_format format) {
+    struct png_image *image = &dec->image;
+    int ret = -1;
+
+    if (dec->idat == NULL) {
+        LOGE("png_decodeInto without a header\n");
+        return -1;
+    }
+    if (png_formatBpp(format) < 0 ||
+        stride < (size_t)image->ihdr.width * png_formatBpp(format)) {
+        LOGE("Invalid output format or stride\n");
+        png_decoderFinish(dec);
+        return -1;
+    }
 
-            output_image->pixels[i * output_image->bpp + 0] = pal[0];
-            output_image->pixels[i * output_image->bpp + 1] = pal[1];
-            output_image->pixels[i * output_image->bpp + 2] = pal[2];
+    struct png_idatReader reader;
+    png_idatReaderInit(&reader, &dec->map, dec->idat, dec->idatCount);
 
-            if (has_alpha) {
-                if (idx < image->trns.length) {
-                    // printf("idx: %u\n", idx);
-                    output_image->pixels[i * output_image->bpp + 3] = image->trns.alpha[idx];
-                } else {
-                    output_image->pixels[i * output_image->bpp + 3] = 255;
+    uint8_t header[2];
+    if (png_idatCopy(&reader, 0, header, 2) != 2 || ((header[0] << 8) | header[1]) % 31 != 0) {
+        LOGE("Invalid zlib header\n");
+        png_decoderFinish(dec);
+        return -1;
+    }
+    LOGI("CMF: 0x%02X FLG: 0x%02X, %zu bytes of zlib data\n", header[0], header[1], reader.total);
+
+    if (image->ihdr.colorType == 3) {
+        png_expandPalette(image, format);
+    }
+
+    struct png_rowDecoder d;
+    if (png_inflateWhole(dec, &reader, &d) == 0) {
+        if (png_rowsUnfilterParallel(&d, image, pixels, stride, format, dec->threads,
+                                     &dec->arena) == 0) {
+            png_rowsFinish(&d);
+            ret = 1;
+        }
+    } else if (png_rowsInit(&d, &image->ihdr, png_idatRefill, &reader, &dec->arena) == 0) {
+        inflate_init(&d.inflate, NULL, 0, 0);
+        d.inflate.stats = &dec->stats;
+        png_idatSeek(&reader, &d.inflate, 2);
+
+        if (d.interlaced) {
+            if (png_decodeInterlaced(dec, &d, pixels, stride, format) == 0) {
+                png_rowsFinish(&d);
+                ret = 1;
+            }
+        } else {
+            uint32_t row;
+            for (row = 0; row < image->ihdr.height; row++) {
+                const uint8_t *src = png_rowsNext(&d);
+                if (src == NULL) {
+                    break;
                 }
+                PNG_STATS_START(t);
+                png_convertRow(image, src, pixels + row * stride, image->ihdr.width, format);
+                PNG_STATS_STOP(&dec->stats, PNG_STAGE_CONVERT, t);
+            }
+            if (row == image->ihdr.height) {
+                png_rowsFinish(&d);
+                ret = 1;
             }
         }
-        return output_image;
     }
 
-    free(output_image->pixels);
-    free(output_image);
-    return NULL;
+    if (ret == 1) {
+        PNG_STATS_ADD(&dec->stats, images, 1);
+        PNG_STATS_ADD(&dec->stats, pixels, (uint64_t)image->ihdr.width * image->ihdr.height);
+        PNG_STATS_ADD(&dec->stats, compressed_bytes, reader.total);
+        PNG_STATS_ADD(&dec->stats, filtered_bytes, d.filtered_size);
+    }
+    png_decoderFinish(dec);
+    return ret;
 }
 
-struct output_image *png_open(char filename[]) {
-    FILE *fptr;
+void png_decoderInit(struct png_decoder *dec, const struct png_allocator *allocator) {
+    memset(dec, 0, sizeof(*dec));
+    png_arenaInit(&dec->arena, allocator);
+    dec->arena.stats = &dec->stats;
+    dec->threads = 1;
+}
 
-    make_crc_table();
+void png_decoderRelease(struct png_decoder *dec) {
+    png_decoderFinish(dec);
+    png_arenaRelease(&dec->arena);
+}
 
-    if ((fptr = fopen(filename, "rb")) == NULL) {
-        LOGE("Failed to open file %s\n", filename);
+/*
+ * Decode one file into a new output_image in the default format. All
+ * scratch memory comes from the decoder's arena, which is reset (not freed)
+ * afterwards, so once the decoder has seen an image of a given size later
+ * ones of that size allocate nothing but the returned image. Free that with
+ * png_freeImage.
+ */
+struct output_image *png_decode(struct png_decoder *dec, const char *filename) {
+    struct png_info info;
+    if (png_readHeader(dec, filename, &info) != 1) {
         return NULL;
     }
 
-    struct png_fileSignature png_fileSignature;
-    if (png_readFileSignature(fptr, &png_fileSignature) != 1) {
+    size_t size;
+    if (png_mulSize((size_t)info.width * png_formatBpp(info.format), info.height, &size) != 0) {
+        LOGE("Image of %ux%u pixels is too big\n", info.width, info.height);
+        png_decoderFinish(dec);
         return NULL;
     }
-    png_printFileSignature(&png_fileSignature);
 
-    struct png_chunk *chunks = malloc(sizeof(struct png_chunk));
-    if (chunks == NULL) {
-        LOGE("Failed to allocte memory for chunks\n");
+    const struct png_allocator *allocator = &dec->arena.allocator;
+    struct output_image *output_image = png_alloc(allocator, sizeof(struct output_image));
+    if (output_image != NULL) {
+        output_image->width = info.width;
+        output_image->height = info.height;
+        output_image->bpp = png_formatBpp(info.format);
+        output_image->pixels = png_alloc(allocator, size);
+    }
+    if (output_image == NULL || output_image->pixels == NULL) {
+        LOGE("Failed to allocate the output image\n");
+        png_freeImage(dec, output_image);
+        png_decoderFinish(dec);
         return NULL;
     }
 
-    struct png_image image = {0};
-    int chunkCount = png_readChunks(fptr, &chunks, &image);
-    if (chunkCount < 0) {
-        LOGE("Error reading chunks\n");
-        fclose(fptr);
+    if (png_decodeInto(dec, output_image->pixels, (size_t)info.width * output_image->bpp,
+                       info.format) != 1) {
+        png_freeImage(dec, output_image);
         return NULL;
     }
-    fclose(fptr);
+    return output_image;
+}
 
-    if (image.idat_stream.data) {
-        image.pixels = png_processIDAT(
-            image.idat_stream.data,
-            image.idat_stream.length,
-            &image.ihdr,
-            &image.pixel_size
-        );
+void png_freeImage(struct png_decoder *dec, struct output_image *image) {
+    if (image == NULL) {
+        return;
     }
+    png_free(&dec->arena.allocator, image->pixels);
+    png_free(&dec->arena.allocator, image);
+}
+
+struct output_image *png_open(char filename[]) {
+    struct png_decoder dec;
+    png_decoderInit(&dec, NULL);
+    struct output_image *output_image = png_decode(&dec, filename);
+    png_decoderRelease(&dec);
+    return output_image;
+}
+
+// Signature, then the IHDR chunk: length, type, 13 bytes of data, crc
+#define PNG_PROBE_SIZE (8 + 4 + 4 + 13 + 4)
+
+static uint32_t png_readBE32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
 
-    struct output_image *output_image = png_finalImageConstruction(&image);
+/*
+ * Read and validate just the signature and IHDR, one 33-byte read, without
+ * looking at the rest of the file. Returns 1 on success, -1 on failure.
+ */
+int png_probe(const char *filename, struct image_probe *probe) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    uint8_t buf[PNG_PROBE_SIZE];
 
-    if (image.pixels != NULL) {
-        // png_printPixels(image.pixels, &image.ihdr, &image.plte);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Failed to open file %s\n", filename);
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n != (ssize_t)sizeof(buf)) {
+        LOGE("%s: too short for a PNG header\n", filename);
+        return -1;
     }
 
-    for (int i = 0; i < chunkCount; ++i) {
-        free(chunks[i].chunkData);
+    if (memcmp(buf, signature, sizeof(signature)) != 0) {
+        LOGE("%s: not a PNG file\n", filename);
+        return -1;
+    }
+    const uint8_t *chunk = buf + 8;
+    if (png_readBE32(chunk) != 13 || memcmp(chunk + 4, "IHDR", 4) != 0) {
+        LOGE("%s: first chunk is not IHDR\n", filename);
+        return -1;
+    }
+    if (crc((unsigned char *)chunk + 4, 4 + 13) != png_readBE32(chunk + 8 + 13)) {
+        LOGE("%s: IHDR CRC NOT MATCHING\n", filename);
+        return -1;
     }
-    free(chunks);
 
-    return output_image;
+    const uint8_t *data = chunk + 8;
+    uint32_t width = png_readBE32(data);
+    uint32_t height = png_readBE32(data + 4);
+    uint8_t bitDepth = data[8];
+    uint8_t colorType = data[9];
+    if (width == 0 || height == 0 || width > PNG_MAX_DIMENSION || height > PNG_MAX_DIMENSION ||
+        !png_validDepth(colorType, bitDepth) ||
+        data[10] != 0 || data[11] != 0 || data[12] > 1) {
+        LOGE("%s: invalid IHDR\n", filename);
+        return -1;
+    }
+
+    probe->width = width;
+    probe->height = height;
+    probe->bitDepth = bitDepth;
+    probe->colorType = colorType;
+    probe->interlaced = data[12];
+    return 1;
 }
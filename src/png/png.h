@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "../image_common.h"
+#include "png_arena.h"
+#include "png_map.h"
+#include "png_stats.h"
 
 struct __attribute__((packed)) png_fileSignature {
     char signature[8];
@@ -34,17 +37,11 @@ struct png_IDAT {
     uint8_t fcheck;
     uint8_t fdict;
     uint8_t flevel;
-    uint32_t data_length;
+    size_t data_length;
     uint8_t *data;
     uint32_t adler32;
 };
 
-// For combining all the IDAT chunks
-struct png_IDAT_stream {
-    uint8_t *data;
-    size_t length;
-};
-
 struct png_zTXt {
     char *keyword;
     uint8_t *compMethod;
@@ -65,9 +62,9 @@ struct png_image {
     struct png_IHDR ihdr;
     struct png_PLTE plte;
     struct png_tRNS trns;
-    struct png_IDAT_stream idat_stream;
     uint8_t *pixels;
     size_t pixel_size; // total size of pixel data in bytes
+    uint8_t palette[256][4]; // PLTE + tRNS already in the output format
 };
 
 struct output_image {
@@ -77,6 +74,77 @@ struct output_image {
     uint8_t bpp;
 };
 
+// Pixel layouts the decoder can write
+enum png_format {
+    PNG_FORMAT_RGB,
+    PNG_FORMAT_RGBA,
+    PNG_FORMAT_BGRA,
+    PNG_FORMAT_GRAY,
+};
+
+// Header info from png_readHeader, enough to size the output buffer
+struct png_info {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bitDepth;
+    uint8_t colorType;
+    uint8_t hasAlpha;        // alpha channel or tRNS chunk present
+    enum png_format format;  // layout png_decode would pick
+};
+
+/*
+ * Progress of an interlaced decode, called after each Adam7 pass (1-7) that
+ * has pixels. pixels is the caller's output buffer, by then a full-size
+ * preview: pixels later passes have yet to fill repeat a decoded neighbour
+ * above or to the left. The last call has the finished image.
+ */
+typedef void (*png_passFn)(void *ctx, const uint8_t *pixels, size_t stride, int pass);
+
+// Reusable decoder, keeps its scratch memory between images
+struct png_decoder {
+    struct png_arena arena;
+    int threads;  // inflate threads for large images, 1 by default
+    png_passFn on_pass;  // NULL by default, only interlaced images have passes
+    void *on_pass_ctx;
+    struct png_stats stats;  // accumulated over every image, see png_stats.h
+
+    // Between png_readHeader and png_decodeInto
+    struct png_map map;
+    struct png_image image;
+    const struct png_chunkView *idat;
+    int idatCount;
+};
+
+// Largest width or height the spec allows
+#define PNG_MAX_DIMENSION 0x7FFFFFFFu
+
+// *out = a * b, -1 when that doesn't fit in a size_t
+static inline int png_mulSize(size_t a, size_t b, size_t *out) {
+    return __builtin_mul_overflow(a, b, out) ? -1 : 0;
+}
+
 struct output_image *png_open(char filename[]);
+int png_probe(const char *filename, struct image_probe *probe);
+
+void png_decoderInit(struct png_decoder *dec, const struct png_allocator *allocator);
+void png_decoderRelease(struct png_decoder *dec);
+struct output_image *png_decode(struct png_decoder *dec, const char *filename);
+int png_readHeader(struct png_decoder *dec, const char *filename, struct png_info *info);
+int png_decodeInto(struct png_decoder *dec, uint8_t *pixels, size_t stride,
+                   enum png_format format);
+void png_freeImage(struct png_decoder *dec, struct output_image *image);
+
+int png_readFileSignature(FILE *fptr, struct png_fileSignature *fileSignature);
+int png_readChunkHeader(FILE *fptr, struct png_chunk *chunk);
+int png_readChunkBody(FILE *fptr, struct png_chunk *chunk);
+void png_printChunk(struct png_chunk *chunk, struct png_image *image);
+int png_checkDimensions(const struct png_IHDR *ihdr);
+int png_filteredBpp(const struct png_IHDR *ihdr);
+size_t png_rowBytes(const struct png_IHDR *ihdr);
+int png_formatBpp(enum png_format format);
+enum png_format png_defaultFormat(const struct png_image *image);
+void png_expandPalette(struct png_image *image, enum png_format format);
+void png_convertRow(const struct png_image *image, const uint8_t *src,
+                    uint8_t *dst, uint32_t width, enum png_format format);
 
 #endif  // PNG_H
@@ -0,0 +1,87 @@
+#include "png_adam7.h"
+#include <string.h>
+
+const struct png_adam7Pass png_adam7Passes[PNG_ADAM7_PASSES] = {
+    {0, 0, 8, 8, 8, 8},
+    {4, 0, 8, 8, 4, 8},
+    {0, 4, 4, 8, 4, 4},
+    {2, 0, 4, 4, 2, 4},
+    {0, 2, 2, 4, 2, 2},
+    {1, 0, 2, 2, 1, 2},
+    {0, 1, 1, 2, 1, 1},
+};
+
+typedef void (*png_scatterFn)(uint8_t *dst, const uint8_t *src, uint32_t count);
+
+/*
+ * Spread count pixels out to every DX-th pixel of dst. One kernel per pass
+ * spacing and output pixel size, so each store is a fixed-size move at a
+ * fixed stride. Pass 7 has DX 1 and is a plain memcpy.
+ */
+#define DEFINE_SCATTER(DX, BPP)                                                           \
+static void png_scatter_##DX##_##BPP(uint8_t *dst, const uint8_t *src, uint32_t count) {  \
+    for (uint32_t i = 0; i < count; i++) {                                                \
+        memcpy(dst + (size_t)i * (DX * BPP), src + (size_t)i * BPP, BPP);                 \
+    }                                                                                     \
+}
+
+DEFINE_SCATTER(8, 1)
+DEFINE_SCATTER(8, 3)
+DEFINE_SCATTER(8, 4)
+DEFINE_SCATTER(4, 1)
+DEFINE_SCATTER(4, 3)
+DEFINE_SCATTER(4, 4)
+DEFINE_SCATTER(2, 1)
+DEFINE_SCATTER(2, 3)
+DEFINE_SCATTER(2, 4)
+
+#define SCATTERS(DX) {png_scatter_##DX##_1, png_scatter_##DX##_3, png_scatter_##DX##_4}
+
+// By pass spacing 8, 4, 2, then output pixel size 1, 3, 4
+static const png_scatterFn png_scatterKernels[3][3] = {SCATTERS(8), SCATTERS(4), SCATTERS(2)};
+
+/*
+ * Preview variant: each pixel also covers the rest of its block in this row,
+ * clipped to the columns left. The positions it overwrites all belong to
+ * later passes.
+ */
+static void png_scatterBlocks(uint8_t *dst, const uint8_t *src, uint32_t count, uint32_t dx,
+                              uint32_t block_w, uint32_t columns, int bpp) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t end = i * dx + block_w;
+        if (end > columns) end = columns;
+        for (uint32_t x = i * dx; x < end; x++) {
+            memcpy(dst + (size_t)x * bpp, src + (size_t)i * bpp, bpp);
+        }
+    }
+}
+
+/*
+ * Place one converted row of an Adam7 pass (bpp bytes per pixel) into the
+ * full-size image. With preview the row also fills the blocks its pixels
+ * stand for, so after every pass the image is a complete, coarser version
+ * of the final one.
+ */
+void png_adam7Scatter(uint8_t *pixels, size_t stride, uint32_t width, uint32_t height,
+                      const uint8_t *row, int pass, uint32_t pass_row, int bpp, int preview) {
+    const struct png_adam7Pass *p = &png_adam7Passes[pass];
+    uint32_t count = png_adam7Width(width, pass);
+    uint32_t y = p->y0 + pass_row * p->dy;
+    uint8_t *dst = pixels + (size_t)y * stride + (size_t)p->x0 * bpp;
+
+    if (preview && p->block_w * p->block_h > 1) {
+        uint32_t columns = width - p->x0;
+        png_scatterBlocks(dst, row, count, p->dx, p->block_w, columns, bpp);
+        for (uint32_t r = 1; r < p->block_h && y + r < height; r++) {
+            memcpy(dst + r * stride, dst, (size_t)columns * bpp);
+        }
+        return;
+    }
+    if (p->dx == 1) {
+        memcpy(dst, row, (size_t)count * bpp);
+        return;
+    }
+    int spacing = p->dx == 8 ? 0 : p->dx == 4 ? 1 : 2;
+    int size = bpp == 1 ? 0 : bpp == 3 ? 1 : 2;
+    png_scatterKernels[spacing][size](dst, row, count);
+}
@@ -0,0 +1,35 @@
+#ifndef PNG_ADAM7_H
+#define PNG_ADAM7_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PNG_ADAM7_PASSES 7
+
+/*
+ * Where the pixels of an Adam7 pass sit in each 8x8 tile: the first one at
+ * (x0, y0), then every dx columns and dy rows. Until later passes fill them
+ * in, each stands for the block_w x block_h block to its right and below.
+ */
+struct png_adam7Pass {
+    uint8_t x0, y0, dx, dy;
+    uint8_t block_w, block_h;
+};
+
+extern const struct png_adam7Pass png_adam7Passes[PNG_ADAM7_PASSES];
+
+// Pixels per row of a pass, 0 when the image is too narrow to have any
+static inline uint32_t png_adam7Width(uint32_t width, int pass) {
+    const struct png_adam7Pass *p = &png_adam7Passes[pass];
+    return width > p->x0 ? (width - p->x0 + p->dx - 1) / p->dx : 0;
+}
+
+static inline uint32_t png_adam7Height(uint32_t height, int pass) {
+    const struct png_adam7Pass *p = &png_adam7Passes[pass];
+    return height > p->y0 ? (height - p->y0 + p->dy - 1) / p->dy : 0;
+}
+
+void png_adam7Scatter(uint8_t *pixels, size_t stride, uint32_t width, uint32_t height,
+                      const uint8_t *row, int pass, uint32_t pass_row, int bpp, int preview);
+
+#endif  // PNG_ADAM7_H
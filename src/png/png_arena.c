@@ -0,0 +1,108 @@
+#include "png_arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+
+#define PNG_ARENA_ALIGN 16
+#define PNG_ARENA_HEADER \
+    ((sizeof(struct png_arenaBlock) + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1))
+
+void *png_alloc(const struct png_allocator *allocator, size_t size) {
+    if (allocator && allocator->alloc) {
+        return allocator->alloc(allocator->ctx, size);
+    }
+    return malloc(size);
+}
+
+void png_free(const struct png_allocator *allocator, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (allocator && allocator->free) {
+        allocator->free(allocator->ctx, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+void png_arenaInit(struct png_arena *arena, const struct png_allocator *allocator) {
+    memset(arena, 0, sizeof(*arena));
+    if (allocator) {
+        arena->allocator = *allocator;
+    }
+}
+
+static struct png_arenaBlock *png_arenaNewBlock(struct png_arena *arena, size_t size) {
+    struct png_arenaBlock *block = png_alloc(&arena->allocator, PNG_ARENA_HEADER + size);
+    if (block == NULL) {
+        LOGE("Failed to allocate %zu byte arena block\n", size);
+        return NULL;
+    }
+    PNG_STATS_ADD(arena->stats, allocator_calls, 1);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *png_arenaAlloc(struct png_arena *arena, size_t size) {
+    size = (size + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1);
+
+    struct png_arenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // Grow geometrically so an image needs few blocks before a reset
+        size_t block_size = PNG_ARENA_MIN_BLOCK;
+        if (block && block_size < 2 * block->size) block_size = 2 * block->size;
+        if (block_size < size) block_size = size;
+
+        block = png_arenaNewBlock(arena, block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *ptr = (uint8_t *)block + PNG_ARENA_HEADER + block->used;
+    block->used += size;
+    PNG_STATS_ADD(arena->stats, allocations, 1);
+    PNG_STATS_ADD(arena->stats, allocated_bytes, size);
+    return ptr;
+}
+
+void *png_arenaCalloc(struct png_arena *arena, size_t size) {
+    void *ptr = png_arenaAlloc(arena, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void png_arenaReset(struct png_arena *arena) {
+    struct png_arenaBlock *block = arena->head;
+    if (block == NULL) {
+        return;
+    }
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    // Several blocks: the next image of this size should fit in one
+    size_t total = 0;
+    for (struct png_arenaBlock *b = block; b; b = b->next) {
+        total += b->size;
+    }
+    png_arenaRelease(arena);
+    arena->head = png_arenaNewBlock(arena, total);
+}
+
+void png_arenaRelease(struct png_arena *arena) {
+    struct png_arenaBlock *block = arena->head;
+    while (block) {
+        struct png_arenaBlock *next = block->next;
+        png_free(&arena->allocator, block);
+        block = next;
+    }
+    arena->head = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef PNG_ARENA_H
+#define PNG_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "png_stats.h"
+
+// Allocator hooks; a NULL allocator anywhere means malloc/free. With
+// png_decoder.threads > 1 they are also called from the decoder's worker threads.
+struct png_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+
+struct png_arenaBlock {
+    struct png_arenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+/*
+ * Bump allocator for per-image scratch memory. Nothing is freed on its own;
+ * png_arenaReset drops everything at once and, if the image needed more
+ * than one block, swaps them for a single block of the combined size. A
+ * worker decoding similar images settles on one block and stops calling
+ * the allocator altogether.
+ */
+struct png_arena {
+    struct png_allocator allocator;
+    struct png_arenaBlock *head;
+    struct png_stats *stats;  // allocation counters, may be NULL
+};
+
+#define PNG_ARENA_MIN_BLOCK (256 * 1024)
+
+void *png_alloc(const struct png_allocator *allocator, size_t size);
+void png_free(const struct png_allocator *allocator, void *ptr);
+
+void png_arenaInit(struct png_arena *arena, const struct png_allocator *allocator);
+void *png_arenaAlloc(struct png_arena *arena, size_t size);
+void *png_arenaCalloc(struct png_arena *arena, size_t size);
+void png_arenaReset(struct png_arena *arena);
+void png_arenaRelease(struct png_arena *arena);
+
+#endif  // PNG_ARENA_H
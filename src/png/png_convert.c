@@ -0,0 +1,293 @@
+#include "png.h"
+#include <string.h>
+
+/*
+ * Unfiltered rows to the output formats, for every colour type and bit
+ * depth. Each (colour type, bit depth, tRNS, format) combination is its own
+ * function, stamped out by DEFINE_CONVERTERS from a loader and
+ * png_storePixel, so the per-pixel loop never branches on the layout.
+ * png_convertRow looks the function up once per row.
+ *
+ * 16-bit samples keep their high byte, 1, 2 and 4-bit gray is scaled up to
+ * the full 0..255 range. tRNS colour keys are matched at the image's own
+ * depth, before any scaling.
+ */
+
+typedef void (*png_convertFn)(const struct png_image *image, const uint8_t *src,
+                              uint8_t *dst, uint32_t width);
+
+struct png_pixel {
+    uint8_t r, g, b, a;
+};
+
+// tRNS colour key of a gray or RGB image
+struct png_key {
+    uint32_t gray, r, g, b;
+};
+
+// Rec. 601 weights in 8-bit fixed point, they sum to 256
+static inline uint8_t png_luma(uint8_t r, uint8_t g, uint8_t b) {
+    return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+static inline struct png_key png_trnsKey(const struct png_image *image) {
+    struct png_key key = {0};
+    const uint8_t *t = image->trns.alpha;
+    if (image->ihdr.colorType == 0 && image->trns.length >= 2) {
+        uint32_t mask = image->ihdr.bitDepth == 16 ? 0xFFFF : (1u << image->ihdr.bitDepth) - 1;
+        key.gray = (t[0] << 8 | t[1]) & mask;
+    } else if (image->ihdr.colorType == 2 && image->trns.length >= 6) {
+        uint32_t mask = image->ihdr.bitDepth == 16 ? 0xFFFF : 0xFF;
+        key.r = (t[0] << 8 | t[1]) & mask;
+        key.g = (t[2] << 8 | t[3]) & mask;
+        key.b = (t[4] << 8 | t[5]) & mask;
+    }
+    return key;
+}
+
+// Sample i of a row of depth-bit samples, most significant bits first
+static inline uint32_t png_sample(const uint8_t *src, size_t i, int depth) {
+    if (depth == 16) {
+        return (uint32_t)src[2 * i] << 8 | src[2 * i + 1];
+    }
+    if (depth == 8) {
+        return src[i];
+    }
+    int per_byte = 8 / depth;
+    int shift = 8 - depth * (int)(i % per_byte + 1);
+    return (src[i / per_byte] >> shift) & ((1u << depth) - 1);
+}
+
+static inline uint8_t png_scale(uint32_t v, int depth) {
+    if (depth == 16) {
+        return v >> 8;
+    }
+    if (depth == 8) {
+        return v;
+    }
+    return v * (255 / ((1u << depth) - 1));
+}
+
+// Loaders, key is NULL when there is no tRNS to match
+
+static inline struct png_pixel png_loadGray(const uint8_t *src, uint32_t i, int depth,
+                                            const struct png_key *key) {
+    uint32_t v = png_sample(src, i, depth);
+    uint8_t g = png_scale(v, depth);
+    struct png_pixel p = {g, g, g, 255};
+    if (key && v == key->gray) {
+        p.a = 0;
+    }
+    return p;
+}
+
+static inline struct png_pixel png_loadGrayAlpha(const uint8_t *src, uint32_t i, int depth) {
+    uint8_t g = png_scale(png_sample(src, 2 * (size_t)i, depth), depth);
+    struct png_pixel p = {g, g, g, png_scale(png_sample(src, 2 * (size_t)i + 1, depth), depth)};
+    return p;
+}
+
+static inline struct png_pixel png_loadRGB(const uint8_t *src, uint32_t i, int depth,
+                                           const struct png_key *key) {
+    uint32_t r = png_sample(src, 3 * (size_t)i, depth);
+    uint32_t g = png_sample(src, 3 * (size_t)i + 1, depth);
+    uint32_t b = png_sample(src, 3 * (size_t)i + 2, depth);
+    struct png_pixel p = {png_scale(r, depth), png_scale(g, depth), png_scale(b, depth), 255};
+    if (key && r == key->r && g == key->g && b == key->b) {
+        p.a = 0;
+    }
+    return p;
+}
+
+static inline struct png_pixel png_loadRGBA(const uint8_t *src, uint32_t i, int depth) {
+    struct png_pixel p = {
+        png_scale(png_sample(src, 4 * (size_t)i, depth), depth),
+        png_scale(png_sample(src, 4 * (size_t)i + 1, depth), depth),
+        png_scale(png_sample(src, 4 * (size_t)i + 2, depth), depth),
+        png_scale(png_sample(src, 4 * (size_t)i + 3, depth), depth),
+    };
+    return p;
+}
+
+static inline void png_storePixel(uint8_t *dst, uint32_t i, enum png_format format,
+                                  struct png_pixel p) {
+    switch (format) {
+        case PNG_FORMAT_RGB:
+            dst[i * 3 + 0] = p.r;
+            dst[i * 3 + 1] = p.g;
+            dst[i * 3 + 2] = p.b;
+            break;
+        case PNG_FORMAT_RGBA:
+            dst[i * 4 + 0] = p.r;
+            dst[i * 4 + 1] = p.g;
+            dst[i * 4 + 2] = p.b;
+            dst[i * 4 + 3] = p.a;
+            break;
+        case PNG_FORMAT_BGRA:
+            dst[i * 4 + 0] = p.b;
+            dst[i * 4 + 1] = p.g;
+            dst[i * 4 + 2] = p.r;
+            dst[i * 4 + 3] = p.a;
+            break;
+        case PNG_FORMAT_GRAY:
+            dst[i] = png_luma(p.r, p.g, p.b); // exact for gray, the weights sum to 256
+            break;
+    }
+}
+
+/*
+ * One converter per format. COPY is the format whose layout matches the
+ * source byte for byte (-1 for none) and BPP its size; that one is a memcpy.
+ */
+#define DEFINE_CONVERTER(NAME, FORMAT, LOAD, COPY, BPP)                                   \
+static void NAME(const struct png_image *image, const uint8_t *src, uint8_t *dst,         \
+                 uint32_t width) {                                                        \
+    const struct png_key key = png_trnsKey(image);                                        \
+    (void)key;                                                                            \
+    if ((int)(FORMAT) == (COPY)) {                                                        \
+        memcpy(dst, src, (size_t)width * (BPP));                                          \
+        return;                                                                           \
+    }                                                                                     \
+    for (uint32_t i = 0; i < width; i++) {                                                \
+        png_storePixel(dst, i, FORMAT, LOAD);                                             \
+    }                                                                                     \
+}
+
+#define DEFINE_CONVERTERS(NAME, LOAD, COPY, BPP)                                          \
+    DEFINE_CONVERTER(NAME##_rgb, PNG_FORMAT_RGB, LOAD, COPY, BPP)                         \
+    DEFINE_CONVERTER(NAME##_rgba, PNG_FORMAT_RGBA, LOAD, COPY, BPP)                       \
+    DEFINE_CONVERTER(NAME##_bgra, PNG_FORMAT_BGRA, LOAD, COPY, BPP)                       \
+    DEFINE_CONVERTER(NAME##_gray, PNG_FORMAT_GRAY, LOAD, COPY, BPP)
+
+// In enum png_format order
+#define CONVERTERS(NAME) {NAME##_rgb, NAME##_rgba, NAME##_bgra, NAME##_gray}
+
+DEFINE_CONVERTERS(gray1, png_loadGray(src, i, 1, NULL), -1, 0)
+DEFINE_CONVERTERS(gray2, png_loadGray(src, i, 2, NULL), -1, 0)
+DEFINE_CONVERTERS(gray4, png_loadGray(src, i, 4, NULL), -1, 0)
+DEFINE_CONVERTERS(gray8, png_loadGray(src, i, 8, NULL), PNG_FORMAT_GRAY, 1)
+DEFINE_CONVERTERS(gray16, png_loadGray(src, i, 16, NULL), -1, 0)
+DEFINE_CONVERTERS(gray1_key, png_loadGray(src, i, 1, &key), -1, 0)
+DEFINE_CONVERTERS(gray2_key, png_loadGray(src, i, 2, &key), -1, 0)
+DEFINE_CONVERTERS(gray4_key, png_loadGray(src, i, 4, &key), -1, 0)
+DEFINE_CONVERTERS(gray8_key, png_loadGray(src, i, 8, &key), PNG_FORMAT_GRAY, 1)
+DEFINE_CONVERTERS(gray16_key, png_loadGray(src, i, 16, &key), -1, 0)
+DEFINE_CONVERTERS(rgb8, png_loadRGB(src, i, 8, NULL), PNG_FORMAT_RGB, 3)
+DEFINE_CONVERTERS(rgb16, png_loadRGB(src, i, 16, NULL), -1, 0)
+DEFINE_CONVERTERS(rgb8_key, png_loadRGB(src, i, 8, &key), PNG_FORMAT_RGB, 3)
+DEFINE_CONVERTERS(rgb16_key, png_loadRGB(src, i, 16, &key), -1, 0)
+DEFINE_CONVERTERS(ga8, png_loadGrayAlpha(src, i, 8), -1, 0)
+DEFINE_CONVERTERS(ga16, png_loadGrayAlpha(src, i, 16), -1, 0)
+DEFINE_CONVERTERS(rgba8, png_loadRGBA(src, i, 8), PNG_FORMAT_RGBA, 4)
+DEFINE_CONVERTERS(rgba16, png_loadRGBA(src, i, 16), -1, 0)
+
+/*
+ * Indexed rows are a lookup into the palette png_expandPalette built in the
+ * output format, so RGBA and BGRA share one function.
+ */
+#define DEFINE_INDEXED(DEPTH)                                                             \
+static void index##DEPTH##_4(const struct png_image *image, const uint8_t *src,           \
+                             uint8_t *dst, uint32_t width) {                              \
+    for (uint32_t i = 0; i < width; i++) {                                                \
+        memcpy(dst + i * 4, image->palette[png_sample(src, i, DEPTH)], 4);                \
+    }                                                                                     \
+}                                                                                         \
+static void index##DEPTH##_3(const struct png_image *image, const uint8_t *src,           \
+                             uint8_t *dst, uint32_t width) {                              \
+    for (uint32_t i = 0; i < width; i++) {                                                \
+        memcpy(dst + i * 3, image->palette[png_sample(src, i, DEPTH)], 3);                \
+    }                                                                                     \
+}                                                                                         \
+static void index##DEPTH##_1(const struct png_image *image, const uint8_t *src,           \
+                             uint8_t *dst, uint32_t width) {                              \
+    for (uint32_t i = 0; i < width; i++) {                                                \
+        dst[i] = image->palette[png_sample(src, i, DEPTH)][0];                            \
+    }                                                                                     \
+}
+
+#define INDEXED(DEPTH) {index##DEPTH##_3, index##DEPTH##_4, index##DEPTH##_4, index##DEPTH##_1}
+
+DEFINE_INDEXED(1)
+DEFINE_INDEXED(2)
+DEFINE_INDEXED(4)
+DEFINE_INDEXED(8)
+
+// By log2 of the bit depth, then format
+static const png_convertFn png_grayConverters[2][5][4] = {
+    {CONVERTERS(gray1), CONVERTERS(gray2), CONVERTERS(gray4), CONVERTERS(gray8),
+     CONVERTERS(gray16)},
+    {CONVERTERS(gray1_key), CONVERTERS(gray2_key), CONVERTERS(gray4_key),
+     CONVERTERS(gray8_key), CONVERTERS(gray16_key)},
+};
+static const png_convertFn png_indexedConverters[4][4] = {
+    INDEXED(1), INDEXED(2), INDEXED(4), INDEXED(8),
+};
+// By 8 or 16 bits, then format
+static const png_convertFn png_rgbConverters[2][2][4] = {
+    {CONVERTERS(rgb8), CONVERTERS(rgb16)},
+    {CONVERTERS(rgb8_key), CONVERTERS(rgb16_key)},
+};
+static const png_convertFn png_grayAlphaConverters[2][4] = {CONVERTERS(ga8), CONVERTERS(ga16)};
+static const png_convertFn png_rgbaConverters[2][4] = {CONVERTERS(rgba8), CONVERTERS(rgba16)};
+
+// NULL for combinations png_filteredBpp rejects
+static png_convertFn png_getConverter(const struct png_image *image, enum png_format format) {
+    int depth = __builtin_ctz(image->ihdr.bitDepth | 32);
+    int key = image->trns.length > 0;
+    if (format > PNG_FORMAT_GRAY || depth > 4) {
+        return NULL;
+    }
+    switch (image->ihdr.colorType) {
+        case 0: return png_grayConverters[key][depth][format];
+        case 2: return depth >= 3 ? png_rgbConverters[key][depth - 3][format] : NULL;
+        case 3: return depth <= 3 ? png_indexedConverters[depth][format] : NULL;
+        case 4: return depth >= 3 ? png_grayAlphaConverters[depth - 3][format] : NULL;
+        case 6: return depth >= 3 ? png_rgbaConverters[depth - 3][format] : NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Build the 256-entry palette in the output format, with tRNS folded in, so
+ * converting an indexed row is one table lookup and copy per pixel.
+ * Indices past the end of PLTE come out black.
+ */
+void png_expandPalette(struct png_image *image, enum png_format format) {
+    uint32_t palette_size = image->plte.length / 3;
+
+    for (uint32_t idx = 0; idx < 256; idx++) {
+        uint8_t r = 0, g = 0, b = 0;
+        if (idx < palette_size) {
+            r = image->plte.data[idx * 3 + 0];
+            g = image->plte.data[idx * 3 + 1];
+            b = image->plte.data[idx * 3 + 2];
+        }
+        uint8_t a = idx < image->trns.length ? image->trns.alpha[idx] : 255;
+
+        uint8_t *entry = image->palette[idx];
+        switch (format) {
+            case PNG_FORMAT_RGB:
+            case PNG_FORMAT_RGBA:
+                entry[0] = r; entry[1] = g; entry[2] = b; entry[3] = a;
+                break;
+            case PNG_FORMAT_BGRA:
+                entry[0] = b; entry[1] = g; entry[2] = r; entry[3] = a;
+                break;
+            case PNG_FORMAT_GRAY:
+                entry[0] = png_luma(r, g, b);
+                break;
+        }
+    }
+}
+
+/*
+ * Convert one row of unfiltered pixels to format. Indexed rows need
+ * png_expandPalette with the same format first.
+ */
+void png_convertRow(const struct png_image *image, const uint8_t *src,
+                    uint8_t *dst, uint32_t width, enum png_format format) {
+    png_convertFn convert = png_getConverter(image, format);
+    if (convert) {
+        convert(image, src, dst, width);
+    }
+}
@@ -0,0 +1,237 @@
+#include "png_filter.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PNG_FILTER_X86 1
+#endif
+
+/*
+ * Scalar kernels, specialized per bpp so the left-neighbour stride is a
+ * compile-time constant.
+ */
+static void unfilter_none(uint8_t *dst, const uint8_t *prev, const uint8_t *raw, size_t len,
+                          int left) {
+    (void)prev;
+    (void)left;
+    if (dst != raw) {
+        memcpy(dst, raw, len);
+    }
+}
+
+static void unfilter_up(uint8_t *dst, const uint8_t *prev, const uint8_t *raw, size_t len,
+                        int left) {
+    (void)left;
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = raw[i] + prev[i];
+    }
+}
+
+#define DEFINE_SCALAR_KERNELS(BPP)                                                  \
+static void unfilter_sub_##BPP(uint8_t *dst, const uint8_t *prev,                   \
+                               const uint8_t *raw, size_t len, int left) {          \
+    (void)prev;                                                                     \
+    size_t i = 0;                                                                   \
+    if (!left) for (; i < BPP && i < len; i++) dst[i] = raw[i];                     \
+    for (; i < len; i++) dst[i] = raw[i] + dst[i - BPP];                            \
+}                                                                                   \
+static void unfilter_avg_##BPP(uint8_t *dst, const uint8_t *prev,                   \
+                               const uint8_t *raw, size_t len, int left) {          \
+    size_t i = 0;                                                                   \
+    if (!left) for (; i < BPP && i < len; i++) dst[i] = raw[i] + (prev[i] >> 1);    \
+    for (; i < len; i++) dst[i] = raw[i] + ((dst[i - BPP] + prev[i]) >> 1);         \
+}                                                                                   \
+static void unfilter_paeth_##BPP(uint8_t *dst, const uint8_t *prev,                 \
+                                 const uint8_t *raw, size_t len, int left) {        \
+    size_t i = 0;                                                                   \
+    if (!left) for (; i < BPP && i < len; i++) dst[i] = raw[i] + prev[i];           \
+    for (; i < len; i++)                                                            \
+        dst[i] = raw[i] + paeth_predictor(dst[i - BPP], prev[i], prev[i - BPP]);    \
+}
+
+DEFINE_SCALAR_KERNELS(1)
+DEFINE_SCALAR_KERNELS(2)
+DEFINE_SCALAR_KERNELS(3)
+DEFINE_SCALAR_KERNELS(4)
+DEFINE_SCALAR_KERNELS(6)
+DEFINE_SCALAR_KERNELS(8)
+
+#ifdef PNG_FILTER_X86
+/*
+ * SSE2 kernels. Up is a straight vector add. Sub, Average and Paeth depend
+ * on the reconstructed pixel to the left, so they step one pixel (3 or 4
+ * bytes) at a time with the whole pixel in one register.
+ */
+static inline __m128i load4(const void *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4(void *p, __m128i v) {
+    int32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, sizeof(x));
+}
+
+static inline __m128i load3(const void *p) {
+    int32_t v = 0;
+    memcpy(&v, p, 3);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store3(void *p, __m128i v) {
+    int32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, 3);
+}
+
+static void unfilter_up_sse2(uint8_t *dst, const uint8_t *prev, const uint8_t *raw, size_t len,
+                             int left) {
+    (void)left;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(raw + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(x, b));
+    }
+    for (; i < len; i++) {
+        dst[i] = raw[i] + prev[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void unfilter_up_avx2(uint8_t *dst, const uint8_t *prev, const uint8_t *raw, size_t len,
+                             int left) {
+    (void)left;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(raw + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi8(x, b));
+    }
+    for (; i < len; i++) {
+        dst[i] = raw[i] + prev[i];
+    }
+}
+
+#define DEFINE_SSE2_KERNELS(BPP)                                                    \
+static void unfilter_sub_##BPP##_sse2(uint8_t *dst, const uint8_t *prev,            \
+                                      const uint8_t *raw, size_t len, int left) {   \
+    (void)prev;                                                                     \
+    __m128i a = left ? load##BPP(dst - BPP) : _mm_setzero_si128();                  \
+    for (size_t i = 0; i + BPP <= len; i += BPP) {                                  \
+        a = _mm_add_epi8(a, load##BPP(raw + i));                                    \
+        store##BPP(dst + i, a);                                                     \
+    }                                                                               \
+}                                                                                   \
+static void unfilter_avg_##BPP##_sse2(uint8_t *dst, const uint8_t *prev,            \
+                                      const uint8_t *raw, size_t len, int left) {   \
+    /* (a + b) >> 1 is the rounding-up pavgb minus the lost low bit */              \
+    const __m128i ones = _mm_set1_epi8(1);                                          \
+    __m128i a = left ? load##BPP(dst - BPP) : _mm_setzero_si128();                  \
+    for (size_t i = 0; i + BPP <= len; i += BPP) {                                  \
+        __m128i b = load##BPP(prev + i);                                            \
+        __m128i avg = _mm_avg_epu8(a, b);                                           \
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), ones));          \
+        a = _mm_add_epi8(avg, load##BPP(raw + i));                                  \
+        store##BPP(dst + i, a);                                                     \
+    }                                                                               \
+}                                                                                   \
+static void unfilter_paeth_##BPP##_sse2(uint8_t *dst, const uint8_t *prev,          \
+                                        const uint8_t *raw, size_t len, int left) { \
+    /* Paeth in 16-bit lanes: p - a = b - c, p - b = a - c, p - c = sum of both */  \
+    const __m128i zero = _mm_setzero_si128();                                       \
+    __m128i a = zero, c = zero;                                                     \
+    if (left) {                                                                     \
+        a = _mm_unpacklo_epi8(load##BPP(dst - BPP), zero);                          \
+        c = _mm_unpacklo_epi8(load##BPP(prev - BPP), zero);                         \
+    }                                                                               \
+    for (size_t i = 0; i + BPP <= len; i += BPP) {                                  \
+        __m128i b = _mm_unpacklo_epi8(load##BPP(prev + i), zero);                   \
+        __m128i x = _mm_unpacklo_epi8(load##BPP(raw + i), zero);                    \
+        __m128i pa = _mm_sub_epi16(b, c);                                           \
+        __m128i pb = _mm_sub_epi16(a, c);                                           \
+        __m128i pc = _mm_add_epi16(pa, pb);                                         \
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));                            \
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));                            \
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));                            \
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));                \
+        /* Ties favour a over b over c */                                           \
+        __m128i use_b = _mm_cmpeq_epi16(smallest, pb);                              \
+        __m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b),                     \
+                                       _mm_andnot_si128(use_b, c));                 \
+        __m128i use_a = _mm_cmpeq_epi16(smallest, pa);                              \
+        nearest = _mm_or_si128(_mm_and_si128(use_a, a),                             \
+                               _mm_andnot_si128(use_a, nearest));                   \
+        /* epi8 add: wrap modulo 256 within each 16-bit lane */                     \
+        a = _mm_add_epi8(x, nearest);                                               \
+        store##BPP(dst + i, _mm_packus_epi16(a, a));                                \
+        c = b;                                                                      \
+    }                                                                               \
+}
+
+DEFINE_SSE2_KERNELS(3)
+DEFINE_SSE2_KERNELS(4)
+#endif  // PNG_FILTER_X86
+
+static struct png_unfilterKernels kernels[9];
+
+/* Kernels are selected once, safe to race from decoder threads. */
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+    static const struct {
+        int bpp;
+        png_unfilterFn sub, avg, paeth;
+    } scalar[] = {
+        {1, unfilter_sub_1, unfilter_avg_1, unfilter_paeth_1},
+        {2, unfilter_sub_2, unfilter_avg_2, unfilter_paeth_2},
+        {3, unfilter_sub_3, unfilter_avg_3, unfilter_paeth_3},
+        {4, unfilter_sub_4, unfilter_avg_4, unfilter_paeth_4},
+        {6, unfilter_sub_6, unfilter_avg_6, unfilter_paeth_6},
+        {8, unfilter_sub_8, unfilter_avg_8, unfilter_paeth_8},
+    };
+
+    png_unfilterFn up = unfilter_up;
+#ifdef PNG_FILTER_X86
+    __builtin_cpu_init();
+    up = __builtin_cpu_supports("avx2") ? unfilter_up_avx2 : unfilter_up_sse2;
+#endif
+
+    for (size_t i = 0; i < sizeof(scalar) / sizeof(scalar[0]); i++) {
+        struct png_unfilterKernels *k = &kernels[scalar[i].bpp];
+        k->fn[PNG_FILTER_TYPE_NONE] = unfilter_none;
+        k->fn[PNG_FILTER_TYPE_SUB] = scalar[i].sub;
+        k->fn[PNG_FILTER_TYPE_UP] = up;
+        k->fn[PNG_FILTER_TYPE_AVERAGE] = scalar[i].avg;
+        k->fn[PNG_FILTER_TYPE_PAETH] = scalar[i].paeth;
+    }
+
+#ifdef PNG_FILTER_X86
+    kernels[3].fn[PNG_FILTER_TYPE_SUB] = unfilter_sub_3_sse2;
+    kernels[3].fn[PNG_FILTER_TYPE_AVERAGE] = unfilter_avg_3_sse2;
+    kernels[3].fn[PNG_FILTER_TYPE_PAETH] = unfilter_paeth_3_sse2;
+    kernels[4].fn[PNG_FILTER_TYPE_SUB] = unfilter_sub_4_sse2;
+    kernels[4].fn[PNG_FILTER_TYPE_AVERAGE] = unfilter_avg_4_sse2;
+    kernels[4].fn[PNG_FILTER_TYPE_PAETH] = unfilter_paeth_4_sse2;
+#endif
+}
+
+// Kernels for a pixel size of bpp bytes (1, 2, 3, 4, 6 or 8), NULL otherwise
+const struct png_unfilterKernels *png_getUnfilterKernels(int bpp) {
+    pthread_once(&kernels_once, select_kernels);
+    if (bpp < 1 || bpp > 8 || kernels[bpp].fn[0] == NULL) {
+        return NULL;
+    }
+    return &kernels[bpp];
+}
+
+int png_unfilterRow(uint8_t filter, uint8_t *dst, const uint8_t *prev,
+                    const uint8_t *raw, size_t len, int bpp) {
+    const struct png_unfilterKernels *k = png_getUnfilterKernels(bpp);
+    if (k == NULL || filter >= PNG_FILTER_TYPES) {
+        return -1;
+    }
+    k->fn[filter](dst, prev, raw, len, 0);
+    return 0;
+}
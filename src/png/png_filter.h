@@ -0,0 +1,42 @@
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+enum {
+    PNG_FILTER_TYPE_NONE = 0,
+    PNG_FILTER_TYPE_SUB = 1,
+    PNG_FILTER_TYPE_UP = 2,
+    PNG_FILTER_TYPE_AVERAGE = 3,
+    PNG_FILTER_TYPE_PAETH = 4,
+    PNG_FILTER_TYPES
+};
+
+// Reconstruct one scanline: dst[i] = raw[i] + predictor(dst, prev).
+// prev is the previous reconstructed row (zeros for the first row).
+// With left set, dst, prev and raw point into the middle of their rows and
+// the pixel before them is the left neighbour instead of zeros.
+typedef void (*png_unfilterFn)(uint8_t *dst, const uint8_t *prev,
+                               const uint8_t *raw, size_t len, int left);
+
+struct png_unfilterKernels {
+    png_unfilterFn fn[PNG_FILTER_TYPES];
+};
+
+static inline uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+const struct png_unfilterKernels *png_getUnfilterKernels(int bpp);
+int png_unfilterRow(uint8_t filter, uint8_t *dst, const uint8_t *prev,
+                    const uint8_t *raw, size_t len, int bpp);
+
+#endif  // PNG_FILTER_H
@@ -0,0 +1,218 @@
+#include "png_map.h"
+#include "../crc/crc.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../log.h"
+
+int png_mapFile(const char *filename, struct png_map *map) {
+    // Failures are quiet, the caller falls back to reading the file
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    // The file is read front to back once
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    map->data = data;
+    map->size = st.st_size;
+    map->mapped = 1;
+    return 1;
+}
+
+/*
+ * For inputs that can't be mapped (pipes): read the whole file into the
+ * arena so it can be decoded the same way as a mapping.
+ */
+int png_loadFile(const char *filename, struct png_arena *arena, struct png_map *map) {
+    FILE *fptr = fopen(filename, "rb");
+    if (fptr == NULL) {
+        LOGE("Failed to open file %s\n", filename);
+        return -1;
+    }
+
+    size_t capacity = 64 * 1024;
+    size_t size = 0;
+    uint8_t *data = png_arenaAlloc(arena, capacity);
+    while (data) {
+        size += fread(data + size, 1, capacity - size, fptr);
+        if (size < capacity) {
+            break;
+        }
+        // The old buffer stays in the arena until the next reset
+        uint8_t *grown = png_arenaAlloc(arena, 2 * capacity);
+        if (grown) {
+            memcpy(grown, data, size);
+        }
+        data = grown;
+        capacity *= 2;
+    }
+    int failed = ferror(fptr);
+    fclose(fptr);
+    if (data == NULL || failed) {
+        LOGE("Failed to read file %s\n", filename);
+        return -1;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->mapped = 0;
+    return 1;
+}
+
+void png_unmapFile(struct png_map *map) {
+    if (map->data && map->mapped) {
+        munmap((void *)map->data, map->size);
+    }
+    map->data = NULL;
+    map->size = 0;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+// Bounds-check the chunk at pos; its total size, or 0 if it runs past the end
+static size_t png_chunkSpan(const struct png_map *map, size_t pos) {
+    // length + type in front of the data, crc behind it
+    if (map->size - pos < 12) {
+        LOGE("Error reading chunk or end of file\n");
+        return 0;
+    }
+    uint32_t length = read_be32(map->data + pos);
+    if (length > map->size - pos - 12) {
+        LOGE("Chunk length %u runs past the end of the file\n", length);
+        return 0;
+    }
+    return 12 + (size_t)length;
+}
+
+/*
+ * Walk the chunks after the file signature up to IEND. The views go into
+ * one arena allocation sized by a first pass over the chunk headers.
+ * Returns the number of views, or -1 on failure.
+ */
+int png_mapChunks(const struct png_map *map, struct png_arena *arena,
+                  struct png_chunkView **views) {
+    int count = 0;
+    for (size_t pos = 8, span; (span = png_chunkSpan(map, pos)) != 0; pos += span) {
+        count++;
+        if (memcmp(map->data + pos + 4, "IEND", 4) == 0) {
+            break;
+        }
+    }
+
+    *views = png_arenaAlloc(arena, (count ? count : 1) * sizeof(struct png_chunkView));
+    if (*views == NULL) {
+        LOGE("Failed to allocte memory for chunks\n");
+        return -1;
+    }
+
+    size_t pos = 8; // file signature
+    for (int i = 0; i < count; i++) {
+        struct png_chunkView *view = &(*views)[i];
+        uint32_t length = read_be32(map->data + pos);
+        memcpy(view->chunkType, map->data + pos + 4, sizeof(view->chunkType));
+        view->offset = pos + 8;
+        view->length = length;
+        view->crc = read_be32(map->data + pos + 8 + length);
+        pos += 12 + (size_t)length;
+    }
+    return count;
+}
+
+// CRC over the chunk type and data as they sit in the mapping
+int png_viewCompareCRC(const struct png_map *map, const struct png_chunkView *view) {
+    unsigned char *type = (unsigned char *)map->data + view->offset - 4;
+    return crc(type, (size_t)view->length + 4) == view->crc;
+}
+
+void png_idatReaderInit(struct png_idatReader *r, const struct png_map *map,
+                        const struct png_chunkView *idat, int count) {
+    r->map = map;
+    r->idat = idat;
+    r->count = count;
+    r->total = 0;
+    for (int i = 0; i < count; i++) {
+        r->total += idat[i].length;
+    }
+    r->base = 0;
+}
+
+// Copy up to n stream bytes starting at pos, across chunk boundaries
+size_t png_idatCopy(const struct png_idatReader *r, size_t pos, uint8_t *dst, size_t n) {
+    size_t start = 0;
+    size_t copied = 0;
+    for (int i = 0; i < r->count && copied < n; i++) {
+        size_t end = start + r->idat[i].length;
+        if (pos + copied < end) {
+            size_t from = pos + copied - start;
+            size_t len = end - (pos + copied);
+            if (len > n - copied) len = n - copied;
+            memcpy(dst + copied, r->map->data + r->idat[i].offset + from, len);
+            copied += len;
+        }
+        start = end;
+    }
+    return copied;
+}
+
+/*
+ * Point the inflate input at stream offset pos, the next byte the bitstream
+ * will load. Bits already in the accumulator are kept, so this is also how
+ * the reader answers INFLATE_NEED_INPUT. Input comes straight from the
+ * chunk holding pos unless that chunk is about to run out, then the bytes
+ * around the boundary go through the bridge buffer.
+ */
+void png_idatSeek(struct png_idatReader *r, struct inflateState *s, size_t pos) {
+    struct bitStream *bs = &s->bs;
+    size_t start = 0;
+
+    for (int i = 0; i < r->count; i++) {
+        size_t end = start + r->idat[i].length;
+        int last = (i == r->count - 1);
+        if (pos < end && (last || end - pos > 2 * INFLATE_INPUT_MARGIN)) {
+            bs->data = (uint8_t *)r->map->data + r->idat[i].offset;
+            bs->length = r->idat[i].length;
+            bs->bytepos = pos - start;
+            s->input_done = last;
+            r->base = start;
+            return;
+        }
+        if (pos < end) {
+            break;
+        }
+        start = end;
+    }
+
+    size_t n = png_idatCopy(r, pos, r->bridge, sizeof(r->bridge));
+    PNG_STATS_ADD(s->stats, copied_bytes, n);
+    bs->data = r->bridge;
+    bs->length = n;
+    bs->bytepos = 0;
+    s->input_done = (pos + n == r->total);
+    r->base = pos;
+}
+
+// png_idatSeek to where the bitstream stopped, for INFLATE_NEED_INPUT
+void png_idatRefill(void *ctx, struct inflateState *s) {
+    struct png_idatReader *r = ctx;
+    png_idatSeek(r, s, r->base + s->bs.bytepos);
+}
@@ -0,0 +1,53 @@
+#ifndef PNG_MAP_H
+#define PNG_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "inflate.h"
+#include "png_arena.h"
+
+// Read-only view of a whole PNG file, mapped or loaded into an arena
+struct png_map {
+    const uint8_t *data;
+    size_t size;
+    int mapped;   // data is an mmap, not arena memory
+};
+
+// A chunk described by where it sits in the mapping, its data is not copied
+struct png_chunkView {
+    char chunkType[4];
+    size_t offset;    // file offset of the chunk data
+    uint32_t length;
+    uint32_t crc;
+};
+
+#define PNG_IDAT_BRIDGE_SIZE (4 * INFLATE_INPUT_MARGIN)
+
+/*
+ * Feeds the zlib stream split over consecutive IDAT chunks to inflate
+ * straight out of the mapping. The bitstream points into the current chunk;
+ * only the few bytes around a chunk boundary are copied, into bridge.
+ */
+struct png_idatReader {
+    const struct png_map *map;
+    const struct png_chunkView *idat;
+    int count;
+    size_t total;   // zlib stream length, sum of the IDAT lengths
+    size_t base;    // stream offset of bs.data[0]
+    uint8_t bridge[PNG_IDAT_BRIDGE_SIZE];
+};
+
+int png_mapFile(const char *filename, struct png_map *map);
+int png_loadFile(const char *filename, struct png_arena *arena, struct png_map *map);
+void png_unmapFile(struct png_map *map);
+int png_mapChunks(const struct png_map *map, struct png_arena *arena,
+                  struct png_chunkView **views);
+int png_viewCompareCRC(const struct png_map *map, const struct png_chunkView *view);
+
+void png_idatReaderInit(struct png_idatReader *r, const struct png_map *map,
+                        const struct png_chunkView *idat, int count);
+size_t png_idatCopy(const struct png_idatReader *r, size_t pos, uint8_t *dst, size_t n);
+void png_idatSeek(struct png_idatReader *r, struct inflateState *s, size_t pos);
+void png_idatRefill(void *ctx, struct inflateState *s);
+
+#endif  // PNG_MAP_H
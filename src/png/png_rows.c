@@ -0,0 +1,397 @@
+#include "png_rows.h"
+#include "adler32.h"
+#include "deflate.h"
+#include "png_filter.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+
+// Everything but the window
+static int png_rowsSetup(struct png_rowDecoder *d, const struct png_IHDR *ihdr,
+                         struct png_arena *arena) {
+    memset(d, 0, sizeof(*d));
+    d->filtered_bpp = png_filteredBpp(ihdr);
+    if (d->filtered_bpp < 0) {
+        return -1;
+    }
+    d->height = ihdr->height;
+    d->stride = png_rowBytes(ihdr);
+    d->adler = 1;
+    if (png_mulSize(d->stride + 1, d->height, &d->filtered_size) != 0) {
+        LOGE("Image of %ux%u pixels is too big\n", ihdr->width, ihdr->height);
+        return -1;
+    }
+
+    if (ihdr->interlaceMethod != 0) {
+        d->interlaced = 1;
+        d->pass = -1;
+        d->height = 0;
+        d->filtered_size = 0;
+        for (int pass = 0; pass < PNG_ADAM7_PASSES; pass++) {
+            struct png_IHDR reduced = *ihdr;
+            reduced.width = png_adam7Width(ihdr->width, pass);
+            reduced.height = reduced.width ? png_adam7Height(ihdr->height, pass) : 0;
+            d->pass_width[pass] = reduced.width;
+            d->pass_height[pass] = reduced.height;
+            d->pass_stride[pass] = png_rowBytes(&reduced);
+            d->height += reduced.height;
+            // Never more than the non-interlaced size checked above
+            d->filtered_size += (d->pass_stride[pass] + 1) * reduced.height;
+        }
+    }
+
+    d->prev_row = png_arenaCalloc(arena, d->stride + 1);
+    d->cur_row = png_arenaAlloc(arena, d->stride + 1);
+    if (!d->prev_row || !d->cur_row) {
+        LOGE("Failed to allocate row decoder buffers\n");
+        return -1;
+    }
+    return 0;
+}
+
+int png_rowsInit(struct png_rowDecoder *d, const struct png_IHDR *ihdr,
+                 png_refillFn refill, void *ctx, struct png_arena *arena) {
+    if (png_rowsSetup(d, ihdr, arena) != 0) {
+        return -1;
+    }
+    d->refill = refill;
+    d->ctx = ctx;
+
+    // Twice the DEFLATE window so each slide frees at least 32 KiB and the
+    // memmove cost stays proportional to the output
+    d->window_size = 2 * DEFLATE_WSIZE + 2 * (d->stride + 1);
+    d->window = png_arenaAlloc(arena, d->window_size);
+    if (!d->window) {
+        LOGE("Failed to allocate row decoder buffers\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Unfilter rows out of a stream that was inflated in one go (see
+ * inflate_parallel) into data. inflate is where that left the stream, so
+ * png_rowsFinish can check the Adler-32 that follows it.
+ */
+int png_rowsInitInflated(struct png_rowDecoder *d, const struct png_IHDR *ihdr,
+                         uint8_t *data, size_t size, const struct inflateState *inflate,
+                         struct png_arena *arena) {
+    if (png_rowsSetup(d, ihdr, arena) != 0) {
+        return -1;
+    }
+    d->inflate = *inflate;
+    d->window = data;
+    d->window_size = size;
+    d->window_pos = size;
+    PNG_STATS_START(t);
+    d->adler = adler32_update(1, data, size);
+    PNG_STATS_STOP(d->inflate.stats, PNG_STAGE_ADLER32, t);
+    return 0;
+}
+
+// Inflate more data into the window. 0 on progress, -1 on error
+static int png_rowsInflate(struct png_rowDecoder *d) {
+    if (d->window_pos == d->window_size) {
+        // Keep the unread rows and a full window of history
+        size_t keep_from = d->window_pos - DEFLATE_WSIZE;
+        if (keep_from > d->read_pos) keep_from = d->read_pos;
+        memmove(d->window, d->window + keep_from, d->window_pos - keep_from);
+        PNG_STATS_ADD(d->inflate.stats, copied_bytes, d->window_pos - keep_from);
+        d->window_pos -= keep_from;
+        d->read_pos -= keep_from;
+    }
+
+    size_t start = d->window_pos;
+    PNG_STATS_START(t0);
+    int res = inflate_run(&d->inflate, d->window, &d->window_pos, d->window_size);
+    PNG_STATS_START(t1);
+    d->adler = adler32_update(d->adler, d->window + start, d->window_pos - start);
+    PNG_STATS_STOP(d->inflate.stats, PNG_STAGE_ADLER32, t1);
+    PNG_STATS_ADD(d->inflate.stats, ticks[PNG_STAGE_INFLATE], t1 - t0);
+
+    switch (res) {
+        case INFLATE_OUTPUT_FULL:
+            return 0;
+        case INFLATE_NEED_INPUT:
+            if (d->refill == NULL) {
+                LOGE("Inflated data truncated at row %u\n", d->row);
+                return -1;
+            }
+            d->refill(d->ctx, &d->inflate);
+            return 0;
+        case INFLATE_STREAM_END:
+            if (d->window_pos == start) {
+                LOGE("Inflated data truncated at row %u\n", d->row);
+                return -1;
+            }
+            return 0;
+        default:
+            LOGE("DEFLATE block decode failed\n");
+            return -1;
+    }
+}
+
+// Move on to the next Adam7 pass that has rows, it starts from a zero previous row
+static void png_rowsNextPass(struct png_rowDecoder *d) {
+    do {
+        d->pass++;
+    } while (d->pass_height[d->pass] == 0);
+    d->pass_row = 0;
+    d->stride = d->pass_stride[d->pass];
+    memset(d->prev_row, 0, d->stride);
+}
+
+/*
+ * Unfilter the next scanline. Returns the row (stride bytes, valid until the
+ * next call), or NULL on error or once all rows have been returned.
+ */
+const uint8_t *png_rowsNext(struct png_rowDecoder *d) {
+    if (d->row >= d->height) {
+        return NULL;
+    }
+    if (d->interlaced && (d->pass < 0 || ++d->pass_row == d->pass_height[d->pass])) {
+        png_rowsNextPass(d);
+    }
+    size_t row_bytes = d->stride + 1;
+
+    while (d->window_pos - d->read_pos < row_bytes) {
+        if (png_rowsInflate(d) != 0) {
+            return NULL;
+        }
+    }
+
+    const uint8_t *raw = d->window + d->read_pos;
+    PNG_STATS_START(t);
+    if (png_unfilterRow(raw[0], d->cur_row, d->prev_row, raw + 1,
+                        d->stride, d->filtered_bpp) != 0) {
+        LOGE("Unknown filter %u\n", raw[0]);
+        return NULL;
+    }
+    PNG_STATS_STOP(d->inflate.stats, PNG_STAGE_UNFILTER, t);
+    d->read_pos += row_bytes;
+    d->row++;
+
+    // The row just decoded is the previous row of the next one
+    uint8_t *tmp = d->prev_row;
+    d->prev_row = d->cur_row;
+    d->cur_row = tmp;
+    return d->prev_row;
+}
+
+/*
+ * After the last row: run the stream to its end and check the Adler-32.
+ * Problems past the image data are only logged, the rows are already out.
+ */
+int png_rowsFinish(struct png_rowDecoder *d) {
+    while (1) {
+        size_t end = d->window_pos;
+        int res = inflate_run(&d->inflate, d->window, &d->window_pos, end);
+        if (res == INFLATE_NEED_INPUT && d->refill) {
+            d->refill(d->ctx, &d->inflate);
+            continue;
+        }
+        if (res != INFLATE_STREAM_END) {
+            LOGW("Extra compressed data after the last scanline\n");
+            return -1;
+        }
+        break;
+    }
+
+    uint32_t adler = 0;
+    struct bitStream *bs = &d->inflate.bs;
+    bitstream_align_byte(bs);
+    if (bitstream_bits_left(bs) < 32 && d->refill) {
+        d->refill(d->ctx, &d->inflate);
+    }
+    for (int i = 0; i < 4; i++) {
+        uint32_t byte;
+        if (bitstream_read(bs, 8, &byte) != 0) {
+            LOGE("Missing Adler32 checksum\n");
+            return -1;
+        }
+        adler = (adler << 8) | byte;
+    }
+    if (adler != d->adler) {
+        LOGE("Adler32 mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parallel unfilter and convert for a decoder set up with
+ * png_rowsInitInflated. Threads take rows in turn and unfilter each one in
+ * place, span by span from left to right, then convert it. A row whose
+ * filter looks at the row above (Up, Average, Paeth) only waits for that row
+ * to be done up to the end of the span it is working on, so consecutive
+ * rows run as a wavefront a span apart and an image filtered with Paeth
+ * throughout keeps as many threads busy as None and Sub rows do. Each row's
+ * progress is published per span; a thread that gets ahead spins briefly,
+ * then sleeps on a condition variable until the row it waits for moves on.
+ */
+struct png_rowJob {
+    struct png_rowDecoder *d;
+    const struct png_image *image;
+    uint8_t *pixels;
+    size_t out_stride;
+    enum png_format format;
+    const struct png_unfilterKernels *kernels;
+    const uint8_t *zero_row;   // previous row of the first row
+
+    size_t span;               // bytes unfiltered between progress updates
+    uint32_t group;            // rows taken at a time
+    uint32_t next_row;         // shared by the workers
+    size_t *done;              // bytes of each row unfiltered so far
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    int waiters;               // threads sleeping on progress
+};
+
+// Busy checks before a waiting thread goes to sleep
+#define PNG_WAIT_SPINS 1024
+// Rows of one span can't overlap anyway; taking this many bytes of them at a
+// time keeps the handoffs between threads rare
+#define PNG_ROWS_GROUP (16 * 1024)
+
+static void png_wakeWaiters(struct png_rowJob *job) {
+    pthread_mutex_lock(&job->lock);
+    pthread_cond_broadcast(&job->progress);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Sequentially consistent on both sides: either the publisher sees the
+ * waiter counted and wakes it, or the waiter sees the new progress before
+ * it sleeps.
+ */
+static void png_publishRow(struct png_rowJob *job, uint32_t row, size_t bytes) {
+    __atomic_store_n(&job->done[row], bytes, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&job->waiters, __ATOMIC_SEQ_CST) > 0) {
+        png_wakeWaiters(job);
+    }
+}
+
+static void png_failRows(struct png_rowJob *job) {
+    __atomic_store_n(&job->error, 1, __ATOMIC_SEQ_CST);
+    png_wakeWaiters(job);
+}
+
+// Wait until the first bytes of row are unfiltered. Returns 0, -1 on error
+static int png_waitRow(struct png_rowJob *job, uint32_t row, size_t bytes) {
+    for (int spin = 0; spin < PNG_WAIT_SPINS; spin++) {
+        if (__atomic_load_n(&job->done[row], __ATOMIC_ACQUIRE) >= bytes) {
+            return 0;
+        }
+        if (__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    __atomic_add_fetch(&job->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&job->done[row], __ATOMIC_SEQ_CST) < bytes &&
+           !__atomic_load_n(&job->error, __ATOMIC_SEQ_CST)) {
+        pthread_cond_wait(&job->progress, &job->lock);
+    }
+    __atomic_sub_fetch(&job->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&job->lock);
+    return __atomic_load_n(&job->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+static int png_unfilterWave(struct png_rowJob *job, uint32_t row) {
+    struct png_rowDecoder *d = job->d;
+    size_t row_bytes = d->stride + 1;
+    uint8_t *raw = d->window + row * row_bytes;
+    uint8_t filter = raw[0];
+    if (filter >= PNG_FILTER_TYPES) {
+        LOGE("Unknown filter %u\n", filter);
+        png_failRows(job);
+        return -1;
+    }
+    const uint8_t *prev = row == 0 ? job->zero_row : raw - row_bytes + 1;
+    int needs_prev = row > 0 && filter >= PNG_FILTER_TYPE_UP;
+
+    // Unfiltered in place, the filter byte stays in front of the row
+    for (size_t pos = 0; pos < d->stride; pos += job->span) {
+        size_t len = d->stride - pos < job->span ? d->stride - pos : job->span;
+        if (needs_prev && png_waitRow(job, row - 1, pos + len) != 0) {
+            return -1;
+        }
+        job->kernels->fn[filter](raw + 1 + pos, prev + pos, raw + 1 + pos, len, pos > 0);
+        png_publishRow(job, row, pos + len);
+    }
+    return 0;
+}
+
+static void *png_rowWorker(void *arg) {
+    struct png_rowJob *job = arg;
+    struct png_rowDecoder *d = job->d;
+    uint32_t start;
+
+    while ((start = __atomic_fetch_add(&job->next_row, job->group, __ATOMIC_RELAXED)) < d->height) {
+        uint32_t end = start + job->group;
+        if (end > d->height) end = d->height;
+        for (uint32_t row = start; row < end; row++) {
+            if (png_unfilterWave(job, row) != 0) {
+                return NULL;
+            }
+            png_convertRow(job->image, d->window + row * (d->stride + 1) + 1,
+                           job->pixels + row * job->out_stride, job->image->ihdr.width,
+                           job->format);
+        }
+    }
+    return NULL;
+}
+
+int png_rowsUnfilterParallel(struct png_rowDecoder *d, struct png_image *image, uint8_t *pixels,
+                             size_t out_stride, enum png_format format, int threads,
+                             struct png_arena *arena) {
+    if (d->window_pos < d->filtered_size) {
+        LOGE("Inflated data truncated\n");
+        return -1;
+    }
+
+    // Spans hold whole pixels
+    size_t span = PNG_ROWS_SPAN - PNG_ROWS_SPAN % d->filtered_bpp;
+    struct png_rowJob job = {
+        .d = d,
+        .image = image,
+        .pixels = pixels,
+        .out_stride = out_stride,
+        .format = format,
+        .kernels = png_getUnfilterKernels(d->filtered_bpp),
+        .zero_row = d->prev_row, // png_rowsSetup zeroes it
+        .span = span,
+        .group = d->stride < span ? (uint32_t)(PNG_ROWS_GROUP / d->stride) : 1,
+    };
+    job.done = png_arenaCalloc(arena, (size_t)d->height * sizeof(*job.done));
+    pthread_t *workers = png_arenaAlloc(arena, (size_t)threads * sizeof(pthread_t));
+    if (job.kernels == NULL || job.done == NULL || workers == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.progress, NULL);
+    LOGI("Unfiltering %u rows on %d threads in %zu byte spans\n", d->height, threads, span);
+
+    // The calling thread works too; failing to start a worker just means less help
+    PNG_STATS_START(t);
+    int started = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&workers[started], NULL, png_rowWorker, &job) == 0) {
+            started++;
+        }
+    }
+    png_rowWorker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    PNG_STATS_STOP(d->inflate.stats, PNG_STAGE_UNFILTER, t);
+
+    pthread_cond_destroy(&job.progress);
+    pthread_mutex_destroy(&job.lock);
+    d->row = d->height;
+    return job.error ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef PNG_ROWS_H
+#define PNG_ROWS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "png.h"
+#include "inflate.h"
+#include "png_arena.h"
+#include "png_adam7.h"
+
+// Filtered image size from which png_open unfilters rows on several threads
+#define PNG_PARALLEL_MIN (1024 * 1024)
+// Bytes of a row png_rowsUnfilterParallel does before the row below may follow
+#define PNG_ROWS_SPAN 1024
+
+// Supplies more input when inflate_run returns INFLATE_NEED_INPUT
+typedef void (*png_refillFn)(void *ctx, struct inflateState *inflate);
+
+/*
+ * Scanline decoder shared by png_open and the stream API. Rows are inflated
+ * into a sliding window that holds the 32 KiB DEFLATE history plus a couple
+ * of rows, checksummed as they are produced and unfiltered one at a time, so
+ * each row is handled while it is still in cache and only two unfiltered
+ * rows are ever kept.
+ *
+ * Interlaced images come out pass by pass, each pass's rows as wide as the
+ * pass; pass and pass_row say where the row png_rowsNext returned belongs.
+ *
+ * The caller sets up inflate's input (past the zlib header) after
+ * png_rowsInit; refill may be NULL when the whole stream is already there.
+ * Buffers come from the arena and go away with it.
+ */
+struct png_rowDecoder {
+    struct inflateState inflate;
+    png_refillFn refill;
+    void *ctx;
+
+    uint8_t *window;
+    size_t window_size;
+    size_t window_pos;   // end of inflated data
+    size_t read_pos;     // start of the next filtered row
+    uint32_t adler;      // of everything inflated so far
+
+    int filtered_bpp;
+    size_t stride;       // unfiltered bytes per row, of the current pass if interlaced
+    uint32_t height;     // filtered rows, of all passes if interlaced
+    uint32_t row;        // rows returned so far
+    size_t filtered_size; // every filtered row with its filter byte
+
+    // Adam7 only, passes too small to have pixels have no rows
+    uint8_t interlaced;
+    uint32_t pass_width[PNG_ADAM7_PASSES];
+    uint32_t pass_height[PNG_ADAM7_PASSES];
+    size_t pass_stride[PNG_ADAM7_PASSES];
+    int pass;            // of the last row returned
+    uint32_t pass_row;
+    uint8_t *prev_row;
+    uint8_t *cur_row;
+};
+
+int png_rowsInit(struct png_rowDecoder *d, const struct png_IHDR *ihdr,
+                 png_refillFn refill, void *ctx, struct png_arena *arena);
+int png_rowsInitInflated(struct png_rowDecoder *d, const struct png_IHDR *ihdr,
+                         uint8_t *data, size_t size, const struct inflateState *inflate,
+                         struct png_arena *arena);
+const uint8_t *png_rowsNext(struct png_rowDecoder *d);
+int png_rowsFinish(struct png_rowDecoder *d);
+int png_rowsUnfilterParallel(struct png_rowDecoder *d, struct png_image *image, uint8_t *pixels,
+                             size_t out_stride, enum png_format format, int threads,
+                             struct png_arena *arena);
+
+#endif  // PNG_ROWS_H
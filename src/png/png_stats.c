@@ -0,0 +1,60 @@
+#include "png_stats.h"
+#include <inttypes.h>
+
+static const char *png_stageNames[PNG_STAGES] = {
+    "header", "inflate", "adler32", "unfilter", "convert",
+};
+
+void png_statsMerge(struct png_stats *into, const struct png_stats *from) {
+    // Every field is a uint64_t counter
+    uint64_t *dst = (uint64_t *)into;
+    const uint64_t *src = (const uint64_t *)from;
+    for (size_t i = 0; i < sizeof(struct png_stats) / sizeof(uint64_t); i++) {
+        dst[i] += src[i];
+    }
+}
+
+// One JSON object, ticks are TSC cycles on x86 and nanoseconds elsewhere
+void png_statsPrint(const struct png_stats *stats, FILE *fptr) {
+    uint64_t total = 0;
+    for (int i = 0; i < PNG_STAGES; i++) {
+        total += stats->ticks[i];
+    }
+
+    fprintf(fptr, "{\n  \"enabled\": %s,\n", PNG_STATS_ENABLED ? "true" : "false");
+#if defined(__x86_64__) || defined(__i386__)
+    fprintf(fptr, "  \"tick_unit\": \"tsc\",\n");
+#else
+    fprintf(fptr, "  \"tick_unit\": \"ns\",\n");
+#endif
+    fprintf(fptr, "  \"images\": %" PRIu64 ",\n  \"pixels\": %" PRIu64 ",\n",
+            stats->images, stats->pixels);
+    fprintf(fptr, "  \"compressed_bytes\": %" PRIu64 ",\n  \"filtered_bytes\": %" PRIu64 ",\n",
+            stats->compressed_bytes, stats->filtered_bytes);
+
+    fprintf(fptr, "  \"stages\": {\n");
+    for (int i = 0; i < PNG_STAGES; i++) {
+        fprintf(fptr, "    \"%s\": {\"ticks\": %" PRIu64 ", \"share\": %.4f, "
+                "\"ticks_per_pixel\": %.3f}%s\n",
+                png_stageNames[i], stats->ticks[i],
+                total ? (double)stats->ticks[i] / total : 0.0,
+                stats->pixels ? (double)stats->ticks[i] / stats->pixels : 0.0,
+                i + 1 < PNG_STAGES ? "," : "");
+    }
+    fprintf(fptr, "  },\n");
+
+    fprintf(fptr, "  \"inflate\": {\"stored_blocks\": %" PRIu64 ", "
+            "\"fixed_blocks\": %" PRIu64 ", \"dynamic_blocks\": %" PRIu64 ", "
+            "\"symbols\": %" PRIu64 ", \"literal_bytes\": %" PRIu64 ", "
+            "\"match_bytes\": %" PRIu64 ", \"matches\": %" PRIu64 ", "
+            "\"avg_match_length\": %.2f, \"stored_bytes\": %" PRIu64 "},\n",
+            stats->blocks[0], stats->blocks[1], stats->blocks[2], stats->symbols,
+            stats->literal_bytes, stats->match_bytes, stats->matches,
+            stats->matches ? (double)stats->match_bytes / stats->matches : 0.0,
+            stats->stored_bytes);
+    fprintf(fptr, "  \"memory\": {\"allocations\": %" PRIu64 ", "
+            "\"allocated_bytes\": %" PRIu64 ", \"allocator_calls\": %" PRIu64 ", "
+            "\"copied_bytes\": %" PRIu64 "}\n}\n",
+            stats->allocations, stats->allocated_bytes, stats->allocator_calls,
+            stats->copied_bytes);
+}
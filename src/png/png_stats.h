@@ -0,0 +1,77 @@
+#ifndef PNG_STATS_H
+#define PNG_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Decoder stages timed in png_stats.ticks
+enum png_stage {
+    PNG_STAGE_HEADER,   // map the file, walk the chunks, IHDR/PLTE/tRNS
+    PNG_STAGE_INFLATE,
+    PNG_STAGE_ADLER32,
+    PNG_STAGE_UNFILTER, // with colour conversion when unfiltered in parallel
+    PNG_STAGE_CONVERT,
+    PNG_STAGES
+};
+
+/*
+ * Counters a decoder accumulates over every image it decodes. Only a
+ * build with -DPNG_STATS (make STATS=1) fills them in; otherwise the
+ * PNG_STATS_* macros below compile to nothing and the struct stays zero.
+ * The streams of a parallel inflate are timed but not counted.
+ */
+struct png_stats {
+    uint64_t images;
+    uint64_t pixels;
+    uint64_t compressed_bytes;   // zlib stream
+    uint64_t filtered_bytes;     // inflated scanlines
+    uint64_t ticks[PNG_STAGES];
+
+    uint64_t blocks[3];          // by BTYPE: stored, fixed, dynamic
+    uint64_t symbols;            // literal/length symbols decoded
+    uint64_t literal_bytes;
+    uint64_t match_bytes;
+    uint64_t matches;
+    uint64_t stored_bytes;
+
+    uint64_t allocations;        // arena allocations
+    uint64_t allocated_bytes;
+    uint64_t allocator_calls;    // arena blocks taken from the allocator
+    uint64_t copied_bytes;       // IDAT joins and bridges, window slides
+};
+
+// rdtsc where there is one, nanoseconds otherwise
+static inline uint64_t png_statsTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#ifdef PNG_STATS
+#define PNG_STATS_ENABLED 1
+#define PNG_STATS_ONLY(...) __VA_ARGS__
+#define PNG_STATS_ADD(stats, field, n) \
+do { if (stats) (stats)->field += (n); } while (0)
+#define PNG_STATS_START(t) uint64_t t = png_statsTicks()
+#define PNG_STATS_STOP(stats, stage, t) \
+PNG_STATS_ADD(stats, ticks[stage], png_statsTicks() - (t))
+#else
+#define PNG_STATS_ENABLED 0
+#define PNG_STATS_ONLY(...)
+#define PNG_STATS_ADD(stats, field, n) do { } while (0)
+#define PNG_STATS_START(t) do { } while (0)
+#define PNG_STATS_STOP(stats, stage, t) do { } while (0)
+#endif
+
+void png_statsMerge(struct png_stats *into, const struct png_stats *from);
+void png_statsPrint(const struct png_stats *stats, FILE *fptr);
+
+#endif  // PNG_STATS_H
@@ -0,0 +1,227 @@
+#include "png_stream.h"
+#include "../crc/crc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../log.h"
+
+static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+static void png_streamStartIDAT(struct png_stream *s, struct png_chunk *chunk) {
+    s->chunk_left = chunk->length;
+    s->chunk_crc = update_crc(0xffffffffL, (unsigned char *)chunk->chunkType,
+                              sizeof(chunk->chunkType));
+}
+
+// Check the CRC of the finished IDAT chunk and move on to the next chunk.
+// Returns 1 when another IDAT follows, 0 at the end of the IDAT run.
+static int png_streamNextIDAT(struct png_stream *s) {
+    uint32_t expected;
+    if (fread(&expected, sizeof(expected), 1, s->fptr) != 1) {
+        LOGE("Failed to read chunk crc\n");
+        s->error = 1;
+        return 0;
+    }
+    if ((s->chunk_crc ^ 0xffffffffL) != __builtin_bswap32(expected)) {
+        LOGE("CRC NOT MATCHING\n");
+    }
+
+    struct png_chunk chunk;
+    if (png_readChunkHeader(s->fptr, &chunk) != 1) {
+        s->error = 1;
+        return 0;
+    }
+    if (strncmp(chunk.chunkType, "IDAT", 4) != 0) {
+        return 0;
+    }
+    png_streamStartIDAT(s, &chunk);
+    return 1;
+}
+
+// inflate_feed callback: the payload of consecutive IDAT chunks
+static size_t png_streamReadIDAT(void *ctx, uint8_t *dst, size_t n) {
+    struct png_stream *s = ctx;
+    size_t total = 0;
+
+    while (total < n && !s->idat_done) {
+        if (s->chunk_left == 0) {
+            if (!png_streamNextIDAT(s)) {
+                s->idat_done = 1;
+            }
+            continue;
+        }
+
+        size_t want = n - total;
+        if (want > s->chunk_left) want = s->chunk_left;
+        if (fread(dst + total, 1, want, s->fptr) != want) {
+            LOGE("Failed to read chunk data\n");
+            s->error = 1;
+            s->idat_done = 1;
+            break;
+        }
+        s->chunk_crc = update_crc(s->chunk_crc, dst + total, want);
+        s->chunk_left -= want;
+        total += want;
+    }
+    return total;
+}
+
+// Read chunks up to the first IDAT, leaving the file at its payload
+static int png_streamReadHeader(struct png_stream *s) {
+    struct png_fileSignature signature;
+    if (png_readFileSignature(s->fptr, &signature) != 1) {
+        return -1;
+    }
+    if (memcmp(signature.signature, png_signature, sizeof(png_signature)) != 0) {
+        LOGE("Not a PNG file\n");
+        return -1;
+    }
+
+    while (1) {
+        struct png_chunk *temp = realloc(s->chunks, (s->chunkCount + 1) * sizeof(struct png_chunk));
+        if (temp == NULL) {
+            LOGE("Failed to allocte memory for chunks\n");
+            return -1;
+        }
+        s->chunks = temp;
+
+        struct png_chunk *chunk = &s->chunks[s->chunkCount];
+        if (png_readChunkHeader(s->fptr, chunk) != 1) {
+            return -1;
+        }
+        if (strncmp(chunk->chunkType, "IDAT", 4) == 0) {
+            png_streamStartIDAT(s, chunk);
+            return 0;
+        }
+        if (strncmp(chunk->chunkType, "IEND", 4) == 0) {
+            LOGE("No IDAT chunk before IEND\n");
+            return -1;
+        }
+        if (png_readChunkBody(s->fptr, chunk) != 1) {
+            return -1;
+        }
+        s->chunkCount++;
+        png_printChunk(chunk, &s->image);
+    }
+}
+
+// png_refillFn: top up the input buffer from the file
+static void png_streamRefill(void *ctx, struct inflateState *inflate) {
+    inflate_feed(inflate, PNG_STREAM_INPUT_SIZE, png_streamReadIDAT, ctx);
+}
+
+static int png_streamReadZlibHeader(struct png_stream *s) {
+    uint32_t cmf, flg;
+    if (bitstream_read(&s->rows.inflate.bs, 8, &cmf) != 0 ||
+        bitstream_read(&s->rows.inflate.bs, 8, &flg) != 0) {
+        LOGE("Missing zlib header\n");
+        return -1;
+    }
+    if (((cmf << 8) | flg) % 31 != 0 || (cmf & 0x0F) != 8 || (flg & 0x20)) {
+        LOGE("Invalid zlib header\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct png_stream *png_streamOpen(const char *filename) {
+    struct png_stream *s = calloc(1, sizeof(struct png_stream));
+    if (s == NULL) {
+        LOGE("Failed to allocate PNG stream\n");
+        return NULL;
+    }
+
+    png_arenaInit(&s->arena, NULL);
+
+    if ((s->fptr = fopen(filename, "rb")) == NULL) {
+        LOGE("Failed to open file %s\n", filename);
+        free(s);
+        return NULL;
+    }
+
+    if (png_streamReadHeader(s) != 0) {
+        png_streamClose(s);
+        return NULL;
+    }
+
+    struct png_IHDR *ihdr = &s->image.ihdr;
+    if (png_checkDimensions(ihdr) != 0) {
+        png_streamClose(s);
+        return NULL;
+    }
+    if (ihdr->colorType == 3 && s->image.plte.length == 0) {
+        LOGE("Indexed image without a PLTE chunk\n");
+        png_streamClose(s);
+        return NULL;
+    }
+    if (ihdr->interlaceMethod != 0) {
+        LOGE("Interlaced images can't be streamed by row, use png_decodeInto\n");
+        png_streamClose(s);
+        return NULL;
+    }
+
+    s->width = ihdr->width;
+    s->height = ihdr->height;
+    s->format = png_defaultFormat(&s->image);
+    s->bpp = png_formatBpp(s->format);
+    if (ihdr->colorType == 3) {
+        png_expandPalette(&s->image, s->format);
+    }
+
+    s->input = malloc(PNG_STREAM_INPUT_SIZE);
+    if (s->input == NULL) {
+        LOGE("Failed to allocate PNG stream buffers\n");
+        png_streamClose(s);
+        return NULL;
+    }
+    if (png_rowsInit(&s->rows, ihdr, png_streamRefill, s, &s->arena) != 0) {
+        png_streamClose(s);
+        return NULL;
+    }
+
+    inflate_init(&s->rows.inflate, s->input, 0, 0);
+    png_streamRefill(s, &s->rows.inflate);
+    if (s->error || png_streamReadZlibHeader(s) != 0) {
+        png_streamClose(s);
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Decode up to rows scanlines into out, each width * bpp bytes.
+ * Returns the number of rows written, 0 once the image is done, -1 on error.
+ */
+int png_streamReadRows(struct png_stream *s, uint8_t *out, uint32_t rows) {
+    size_t out_stride = (size_t)s->width * s->bpp;
+    uint32_t done = 0;
+
+    while (done < rows && s->rows.row < s->height) {
+        const uint8_t *row = png_rowsNext(&s->rows);
+        if (row == NULL || s->error) {
+            return -1;
+        }
+        png_convertRow(&s->image, row, out + done * out_stride, s->width, s->format);
+        done++;
+
+        if (s->rows.row == s->height) {
+            png_rowsFinish(&s->rows);
+        }
+    }
+    return done;
+}
+
+void png_streamClose(struct png_stream *s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->fptr) {
+        fclose(s->fptr);
+    }
+    for (int i = 0; i < s->chunkCount; i++) {
+        free(s->chunks[i].chunkData);
+    }
+    free(s->chunks);
+    free(s->input);
+    png_arenaRelease(&s->arena);
+    free(s);
+}
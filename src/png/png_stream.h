@@ -0,0 +1,52 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "png.h"
+#include "png_rows.h"
+
+#define PNG_STREAM_INPUT_SIZE (64 * 1024)
+
+/*
+ * Pull-style PNG decoder. IDAT data is read from the file as inflate needs
+ * it and each scanline is unfiltered as soon as it is complete, so only the
+ * 32 KiB inflate window, the input buffer and two scanlines are resident
+ * regardless of image size.
+ *
+ *     struct png_stream *s = png_streamOpen("big.png");
+ *     uint8_t *rows = malloc(16 * s->width * s->bpp);
+ *     int n;
+ *     while ((n = png_streamReadRows(s, rows, 16)) > 0) { ... }
+ *     png_streamClose(s);
+ *
+ * Rows come out in the same layout as png_open: RGB, or RGBA when the image
+ * has a tRNS chunk.
+ */
+struct png_stream {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bpp;        // output bytes per pixel
+    enum png_format format;
+
+    FILE *fptr;
+    struct png_image image;
+    struct png_chunk *chunks;  // header chunks, PLTE/tRNS point into them
+    int chunkCount;
+
+    // IDAT input
+    uint8_t *input;
+    uint32_t chunk_left;       // unread bytes of the current IDAT chunk
+    uint32_t chunk_crc;        // running CRC of the current IDAT chunk
+    int idat_done;             // no IDAT data left in the file
+    int error;                 // I/O failure while reading IDAT
+
+    struct png_arena arena;    // row decoder buffers
+    struct png_rowDecoder rows;
+};
+
+struct png_stream *png_streamOpen(const char *filename);
+int png_streamReadRows(struct png_stream *s, uint8_t *out, uint32_t rows);
+void png_streamClose(struct png_stream *s);
+
+#endif  // PNG_STREAM_H
@@ -1,5 +1,8 @@
 #include "png_write.h"
 #include "png.h"
+#include "deflate.h"
+#include "adler32.h"
+#include "png_filter.h"
 #include "../crc/crc.h"
 #include "../display/display.h"
 #include "../log.h"
@@ -7,76 +10,168 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct huffmanCode fixed_huffman_code(uint16_t symbol) {
-    struct huffmanCode hc;
-    if (symbol <= 143) {
-        hc.code = 0b00110000 + (symbol - 0);
-        hc.length = 8;
-    } else if (symbol <= 255) {
-        hc.code = 0b110010000 + (symbol - 144);
-        hc.length = 9;
-    } else if (symbol <= 279) {
-        hc.code = 0b0000000 + (symbol - 256);
-        hc.length = 7;
-    } else if (symbol <= 287) {
-        hc.code = 0b11000000 + (symbol - 280);
-        hc.length = 8;
-    } else {
-        hc.code = 0;
-        hc.length = 0; // invalid
+// Filter one scanline; prev is the previous unfiltered row (zeros for the first)
+static void png_filterRow(uint8_t filter, const uint8_t *row, const uint8_t *prev,
+                          uint8_t *out, size_t len, int bpp) {
+    size_t i;
+    switch (filter) {
+        case 0: // None
+            memcpy(out, row, len);
+            break;
+        case 1: // Sub
+            for (i = 0; i < (size_t)bpp && i < len; i++) out[i] = row[i];
+            for (; i < len; i++) out[i] = row[i] - row[i - bpp];
+            break;
+        case 2: // Up
+            for (i = 0; i < len; i++) out[i] = row[i] - prev[i];
+            break;
+        case 3: // Average
+            for (i = 0; i < (size_t)bpp && i < len; i++) out[i] = row[i] - (prev[i] >> 1);
+            for (; i < len; i++) out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+            break;
+        case 4: // Paeth
+            for (i = 0; i < (size_t)bpp && i < len; i++) out[i] = row[i] - prev[i];
+            for (; i < len; i++) out[i] = row[i] - paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+            break;
+    }
+}
+
+// Minimum sum of absolute differences: residuals read as signed bytes
+static uint64_t png_filterCost(const uint8_t *out, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += abs((int8_t)out[i]);
+    }
+    return sum;
+}
+
+// Bytes per pixel for the 8-bit color types the encoder writes
+static int png_colorTypeBpp(uint8_t colorType) {
+    switch (colorType) {
+        case 0: return 1; // gray
+        case 4: return 2; // gray + alpha
+        case 2: return 3; // RGB
+        case 6: return 4; // RGBA
+        default: return 0;
     }
-    return hc;
 }
 
-void fixed_huffman(struct bitStream *bs, uint8_t *data, int size) {
-    for (int i = 0; i < size; i++) {
-        struct huffmanCode hc = fixed_huffman_code(data[i]);
-        hc.code = reverse_bits(hc.code, hc.length);
-        bitstream_write(bs, hc.length, hc.code);
+/*
+ * Filter every row into out (filter byte + filtered bytes per row) following
+ * options->filter: one fixed filter, the per-row minimum-sum-of-absolute-
+ * differences choice, or brute force trial compression of every candidate.
+ */
+int png_filterImage(struct png_image *image, uint8_t *out,
+                    const struct png_writeOptions *options) {
+    int bpp = png_colorTypeBpp(image->ihdr.colorType);
+    size_t row_bytes = (size_t)image->ihdr.width * bpp;
+    int strategy = options->filter;
+
+    uint8_t *zero_row = calloc(row_bytes, 1);
+    uint8_t *candidates = malloc(5 * row_bytes);
+    size_t trial_cap = deflate_bound(2 * (row_bytes + 1));
+    uint8_t *trial = NULL;
+    struct deflateState *state = NULL;
+    if (strategy == PNG_FILTER_BRUTE) {
+        // One match finder for every trial, reset per trial by deflate_compress_state
+        trial = malloc(trial_cap);
+        state = deflate_state_new();
     }
+    if (!zero_row || !candidates || (strategy == PNG_FILTER_BRUTE && (!trial || !state))) {
+        free(zero_row);
+        free(candidates);
+        free(trial);
+        deflate_state_free(state);
+        return -1;
+    }
+    int res = 0;
+    int trial_level = options->level > 0 ? options->level : 1;
+
+    for (uint32_t y = 0; y < image->ihdr.height && res == 0; y++) {
+        const uint8_t *row = image->pixels + y * row_bytes;
+        const uint8_t *prev = y > 0 ? row - row_bytes : zero_row;
+        uint8_t *dst = out + y * (row_bytes + 1);
+
+        if (strategy <= PNG_FILTER_PAETH) {
+            dst[0] = strategy;
+            png_filterRow(strategy, row, prev, dst + 1, row_bytes, bpp);
+            continue;
+        }
 
-    struct huffmanCode eob = fixed_huffman_code(256);
-    eob.code = reverse_bits(eob.code, eob.length);
-    bitstream_write(bs, eob.length, eob.code);
+        int best = 0;
+        uint64_t best_cost = UINT64_MAX;
+        for (int f = 0; f <= 4; f++) {
+            uint8_t *cand = candidates + f * row_bytes;
+            png_filterRow(f, row, prev, cand, row_bytes, bpp);
+
+            uint64_t cost;
+            if (strategy == PNG_FILTER_BRUTE) {
+                // Compress the candidate right after the previous filtered row
+                dst[0] = f;
+                memcpy(dst + 1, cand, row_bytes);
+                size_t dict_start = y > 0 ? (y - 1) * (row_bytes + 1) : 0;
+                size_t start = y * (row_bytes + 1);
+                struct bitStream bs;
+                bitstream_init(&bs, trial, trial_cap);
+                if (deflate_compress_state(state, out, dict_start, start, start + row_bytes + 1,
+                                           trial_level, &bs, 1) != 0) {
+                    LOGE("Trial compression of row %u failed\n", y);
+                    res = -1;
+                    break;
+                }
+                cost = bitstream_get_size(&bs);
+            } else {
+                cost = png_filterCost(cand, row_bytes);
+            }
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = f;
+            }
+        }
+        dst[0] = best;
+        memcpy(dst + 1, candidates + best * row_bytes, row_bytes);
+    }
 
-    // Flush to next byte
-    bitstream_flush(bs);
+    free(zero_row);
+    free(candidates);
+    free(trial);
+    deflate_state_free(state);
+    return res;
 }
 
-uint8_t *png_deflate(struct png_image *image, struct png_IDAT *idat, int *out_len) {
-    int bpp = 3;
-    int row_bytes = image->ihdr.width * bpp;
+uint8_t *png_deflate(struct png_image *image, struct png_IDAT *idat,
+                     const struct png_writeOptions *options, size_t *out_len) {
+    int level = options->level;
+    size_t row_bytes = (size_t)image->ihdr.width * png_colorTypeBpp(image->ihdr.colorType);
 
     // Prepare uncompressed data with filters
-    idat->data_length = (row_bytes + 1) * image->ihdr.height;
+    if (png_mulSize(row_bytes + 1, image->ihdr.height, &idat->data_length) != 0) {
+        LOGE("Image of %ux%u pixels is too big\n", image->ihdr.width, image->ihdr.height);
+        return NULL;
+    }
     idat->data = malloc(idat->data_length);
-
-    for (uint32_t i = 0; i < image->ihdr.height; i++) {
-        int row_start = i * (row_bytes + 1);
-        if (i == 0) {
-            idat->data[row_start] = 0; // None
-            for (int x = 0; x < row_bytes; x++)
-                idat->data[row_start + 1 + x] = image->pixels[x];
-        } else {
-            idat->data[row_start] = 1; // Sub
-            for (int x = 0; x < row_bytes; x++) {
-                uint8_t raw = image->pixels[i * row_bytes + x];
-                uint8_t left = (x >= bpp) ? image->pixels[i * row_bytes + x - bpp] : 0;
-                idat->data[row_start + 1 + x] = raw - left;
-            }
-        }
+    if (idat->data == NULL || png_filterImage(image, idat->data, options) != 0) {
+        LOGE("Failed to filter image\n");
+        free(idat->data);
+        return NULL;
     }
 
     // Allocate output buffer: safe overestimate
-    int max_out = idat->data_length + 6 + 5; // zlib header + worst-case compressed + adler
+    size_t max_out = deflate_bound(idat->data_length) + 2 + 4; // zlib header + worst-case compressed + adler
     uint8_t *out_buf = malloc(max_out);
-    struct bitStream bs = { .data = out_buf, .bitpos = 0, .length = max_out };
+    if (out_buf == NULL) {
+        LOGE("Failed to allocate %zu bytes for the compressed image\n", max_out);
+        free(idat->data);
+        return NULL;
+    }
+    struct bitStream bs;
+    bitstream_init(&bs, out_buf, max_out);
 
     // Zlib header
     idat->cm = 8;
-    idat->cinfo = 0;
+    idat->cinfo = 7; // 32K window
     idat->cmf = (idat->cinfo << 4) | idat->cm;
-    idat->flevel = 2;
+    idat->flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
     idat->fdict = 0;
     idat->fcheck = 31 - ((idat->cmf << 8 | (idat->flevel << 1) | idat->fdict)) % 31;
     idat->flg = (idat->flevel << 1 | idat->fdict) << 5 | idat->fcheck;
@@ -86,24 +181,31 @@ uint8_t *png_deflate(struct png_image *image, struct png_IDAT *idat, int *out_le
     bitstream_write(&bs, 5, idat->fcheck);
     bitstream_write(&bs, 1, idat->fdict);
     bitstream_write(&bs, 2, idat->flevel);
-    bitstream_write(&bs, 1, 1); // BFINAL
-    bitstream_write(&bs, 2, 1); // BTYPE fixed Huffman
-
-    fixed_huffman(&bs, idat->data, idat->data_length);
 
-    // Adler32
-    uint32_t a = 1, b = 0;
-    for (size_t i = 0; i < idat->data_length; i++) {
-        a = (a + idat->data[i]) % 65521;
-        b = (b + a) % 65521;
+    int res;
+    uint32_t adler;
+    if (options->threads > 1 && idat->data_length > DEFLATE_SEGMENT_MIN) {
+        res = deflate_compress_parallel(idat->data, idat->data_length, level,
+                                        options->threads, &bs, &adler);
+    } else {
+        res = deflate_compress(idat->data, idat->data_length, level, &bs);
+        adler = adler32_update(1, idat->data, idat->data_length);
     }
     free(idat->data);
-    uint32_t adler32 = __builtin_bswap32((b << 16) | a);
-    bitstream_write(&bs, 32, adler32);
+    if (res != 0) {
+        LOGE("Deflate failed\n");
+        free(out_buf);
+        return NULL;
+    }
+    bitstream_flush(&bs);
+
+    // Adler32
+    idat->adler32 = adler;
+    bitstream_write(&bs, 32, __builtin_bswap32(adler));
+    bitstream_flush(&bs);
 
     // Exact length of compressed chunk
-    int final_len = (bs.bitpos + 7) / 8;
-    *out_len = final_len;
+    *out_len = bitstream_get_size(&bs);
 
     return out_buf;
 }
@@ -131,28 +233,50 @@ uint8_t *serialize_ihdr(const struct png_IHDR *ihdr) {
 
 void write_chunk(FILE *fptr, struct png_chunk *chunk) {
     uint32_t chunkLength = __builtin_bswap32(chunk->length);
-    uint32_t totalChunkSize = sizeof(chunk->length) + sizeof(chunk->chunkType) + chunk->length + sizeof(chunk->crc);
-    uint8_t *buff = malloc(totalChunkSize);
-
-    size_t off = 0;
-    memcpy(buff + off, &chunkLength, sizeof(chunk->length)); off += sizeof(chunk->length);
-    memcpy(buff + off, chunk->chunkType, sizeof(chunk->chunkType)); off += sizeof(chunk->chunkType);
+    uint8_t *data = chunk->chunkData;
+    uint8_t *serializedData = NULL;
 
     if (memcmp(chunk->chunkType, "IHDR", 4) == 0) {
-        uint8_t *serializedData = serialize_ihdr((struct png_IHDR *)chunk->chunkData);
-        memcpy(buff + off, serializedData, chunk->length); off += chunk->length;
-        free(serializedData);
-    } else {
-        memcpy(buff + off, chunk->chunkData, chunk->length); off += chunk->length;
+        serializedData = serialize_ihdr((struct png_IHDR *)chunk->chunkData);
+        data = serializedData;
     }
-    uint32_t crc_val = __builtin_bswap32(crc(buff + sizeof(chunk->length), sizeof(chunk->chunkType) + chunk->length));
-    memcpy(buff + off, &crc_val, sizeof(chunk->crc));
 
-    fwrite(buff, totalChunkSize, 1, fptr);
-    free(buff);
+    // CRC type and data in place instead of joining them into one buffer
+    uint32_t crc_val = update_crc(0xffffffffL, (unsigned char *)chunk->chunkType,
+                                  sizeof(chunk->chunkType));
+    crc_val = __builtin_bswap32(update_crc(crc_val, data, chunk->length) ^ 0xffffffffL);
+
+    fwrite(&chunkLength, sizeof(chunk->length), 1, fptr);
+    fwrite(chunk->chunkType, sizeof(chunk->chunkType), 1, fptr);
+    if (chunk->length > 0) {
+        fwrite(data, chunk->length, 1, fptr);
+    }
+    fwrite(&crc_val, sizeof(chunk->crc), 1, fptr);
+    free(serializedData);
 }
 
-int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, uint8_t bpp) {
+int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, uint8_t bpp,
+             const struct png_writeOptions *options) {
+    struct png_writeOptions defaults = {
+        .level = DEFLATE_DEFAULT_LEVEL,
+        .threads = 1,
+        .filter = PNG_FILTER_ADAPTIVE,
+    };
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    uint8_t colorType;
+    switch (bpp) {
+        case 1: colorType = 0; break;
+        case 2: colorType = 4; break;
+        case 3: colorType = 2; break;
+        case 4: colorType = 6; break;
+        default:
+            LOGE("Unsupported bytes per pixel %u\n", bpp);
+            return -1;
+    }
+
     FILE *fptr;
     if ((fptr = fopen(filename, "wb")) == NULL) {
         LOGE("Failed to open file %s for writing\n", filename);
@@ -167,7 +291,7 @@ int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, ui
         .width = width,
         .height = height,
         .bitDepth = 8,
-        .colorType = 2,
+        .colorType = colorType,
         .compressionMethod = 0,
         .filterMethod = 0,
         .interlaceMethod = 0,
@@ -187,8 +311,19 @@ int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, ui
 
     struct png_IDAT idat;
 
-    int idat_len;
-    uint8_t *compressed = png_deflate(&image, &idat, &idat_len);
+    size_t idat_len;
+    uint8_t *compressed = png_deflate(&image, &idat, options, &idat_len);
+    if (compressed == NULL) {
+        fclose(fptr);
+        return -1;
+    }
+    // Written as a single IDAT, whose length field stops at 2^31 - 1
+    if (idat_len > 0x7FFFFFFF) {
+        LOGE("Compressed image of %zu bytes doesn't fit in one IDAT chunk\n", idat_len);
+        free(compressed);
+        fclose(fptr);
+        return -1;
+    }
 
     struct png_chunk idat_chunk = {
         .length = idat_len,
@@ -4,12 +4,32 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "../image_common.h"
+#include "deflate.h"
 
-struct huffmanCode {
-    uint16_t code; // the bit pattern
-    uint8_t length; // number of bits
+// Per-row filter choice: a fixed PNG filter type (0-4) or a selection heuristic
+enum png_filterStrategy {
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVERAGE = 3,
+    PNG_FILTER_PAETH = 4,
+    PNG_FILTER_ADAPTIVE, // minimum sum of absolute differences per row
+    PNG_FILTER_BRUTE,    // trial-compress every filter per row
 };
 
-int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, uint8_t bpp);
+struct png_writeOptions {
+    int level;   // DEFLATE compression level, 0 (fastest) to 9 (smallest)
+    int threads; // worker threads for compression, 1 = single-threaded
+    int filter;  // enum png_filterStrategy
+};
+
+struct png_image;
+
+// Filter 8-bit image->pixels into out, (width * bpp + 1) bytes per row
+int png_filterImage(struct png_image *image, uint8_t *out,
+                    const struct png_writeOptions *options);
+// options may be NULL for the defaults
+int png_save(char filename[], uint8_t *data, uint32_t width, uint32_t height, uint8_t bpp,
+             const struct png_writeOptions *options);
 
 #endif  // PNG_WRITE_H